@@ -36,10 +36,14 @@
 
 
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <limits.h>
 #include <ctype.h>
 #include <string.h>
 #include <stdio.h>
@@ -50,7 +54,24 @@
 #include <syslog.h>
 #include <errno.h>
 #include <regex.h>
+#include <dlfcn.h>
 #include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <arpa/inet.h>
 
 //TODO// Transition lco_first/_next to UT_hash iteration?
 #include "uthash.h"
@@ -72,12 +93,48 @@ static void debug (char *fmt, ...) {
 	fflush (stderr);
 }
 #else
-static inline debug (char *fmt, ...) {
-	;
+static inline void debug (char *fmt, ...) {
+	(void) fmt;
 }
 #endif
 
 
+/* Static tracepoints for bpftrace and perf, compiled in with USDT.
+ * They are a nop instruction until a tracer attaches, so unlike debug()
+ * they can stay in production builds.  The arguments are pointers and
+ * values at hand; times are CLOCK_MONOTONIC nanoseconds, like the nsecs
+ * of bpftrace, or durations in nanoseconds.  Strings are NUL-terminated.
+ *
+ *  - txn_open (lce, wait_ns) when a transaction has locked the lcenv;
+ *  - txn_done (lce, held_since) and txn_break (lce, held_since) just
+ *    before a transaction unlocks it;
+ *  - fork_accept (lce, add_not_del, dn, lcs) and fork_reject (...)
+ *    for every fork passed to pulleyback_add() or pulleyback_del();
+ *  - event_advance (dn, lcs, ofs_next) when a '?' event moves past;
+ *  - dispatch (lifecycle, dn, lcs, attempt, lag_ns) when an lcstate is
+ *    passed to a driver;
+ *  - service_sleep (lce, timeout_ms) before the service thread waits;
+ *  - service_wake (lce, events) after it has locked the lcenv again.
+ *
+ * For example, to see how late dispatches are per lifecycle:
+ *
+ *	bpftrace -e 'usdt:./libpulleyback_lifecycle.so:lifecycle:dispatch
+ *		{ @lag_ms [str (arg0)] = hist (arg4 / 1000000); }'
+ */
+#ifdef USDT
+#include <sys/sdt.h>
+#define PROBE2(name,a,b)		DTRACE_PROBE2 (lifecycle, name, a, b)
+#define PROBE3(name,a,b,c)		DTRACE_PROBE3 (lifecycle, name, a, b, c)
+#define PROBE4(name,a,b,c,d)		DTRACE_PROBE4 (lifecycle, name, a, b, c, d)
+#define PROBE5(name,a,b,c,d,e)		DTRACE_PROBE5 (lifecycle, name, a, b, c, d, e)
+#else
+#define PROBE2(name,a,b)		do { (void) (a); (void) (b); } while (0)
+#define PROBE3(name,a,b,c)		do { (void) (a); (void) (b); (void) (c); } while (0)
+#define PROBE4(name,a,b,c,d)		do { (void) (a); (void) (b); (void) (c); (void) (d); } while (0)
+#define PROBE5(name,a,b,c,d,e)		do { (void) (a); (void) (b); (void) (c); (void) (d); (void) (e); } while (0)
+#endif
+
+
 /* External Dependencies:
  *
  * We use "uthash.h" for quickly locating a distinguishedName, which may
@@ -131,18 +188,6 @@ char find_type (char *next) {
 }
 
 
-/* Locally implement the non-standard function strchrnul() that is like
- * strchr() except that it will return a pointer to the NUL character
- * at the string's end when it finds no occurrence.
- */
-char *strchrnul (char *s, int c) {
-	while ((*s != '\0') && (*s != c)) {
-		s++;
-	}
-	return s;
-}
-
-
 /* Compare a NUL-terminated ASCII string with a (ptr,len) memory region
  * that is also ASCII-compliant and lacks internal NUL characters.
  */
@@ -167,12 +212,12 @@ bool parse_der (uint8_t *der, char **ptr, size_t *len) {
 		if ((lenlen < 1) || (lenlen > 2)) {
 			return false;
 		}
-		*len = der [0];
+		*len = der [1];
 		if (lenlen == 2) {
-			*len = ((*len) << 8) | der [1];
-			*ptr = (char *) (der + 2);
+			*len = ((*len) << 8) | der [2];
+			*ptr = (char *) (der + 3);
 		} else {
-			*ptr = (char *) (der + 1);
+			*ptr = (char *) (der + 2);
 		}
 	} else {
 		*len = *der;
@@ -235,6 +280,202 @@ bool grammar_dn (char *dn) {
 
 
 
+/********** CLOCKS **********/
+
+
+
+/* Return the monotonic time in nanoseconds, for timing short intervals.
+ */
+uint64_t monotime_ns (void) {
+	struct timespec mono;
+	assert (0 == clock_gettime (CLOCK_MONOTONIC, &mono));
+	return mono.tv_sec * (uint64_t) 1000000000 + mono.tv_nsec;
+}
+
+
+/* Return the wall clock time in nanoseconds.
+ */
+uint64_t realtime_ns (void) {
+	struct timespec real;
+	assert (0 == clock_gettime (CLOCK_REALTIME, &real));
+	return real.tv_sec * (uint64_t) 1000000000 + real.tv_nsec;
+}
+
+
+/* The system clock.  Waits are rounded up to whole milliseconds, so the
+ * service thread does not wake up just before a timer is due.
+ */
+static uint64_t clock_system_realtime (struct lifecycle_clock *clk) {
+	(void) clk;
+	return realtime_ns ();
+}
+//
+static uint64_t clock_system_monotime (struct lifecycle_clock *clk) {
+	(void) clk;
+	return monotime_ns ();
+}
+//
+static int clock_system_timeout (struct lifecycle_clock *clk, uint64_t deadline_ns) {
+	(void) clk;
+	uint64_t now = realtime_ns ();
+	if (deadline_ns <= now) {
+		return 0;
+	}
+	uint64_t ms = (deadline_ns - now + 999999) / 1000000;
+	return (ms < INT_MAX) ? (int) ms : INT_MAX;
+}
+//
+struct lifecycle_clock lifecycle_clock_system = {
+	clock_system_realtime,
+	clock_system_monotime,
+	clock_system_timeout
+};
+
+
+/* The simulated clock.  Its time is only changed atomically, because
+ * it is read by the service threads while it is being advanced.  The
+ * wall clock adds up two of those, which may be seen in either order
+ * when they are changed from different threads at the same time.
+ */
+static uint64_t clock_sim_monotime (struct lifecycle_clock *clk) {
+	struct lifecycle_clock_sim *sim = (struct lifecycle_clock_sim *) clk;
+	return __atomic_load_n (&sim->sim_ns, __ATOMIC_ACQUIRE);
+}
+//
+static uint64_t clock_sim_realtime (struct lifecycle_clock *clk) {
+	struct lifecycle_clock_sim *sim = (struct lifecycle_clock_sim *) clk;
+	return __atomic_load_n (&sim->sim_ns,  __ATOMIC_ACQUIRE) +
+	       __atomic_load_n (&sim->jump_ns, __ATOMIC_ACQUIRE);
+}
+//
+static int clock_sim_timeout (struct lifecycle_clock *clk, uint64_t deadline_ns) {
+	return (deadline_ns <= clock_sim_realtime (clk)) ? 0 : -1;
+}
+//
+void lifecycle_clock_sim_init (struct lifecycle_clock_sim *sim, time_t start) {
+	sim->clk.realtime_ns = clock_sim_realtime;
+	sim->clk.monotime_ns = clock_sim_monotime;
+	sim->clk.timeout_ms  = clock_sim_timeout;
+	__atomic_store_n (&sim->jump_ns, 0, __ATOMIC_RELEASE);
+	__atomic_store_n (&sim->sim_ns, start * (uint64_t) 1000000000, __ATOMIC_RELEASE);
+}
+//
+void lifecycle_clock_sim_advance (struct lifecycle_clock_sim *sim, uint64_t ns) {
+	__atomic_add_fetch (&sim->sim_ns, ns, __ATOMIC_ACQ_REL);
+}
+//
+void lifecycle_clock_sim_jump (struct lifecycle_clock_sim *sim, int64_t ns) {
+	__atomic_add_fetch (&sim->jump_ns, (uint64_t) ns, __ATOMIC_ACQ_REL);
+}
+
+
+/* The clock for lcenv structures that are allocated next.
+ */
+static struct lifecycle_clock *clock_default = &lifecycle_clock_system;
+//
+void lifecycle_clock_use (struct lifecycle_clock *clk) {
+	clock_default = (clk != NULL) ? clk : &lifecycle_clock_system;
+}
+
+
+/* Return the wall clock time of an lcenv in seconds, as used for timers.
+ */
+time_t clock_now (struct lcenv *lce) {
+	return lce->lce_clock->realtime_ns (lce->lce_clock) / 1000000000;
+}
+
+
+/* Return the monotonic time of an lcenv in seconds.  This is not related
+ * to the wall clock, but it can be compared to detect jumps in it.
+ */
+time_t clock_mono (struct lcenv *lce) {
+	return lce->lce_clock->monotime_ns (lce->lce_clock) / 1000000000;
+}
+
+
+
+/********** LOCKING AND STATISTICS **********/
+
+
+
+/* Find the bucket of a histogram for a value.  Small values have their
+ * own bucket, larger ones are split by their highest bit, and then by
+ * the LIFECYCLE_HIST_SUBBITS bits below it.
+ */
+static unsigned hist_bucket (uint64_t value) {
+	const unsigned sub = 1 << LIFECYCLE_HIST_SUBBITS;
+	if (value < sub) {
+		return value;
+	}
+	unsigned top = 63 - __builtin_clzll (value);
+	unsigned low = (value >> (top - LIFECYCLE_HIST_SUBBITS)) & (sub - 1);
+	return ((top - LIFECYCLE_HIST_SUBBITS + 1) << LIFECYCLE_HIST_SUBBITS) + low;
+}
+
+/* Return the highest value that falls into a bucket of a histogram.
+ */
+static uint64_t hist_bucket_top (unsigned bucket) {
+	const unsigned sub = 1 << LIFECYCLE_HIST_SUBBITS;
+	if (bucket < sub) {
+		return bucket;
+	}
+	unsigned top = (bucket >> LIFECYCLE_HIST_SUBBITS) + LIFECYCLE_HIST_SUBBITS - 1;
+	uint64_t low = (sub + (bucket & (sub - 1))) << (top - LIFECYCLE_HIST_SUBBITS);
+	return low + (((uint64_t) 1) << (top - LIFECYCLE_HIST_SUBBITS)) - 1;
+}
+
+/* Record a value in a histogram, like other stats.
+ */
+void hist_record (struct lifecycle_histogram *hst, uint64_t value) {
+	STAT_ADD (hst->buckets [hist_bucket (value)], 1);
+	STAT_ADD (hst->count, 1);
+	if (value > hst->max) {
+		STAT_SET (hst->max, value);
+	}
+}
+
+
+/* Acquire and release pth_envown of an lcenv, while timing how long it
+ * took to get it and how long it was held.  The times are written after
+ * the lock is acquired, and before it is released, like other stats.
+ * They are attributed to the code path that takes the lock, and a
+ * failing trylock tells that this path had to contend for it.
+ * The time waited is returned in nanoseconds.
+ */
+uint64_t envown_lock (struct lcenv *lce, enum lifecycle_lock_path path) {
+	uint64_t start = monotime_ns ();
+	bool contended = (pthread_mutex_trylock (&lce->pth_envown) != 0);
+	if (contended) {
+		assert (!pthread_mutex_lock (&lce->pth_envown));
+	}
+	lce->tim_envheld = monotime_ns ();
+	lce->lck_path = path;
+	uint64_t waited = lce->tim_envheld - start;
+	struct lifecycle_lock_stats *lks = &lce->lck_stats [path];
+	STAT_ADD (lks->acquired, 1);
+	STAT_ADD (lks->contended, contended ? 1 : 0);
+	STAT_ADD (lks->wait_ns, waited);
+	if (waited > lks->wait_max_ns) {
+		STAT_SET (lks->wait_max_ns, waited);
+	}
+	STAT_ADD (lce->lce_stats.envown_acquired, 1);
+	STAT_ADD (lce->lce_stats.envown_wait_ns, waited);
+	return waited;
+}
+//
+void envown_unlock (struct lcenv *lce) {
+	uint64_t held = monotime_ns () - lce->tim_envheld;
+	struct lifecycle_lock_stats *lks = &lce->lck_stats [lce->lck_path];
+	STAT_ADD (lks->hold_ns, held);
+	if (held > lks->hold_max_ns) {
+		STAT_SET (lks->hold_max_ns, held);
+	}
+	STAT_ADD (lce->lce_stats.envown_hold_ns, held);
+	assert (!pthread_mutex_unlock (&lce->pth_envown));
+}
+
+
+
 /********** ALLOCATION AND FREEING **********/
 
 
@@ -307,6 +548,11 @@ void debug_lcstate (struct lcstate *lcs, char *what_to_do) {
 	debug (" | +-----> lifecycleState%s: %s", what_to_do, lcs->txt_attr);
 	debug (" | |       ofs_next=%d tim_next=%d cnt_missed=%d", lcs->ofs_next, lcs->tim_next, lcs->cnt_missed);
 }
+#else
+void debug_lcstate (struct lcstate *lcs, char *what_to_do) {
+	(void) lcs;
+	(void) what_to_do;
+}
 #endif
 
 
@@ -382,6 +628,10 @@ void debug_lcobject (struct lcobject *lco) {
 		lcs = lcs->lcs_next;
 	}
 }
+#else
+void debug_lcobject (struct lcobject *lco) {
+	(void) lco;
+}
 #endif
 
 
@@ -430,8 +680,9 @@ bool smudged_lcobject_firetime (struct lcobject *lco) {
 
 
 /* When the next event is '@' or '=' type, test when it may fire.
+ * Timers without a timestamp fire at the current time, given as now.
  */
-time_t update_lcstate_firetime (struct lcstate *lcs) {
+time_t update_lcstate_firetime (struct lcstate *lcs, time_t now) {
 	time_t update = MAX_TIME_T;
 	if (lcs->typ_next != '@') {
 		goto done;
@@ -443,12 +694,12 @@ time_t update_lcstate_firetime (struct lcstate *lcs) {
 	timestr++;
 	if (!isdigit (*timestr)) {
 		// '=' or ' ' or '\0', but not a timestamp
-		update = time (NULL);
+		update = now;
 		goto done;
 	}
 	unsigned long stamp = strtoul (timestr, &timestr, 10);
 	if (stamp == 0) {
-		update = time (NULL);
+		update = now;
 		goto done;
 	}
 	if (stamp != (unsigned long) (time_t) stamp) {
@@ -467,12 +718,12 @@ done:
  * This involves recalculation of the tim_first value, which signals
  * dirty status .
  */
-void update_lcobject_firetime (struct lcobject *lco) {
+void update_lcobject_firetime (struct lcobject *lco, time_t now) {
 	lco->tim_first = MAX_TIME_T;
 	struct lcstate *lcs = lco->lcs_first;
 	while (lcs != NULL) {
 		if (smudged_lcstate_firetime (lcs)) {
-			update_lcstate_firetime (lcs);
+			update_lcstate_firetime (lcs, now);
 		}
 		assert (lcs->tim_next != 0);
 		if (lcs->tim_next < lco->tim_first) {
@@ -484,6 +735,325 @@ void update_lcobject_firetime (struct lcobject *lco) {
 
 
 
+/* After an lcstate fired, it will fire again until LDAP replaces it with
+ * a more advanced lifecycleState.  Until then, the retries are spaced out
+ * with exponential fallback, counted in cnt_missed.  The counting is done
+ * when firing, the spacing when it is clear that a retry is needed.
+ */
+#define RETRY_MAXSHIFT 12
+void count_lcstate_firing (struct lcstate *lcs) {
+	if (lcs->cnt_missed < UINT8_MAX) {
+		lcs->cnt_missed++;
+	}
+}
+//
+void backoff_lcstate_firetime (struct lcstate *lcs, time_t now) {
+	uint8_t shift = (lcs->cnt_missed > 0) ? (lcs->cnt_missed - 1) : 0;
+	if (shift > RETRY_MAXSHIFT) {
+		shift = RETRY_MAXSHIFT;
+	}
+	lcs->tim_next = now + (((time_t) 1) << shift);
+}
+
+
+
+/********** TIMER SCHEDULE **********/
+
+
+
+/* The cold tier and the late tier are binary heaps in an array, ordered
+ * on tim_heap.  Every move of an entry updates the idx_heap in its
+ * lcobject, so that it can be removed when it is smudged or freed.
+ */
+static void heap_place (struct lcheap *hea, uint32_t idx, struct lcheapent *ent) {
+	hea->ary_heap [idx] = *ent;
+	ent->lco_heap->idx_heap = idx;
+}
+
+static void heap_siftup (struct lcheap *hea, uint32_t idx) {
+	struct lcheapent ent = hea->ary_heap [idx];
+	while (idx > 0) {
+		uint32_t up = (idx - 1) / 2;
+		if (hea->ary_heap [up].tim_heap <= ent.tim_heap) {
+			break;
+		}
+		heap_place (hea, idx, &hea->ary_heap [up]);
+		idx = up;
+	}
+	heap_place (hea, idx, &ent);
+}
+
+static void heap_siftdown (struct lcheap *hea, uint32_t idx) {
+	struct lcheapent ent = hea->ary_heap [idx];
+	while (true) {
+		uint32_t down = 2 * idx + 1;
+		if (down >= hea->cnt_heap) {
+			break;
+		}
+		if ((down + 1 < hea->cnt_heap) && (hea->ary_heap [down + 1].tim_heap < hea->ary_heap [down].tim_heap)) {
+			down++;
+		}
+		if (ent.tim_heap <= hea->ary_heap [down].tim_heap) {
+			break;
+		}
+		heap_place (hea, idx, &hea->ary_heap [down]);
+		idx = down;
+	}
+	heap_place (hea, idx, &ent);
+}
+
+static void heap_insert (struct lcheap *hea, struct lcobject *lco, uint8_t tier) {
+	if (hea->cnt_heap >= hea->max_heap) {
+		uint32_t newmax = (hea->max_heap == 0) ? 1024 : (2 * hea->max_heap);
+		struct lcheapent *newary = realloc (hea->ary_heap, newmax * sizeof (struct lcheapent));
+		if (newary == NULL) {
+			syslog (LOG_CRIT, "FATAL: Failed to allocate timer heap for %d entries", newmax);
+			exit (1);
+		}
+		hea->ary_heap = newary;
+		hea->max_heap = newmax;
+	}
+	uint32_t idx = hea->cnt_heap++;
+	hea->ary_heap [idx].tim_heap = lco->tim_first;
+	hea->ary_heap [idx].lco_heap = lco;
+	lco->sch_tier = tier;
+	heap_siftup (hea, idx);
+}
+
+static void heap_remove (struct lcheap *hea, struct lcobject *lco) {
+	uint32_t idx = lco->idx_heap;
+	assert ((idx < hea->cnt_heap) && (hea->ary_heap [idx].lco_heap == lco));
+	hea->cnt_heap--;
+	if (idx < hea->cnt_heap) {
+		struct lcobject *moved = hea->ary_heap [hea->cnt_heap].lco_heap;
+		heap_place (hea, idx, &hea->ary_heap [hea->cnt_heap]);
+		heap_siftup   (hea, idx);
+		heap_siftdown (hea, moved->idx_heap);
+	}
+	lco->sch_tier = SCHED_NONE;
+}
+
+static struct lcobject *heap_top (struct lcheap *hea) {
+	return (hea->cnt_heap > 0) ? hea->ary_heap [0].lco_heap : NULL;
+}
+
+static void heap_fini (struct lcheap *hea) {
+	free (hea->ary_heap);
+	memset (hea, 0, sizeof (*hea));
+}
+
+
+/* Insert an lcobject at the head of a calendar slot or the dirty list,
+ * or take it out of there again.
+ */
+static void sched_list_insert (struct lcobject **phead, struct lcobject *lco) {
+	lco->lco_schnext = *phead;
+	if (*phead != NULL) {
+		(*phead)->lco_schprev = &lco->lco_schnext;
+	}
+	lco->lco_schprev = phead;
+	*phead = lco;
+}
+
+static void sched_list_remove (struct lcobject *lco) {
+	*lco->lco_schprev = lco->lco_schnext;
+	if (lco->lco_schnext != NULL) {
+		lco->lco_schnext->lco_schprev = lco->lco_schprev;
+	}
+	lco->lco_schnext = NULL;
+	lco->lco_schprev = NULL;
+}
+
+
+/* Find the calendar slot for a given time in the hot tier.
+ * Overdue timers are collected in the cursor slot.
+ */
+static uint32_t sched_slot (struct lcsched *sch, time_t tim) {
+	if (tim <= sch->sch_base) {
+		return sch->sch_cursor;
+	}
+	return (sch->sch_cursor + (tim - sch->sch_base) / SCHED_SLOTSECS) % SCHED_SLOTS;
+}
+
+
+/* Take an lcobject out of the timer schedule, wherever it is filed.
+ * This must be done before an lcobject is freed.
+ */
+void sched_unlink (struct lcenv *lce, struct lcobject *lco) {
+	struct lcsched *sch = &lce->sch_timers;
+	switch (lco->sch_tier) {
+	case SCHED_HOT:
+		sch->cnt_hot--;
+		sched_list_remove (lco);
+		break;
+	case SCHED_DIRTY:
+		sched_list_remove (lco);
+		break;
+	case SCHED_COLD:
+		heap_remove (&sch->hea_cold, lco);
+		break;
+	case SCHED_LATE:
+		heap_remove (&sch->hea_late, lco);
+		break;
+	default:
+		break;
+	}
+	lco->sch_tier = SCHED_NONE;
+}
+
+
+/* Mark an lcobject as dirty for the service thread, by moving it to
+ * the dirty list.  This is done at the end of a transaction for any
+ * lcobject whose firing time was smudged.
+ */
+void sched_dirty (struct lcenv *lce, struct lcobject *lco) {
+	if (lco->sch_tier == SCHED_DIRTY) {
+		return;
+	}
+	sched_unlink (lce, lco);
+	sched_list_insert (&lce->sch_timers.lco_dirty, lco);
+	lco->sch_tier = SCHED_DIRTY;
+}
+
+
+/* File an lcobject with an updated tim_first into the hot or cold tier.
+ * When it has no timer at all, it is not filed.
+ */
+void sched_file (struct lcenv *lce, struct lcobject *lco) {
+	struct lcsched *sch = &lce->sch_timers;
+	assert (!smudged_lcobject_firetime (lco));
+	sched_unlink (lce, lco);
+	if (lco->tim_first == MAX_TIME_T) {
+		return;
+	}
+	if (lco->tim_first - sch->sch_base < SCHED_HORIZON) {
+		sched_list_insert (&sch->lco_slots [sched_slot (sch, lco->tim_first)], lco);
+		lco->sch_tier = SCHED_HOT;
+		sch->cnt_hot++;
+	} else {
+		heap_insert (&sch->hea_cold, lco, SCHED_COLD);
+	}
+}
+
+
+/* Move lcobjects from the cold tier into the hot tier, inasfar as their
+ * time has come within the horizon.
+ */
+static void sched_promote (struct lcenv *lce) {
+	struct lcsched *sch = &lce->sch_timers;
+	while ((sch->hea_cold.cnt_heap > 0) &&
+			(sch->hea_cold.ary_heap [0].tim_heap - sch->sch_base < SCHED_HORIZON)) {
+		sched_file (lce, heap_top (&sch->hea_cold));
+	}
+}
+
+
+/* Initialise the timer schedule to start at the given time.
+ */
+void sched_init (struct lcenv *lce, time_t now) {
+	struct lcsched *sch = &lce->sch_timers;
+	sch->sch_base = now - (now % SCHED_SLOTSECS);
+	sch->sch_cursor = 0;
+	sch->tim_lastreal = now;
+	sch->tim_lastmono = clock_mono (lce);
+}
+
+
+/* Cleanup the timer schedule.  This is only done when the lcobjects
+ * are about to be freed, so they need not be unlinked one by one.
+ */
+void sched_fini (struct lcenv *lce) {
+	struct lcsched *sch = &lce->sch_timers;
+	heap_fini (&sch->hea_cold);
+	heap_fini (&sch->hea_late);
+	memset (sch, 0, sizeof (*sch));
+}
+
+
+/* Move the cursor of the calendar forward until its slot covers now.
+ * Anything left behind in a passed slot is overdue, and is collected
+ * into the new cursor slot.  When the hot tier holds nothing else, the
+ * cursor can jump ahead at once, which helps after long idle periods.
+ * Cold timers are promoted as the horizon moves forward.
+ */
+void sched_advance (struct lcenv *lce, time_t now) {
+	struct lcsched *sch = &lce->sch_timers;
+	struct lcobject *late = NULL;
+	uint32_t cnt_late = 0;
+	while (now - sch->sch_base >= SCHED_SLOTSECS) {
+		if (sch->cnt_hot == cnt_late) {
+			sch->sch_base = now - (now % SCHED_SLOTSECS);
+		} else {
+			struct lcobject *left = sch->lco_slots [sch->sch_cursor];
+			sch->lco_slots [sch->sch_cursor] = NULL;
+			while (left != NULL) {
+				struct lcobject *lco = left;
+				left = lco->lco_schnext;
+				sched_list_insert (&late, lco);
+				cnt_late++;
+			}
+			sch->sch_cursor = (sch->sch_cursor + 1) % SCHED_SLOTS;
+			sch->sch_base += SCHED_SLOTSECS;
+		}
+		sched_promote (lce);
+	}
+	while (late != NULL) {
+		struct lcobject *lco = late;
+		late = lco->lco_schnext;
+		sched_list_insert (&sch->lco_slots [sch->sch_cursor], lco);
+	}
+}
+
+
+/* Return the first time at which the schedule has a timer to expire,
+ * or MAX_TIME_T if there is none.  The first non-empty slot in the hot
+ * tier holds it, or else the top of the cold tier.  During catch-up,
+ * the next catch-up round may come sooner.
+ */
+time_t sched_first (struct lcenv *lce) {
+	struct lcsched *sch = &lce->sch_timers;
+	time_t first = MAX_TIME_T;
+	if (sch->cnt_hot > 0) {
+		uint32_t slot = sch->sch_cursor;
+		while (sch->lco_slots [slot] == NULL) {
+			slot = (slot + 1) % SCHED_SLOTS;
+		}
+		struct lcobject *lco = sch->lco_slots [slot];
+		while (lco != NULL) {
+			if (lco->tim_first < first) {
+				first = lco->tim_first;
+			}
+			lco = lco->lco_schnext;
+		}
+	} else if (sch->hea_cold.cnt_heap > 0) {
+		first = sch->hea_cold.ary_heap [0].tim_heap;
+	}
+	if ((sch->tim_catchup != 0) && (sch->tim_catchup < first)) {
+		first = sch->tim_catchup;
+	}
+	return first;
+}
+
+
+/* Count the lcobjects that are due but have not fired, after a round
+ * of firing.  They wait in the late tier during catch-up, or they are
+ * left in the cursor slot when their firing was put off.
+ */
+uint64_t sched_backlog (struct lcenv *lce, time_t now) {
+	struct lcsched *sch = &lce->sch_timers;
+	uint64_t backlog = sch->hea_late.cnt_heap;
+	struct lcobject *lco = sch->lco_slots [sch->sch_cursor];
+	while (lco != NULL) {
+		if (lco->tim_first <= now) {
+			backlog++;
+		}
+		lco = lco->lco_schnext;
+	}
+	return backlog;
+}
+
+
+
 /********** EVENT EXCHANGE **********/
 
 
@@ -503,16 +1073,16 @@ bool advance_lcstate_events (struct lcstate *lcs, struct lcobject *lco) {
 	while (didsth) {
 		didsth = false;
 		if (lcs->typ_next != '?') {
-			return false;
+			break;
 		}
 		char *src = lcs->txt_attr + lcs->ofs_next;
 		size_t srclen = idlen (src);
-		assert (src [srclen] == '@');
+		assert (src [srclen] == '?');
 		// Search for the matching other
 		struct lcstate *other = lco->lcs_first;
 		while (other != NULL) {
-			size_t lclen = idlen (lcs->txt_attr);
-			if ((lclen == srclen) && (0 == strncmp (lcs->txt_attr, src, srclen))) {
+			size_t lclen = idlen (other->txt_attr);
+			if ((lclen == srclen) && (0 == strncmp (other->txt_attr, src, srclen))) {
 				// Found the right "other", stop searching
 				break;
 			}
@@ -527,10 +1097,11 @@ bool advance_lcstate_events (struct lcstate *lcs, struct lcobject *lco) {
 			// We found the matching other, test it
 			char *evt = src + srclen + 1;
 			size_t evtlen = idlen (evt);
-			char *trig = strchrnul (lcs->txt_attr, ' ');
+			char *past = other->txt_attr + other->ofs_next;
+			char *trig = strchrnul (other->txt_attr, ' ');
 			while (*trig == ' ') {
 				trig++;
-				if (trig >= next) {
+				if (trig >= past) {
 					// Won't look into the future
 					break;
 				}
@@ -552,6 +1123,8 @@ bool advance_lcstate_events (struct lcstate *lcs, struct lcobject *lco) {
 				next++;
 			}
 			lcs->ofs_next = next - lcs->txt_attr;
+			lcs->typ_next = find_type (next);
+			PROBE3 (event_advance, lco->txt_dn, lcs->txt_attr, lcs->ofs_next);
 			smudge_lcstate_firetime (lcs, lco);
 		}
 		// Take note if we did something
@@ -577,7 +1150,9 @@ bool advance_lcobject_events (struct lcobject *lco) {
 		didsth = false;
 		struct lcstate *lcs = lco->lcs_first;
 		while (lcs != NULL) {
-			didsth = advance_lcstate_events (lcs, lco);
+			if (advance_lcstate_events (lcs, lco)) {
+				didsth = true;
+			}
 			lcs = lcs->lcs_next;
 		}
 		retval = retval || didsth;
@@ -609,295 +1184,2121 @@ bool fire_lcstate_events (struct lcstate *lcs, struct lcobject *lco) {
 
 
 
-/********** SERVICE THREAD **********/
+/********** DRIVER PROCESSES **********/
 
 
 
-/* When a backend instance is openened, it is given its own thread.
- * When the backend instance is closed, the thread is taken away.
- * We refer to this thread as the service thread of an lcenv; it
- * exists only because Pulley retains control while we would like
- * to respond to timeouts, not just LDAP changes.
+/* Drivers receive their lines through a non-blocking pipe.  The lines
+ * are first queued in a ring buffer for the lcworker, and then written
+ * as far as the worker is willing to read them.  When a worker is slow,
+ * its remaining output is written when epoll reports that its pipe has
+ * room again.  This is all done by the service thread, which does not
+ * hold pth_envown while waiting, so Pulley can continue its transactions.
  *
- * The context of each thread is its own lcenv.  It passes lines
- * to output drivers, multiple if need be -- LDAP can wait for us.
- * Output drivers may be assumed to run without cross-connections, so
- * we need not be afraid of deadlocks there either.
- * 
- * On a regular basis however, the thread releases its Mutex lock on
- * lcenv, and after grabbing it again it will start from scratch.
- * While the Mutex was held by LDAP, it may have added and deleted
- * lcobject and lcstate representations, as the environment sees fit.
+ * When the queue of a worker fills up to its high watermark, further
+ * lcstates are deferred until it drains to its low watermark.  They are
+ * checked again after DRIVER_RECHECK seconds, without counting as missed
+ * and without the exponential fallback, so other drivers and Pulley are
+ * served as usual.  When the queue is full in spite of this, nothing is
+ * queued and the lcstate is retried along with the exponential fallback.
  *
- * The Mutex in the lcenv is claimed during transaction start, and
- * released after transaction end, good or bad.
- */
-
-
-
-/* Threads synchronise as follows:
+ * Drivers with the ack option are connected through a socket instead,
+ * and answer each pair of lines.  The answers are read by the service
+ * thread as well, and matched with the lcdispatch queued for the lcworker.
+ * The answer determines when the lcstate fires again:
+ *  - "ok" awaits the update through LDAP for DRIVER_OKWAIT seconds
+ *  - "fail" retries with the exponential fallback
+ *  - "retry-after=N" retries after N seconds
+ * The lcstate does not fire again while its dispatch is in flight, but
+ * a driver that does not answer for DRIVER_ACKWAIT seconds is retried.
  *
- *  0. The threads consist of a pulley backend and individual service
- *     threads that each handle an lcenv with its subordinate lcobject
- *     and lcstate data.
- *  1. The new thread will loop, each time checking if the LCE_SERVICED
- *     is still set in lce_flags.  This is always done after waiting for
- *     a condition signal or a timeout.
- *  2. The main program never cancels the service thread, but resets the
- *     flag and sends a condition signal while it knows the service
- *     thread is waiting for it.
- *  3. The service thread normally sits waiting for a condition, which is
- *     that new work has arrived.  A signal is sent by any txn_done(),
- *     and spurious signals should also not wreak more heavoc than making
- *     another run.  During the wait, changes to the LCE_SERVICED flag in
- *     lce_flags might be made if the service thread needs to finish.
- *  4. Upon receiving the condition singal, a complete run through the
- *     logic is made.  This is another loop however, and it is skipped
- *     when LCE_SERVICED is no longer set in lce_flags.
- *  5. When a timer has been set, the condition wait is embellished with
- *     its expiration time.  This is another trigger that could lead to
- *     a spark of activity in the service thread, though specific to the
- *     findings during the previous loop run.  The signal indicates whether
- *     other things might also have changed.
- *  6. The service thread and pulley backend share a mutex, which protects
- *     the condition, but also serves to decide who may make changes to the
- *     lcenv and any lcobject and lcstate underneath.  Note that this is a
- *     strict hierarchy, without sharing between threads.  Between txn_open()
- *     and either txn_break() or txn_done(), the mutex is held by the
- *     transaction.  After a preliminary txn_break() the mutex is already
- *     gone, and no signal sent, but pulley may still believe it is using a
- *     transaction.  Since no further changes are made, this is fine.
+ * Drivers with the shm option find their dispatches as frames in a
+ * shared memory ring, described with struct lcshm, and are woken up
+ * through an eventfd doorbell once per round with new records.  This
+ * avoids the copies into the kernel and back for busy drivers.  When
+ * the ring is full, nothing is queued, just like for the ring buffer.
+ *
+ * The lcworkers are supervised by the service thread.  A worker that
+ * exits, or that breaks its connection, is considered dead.  It is
+ * restarted after a delay with exponential fallback, and is then sent
+ * the lcstates that it was given but did not handle yet.
+ *
+ * Drivers with the shared option use the workers of an lcpool, which
+ * is shared with other lcenvs that have the same driver argument.  Its
+ * workers are handled by the service thread of a private lcenv, and
+ * the answers are passed back to the clients through their dsp_inbox.
+ *
+ * Drivers with the lazy option start their workers for the first
+ * dispatch, and drivers with the idle option retire workers that had
+ * nothing to do for a while.  Their output is queued as usual while
+ * they start.  A retired worker is started again when needed.
  */
 
 
-
-/* When a service fires, run over all registered lcstate that have a timer
- * set to at most the lcobject first firing time; this is always at least
- * one lcstate.
- *
- * During the setup of a Pulley Backend instance, a series of drivers for
- * lifecycle-named processes was openend with popen() and kept in the
- * lcenv.  Write two lines to the popen()ed process, one holding the
- * distinguishedName of the lcobject, the second with the lifecycleState
- * from the lcstate.
+/* Parse a pulleyback_open() argument for an lcdriver, in the form
+ * lifecycle[,option]*=command where each option is a word, possibly
+ * followed by a colon and a value.  The options are:
+ *  - workers:N runs a pool of N processes for the lifecycle
+ *  - ack expects an answer from the driver for every pair of lines
+ *  - frames sends frames with an lcframe header instead of lines
+ *  - plugin loads the command as a shared object, without other options
+ *  - lease:N waits N seconds for LDAP before dispatching an event again
+ *  - shm passes frames through a shared memory ring instead of the pipe
+ *  - shared uses the workers of other lcenvs with the same command and options
+ *  - lazy starts the workers when they get their first dispatch
+ *  - idle:N lets workers finish after N seconds without work
+ *  - high:N holds back output when N bytes are queued for a worker
+ *  - low:N resumes output when the queue drains to N bytes
  *
- * TODO: Error handling; processes can fail, and what then?  Use ferror()?
+ * Fill the options in the lcdriver and return the command, or return
+ * NULL when the syntax is wrong.  The cmdname is not setup here.
  */
-void service_fire_timer (struct lcobject *lco, struct lcenv *lce) {
-	// Find at least one lcstate to fire
-	time_t timer = lco->tim_first;
-	bool fired_some_lcstate_timer = false;
-	struct lcstate *lcs = lco->lcs_first;
-	debug ("Looking for timer %d", timer);
-	while (lcs != NULL) {
-		// See if this lcstate wants to fire
-		debug ("Considering type '%c' timer %d", lcs->typ_next, lcs->tim_next);
-		if ((lcs->typ_next == '@') && (lcs->tim_next <= timer)) {
-			char  *lcname    = lcs->txt_attr;
-			size_t lcnamelen = idlen (lcname);
-			// Iterate over the lcdriver list
-			struct lcdriver *lcd = lce->lcd_cmds;
-			uint32_t lcdnum      = lce->cnt_cmds;
-			while (lcdnum-- > 0) {
-				debug ("Testing lcdriver %s", lcname);
-				if (0 == strmemcmp (lcd->cmdname,
-						lcname, lcnamelen)) {
-					fprintf (lcd->cmdpipe, "%s\n%s\n",
-						lco->txt_dn,
-						lcs->txt_attr);
-					fflush (lcd->cmdpipe);
-					fired_some_lcstate_timer = true;
-					break;
-				}
-				lcd++;
+static bool optis (char *opt, size_t optlen, char *name) {
+	return 0 == strmemcmp (name, opt, optlen);
+}
+//
+char *driver_parse_arg (char *arg, struct lcdriver *lcd) {
+	lcd->lcd_flags = 0;
+	lcd->cnt_workers = 1;
+	lcd->lease_secs = DRIVER_LEASE;
+	lcd->idle_secs = 0;
+	lcd->wmk_high = 0;
+	lcd->wmk_low = 0;
+	bool high = false;
+	bool low = false;
+	char *opt = arg + idlen (arg);
+	while (*opt == ',') {
+		opt++;
+		size_t optlen = idlen (opt);
+		char  *val    = NULL;
+		size_t vallen = 0;
+		if (opt [optlen] == ':') {
+			val = opt + optlen + 1;
+			vallen = idlen (val);
+		}
+		if (optis (opt, optlen, "workers") && (val != NULL)) {
+			char *end;
+			unsigned long num = strtoul (val, &end, 10);
+			if ((end != val + vallen) || (num < 1) || (num > DRIVER_MAXWORKERS)) {
+				return NULL;
 			}
+			lcd->cnt_workers = num;
+		} else if (optis (opt, optlen, "lease") && (val != NULL)) {
+			char *end;
+			unsigned long num = strtoul (val, &end, 10);
+			if ((end != val + vallen) || (num > SCHED_HORIZON)) {
+				return NULL;
+			}
+			lcd->lease_secs = num;
+		} else if (optis (opt, optlen, "idle") && (val != NULL)) {
+			char *end;
+			unsigned long num = strtoul (val, &end, 10);
+			if ((end != val + vallen) || (num > SCHED_HORIZON)) {
+				return NULL;
+			}
+			lcd->idle_secs = num;
+		} else if (optis (opt, optlen, "shared") && (val == NULL)) {
+			lcd->lcd_flags |= LCD_SHARED;
+		} else if (optis (opt, optlen, "lazy") && (val == NULL)) {
+			lcd->lcd_flags |= LCD_LAZY;
+		} else if ((optis (opt, optlen, "high") || optis (opt, optlen, "low")) && (val != NULL)) {
+			char *end;
+			unsigned long num = strtoul (val, &end, 10);
+			if ((end != val + vallen) || (num > DRIVER_SHMRING)) {
+				return NULL;
+			}
+			if (*opt == 'h') {
+				lcd->wmk_high = num;
+				high = true;
+			} else {
+				lcd->wmk_low = num;
+				low = true;
+			}
+		} else if (optis (opt, optlen, "ack") && (val == NULL)) {
+			lcd->lcd_flags |= LCD_ACK;
+		} else if (optis (opt, optlen, "frames") && (val == NULL)) {
+			lcd->lcd_flags |= LCD_FRAMES;
+		} else if (optis (opt, optlen, "shm") && (val == NULL)) {
+			lcd->lcd_flags |= LCD_SHM;
+		} else if (optis (opt, optlen, "plugin") && (val == NULL)) {
+			lcd->lcd_flags |= LCD_PLUGIN;
+		} else {
+			return NULL;
+		}
+		opt = (val != NULL) ? (val + vallen) : (opt + optlen);
+	}
+	if (*opt != '=') {
+		return NULL;
+	}
+	if ((lcd->lcd_flags & LCD_PLUGIN) &&
+			((lcd->lcd_flags != LCD_PLUGIN) || (lcd->cnt_workers != 1))) {
+		return NULL;
+	}
+	uint32_t queue = ((lcd->lcd_flags & LCD_SHM) != 0) ? DRIVER_SHMRING : DRIVER_OUTBUF;
+	if (!high) {
+		lcd->wmk_high = queue / 4 * 3;
+	}
+	if (!low) {
+		lcd->wmk_low = (lcd->wmk_high < queue / 4) ? lcd->wmk_high : queue / 4;
+	}
+	if ((lcd->wmk_high > queue) || (lcd->wmk_low > lcd->wmk_high)) {
+		return NULL;
+	}
+	return opt + 1;
+}
+
+
+/* Cleanup the shared memory ring and doorbell of an lcworker, inasfar
+ * as they were created.  Records that the worker did not consume are
+ * lost; the lcstates involved are sent again after a restart.
+ */
+void driver_shm_close (struct lcworker *lcw) {
+	if (lcw->shm_ring != NULL) {
+		munmap (lcw->shm_ring, sizeof (struct lcshm) + DRIVER_SHMRING);
+		lcw->shm_ring = NULL;
+	}
+	if (lcw->shm_fd >= 0) {
+		close (lcw->shm_fd);
+		lcw->shm_fd = -1;
+	}
+	if (lcw->shm_bell >= 0) {
+		close (lcw->shm_bell);
+		lcw->shm_bell = -1;
+	}
+}
+
+
+/* Create the shared memory ring and doorbell for an lcworker under
+ * LCD_SHM.  Their descriptors are kept above the ones that they will
+ * be mapped to in the worker, so they are not overwritten there.
+ * Return success as true, failure as false with errno set.
+ */
+bool driver_shm_open (struct lcworker *lcw) {
+	size_t size = sizeof (struct lcshm) + DRIVER_SHMRING;
+	int memfd = -1;
+#ifdef SYS_memfd_create
+	memfd = syscall (SYS_memfd_create, "lifecycle", 1 /* MFD_CLOEXEC */);
+#else
+	errno = ENOSYS;
+#endif
+	if (memfd >= 0) {
+		lcw->shm_fd = fcntl (memfd, F_DUPFD_CLOEXEC, 5);
+		close (memfd);
+	}
+	int bell = eventfd (0, EFD_CLOEXEC);
+	if (bell >= 0) {
+		lcw->shm_bell = fcntl (bell, F_DUPFD_CLOEXEC, 5);
+		close (bell);
+	}
+	if ((lcw->shm_fd < 0) || (lcw->shm_bell < 0) || (ftruncate (lcw->shm_fd, size) == -1)) {
+		driver_shm_close (lcw);
+		return false;
+	}
+	void *ring = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, lcw->shm_fd, 0);
+	if (ring == MAP_FAILED) {
+		driver_shm_close (lcw);
+		return false;
+	}
+	lcw->shm_ring = ring;
+	lcw->shm_ring->shm_magic = LCSHM_MAGIC;
+	lcw->shm_ring->shm_size = DRIVER_SHMRING;
+	lcw->shm_head = 0;
+	return true;
+}
+
+
+/* Publish the records written to the shared memory ring of an lcworker,
+ * and ring its doorbell, when there are any new ones.
+ */
+void driver_shm_publish (struct lcworker *lcw) {
+	if ((lcw->shm_ring == NULL) ||
+			(__atomic_load_n (&lcw->shm_ring->shm_head, __ATOMIC_RELAXED) == lcw->shm_head)) {
+		return;
+	}
+	__atomic_store_n (&lcw->shm_ring->shm_head, lcw->shm_head, __ATOMIC_RELEASE);
+	eventfd_write (lcw->shm_bell, 1);
+}
+
+
+/* Setup the cmd_argv for an lcdriver from its cmdline.  When the cmdline
+ * holds no shell metacharacters, quotes, expansions or globs, it is split
+ * into words that are run without a shell.  Otherwise, it is run through
+ * /bin/sh like popen() would.  Characters that only mean something to a
+ * shell in some places, such as = and % and ~ and braces, are common in
+ * arguments and do not call for a shell.  The words are stored after the
+ * pointers.
+ * Return success as true, failure as false with errno set.
+ */
+bool driver_argv (struct lcdriver *lcd) {
+	size_t len = strlen (lcd->cmdline);
+	bool shell = (lcd->cmdline [strcspn (lcd->cmdline, "|&;<>()$`\\\"'*?[#!\n")] != '\0');
+	size_t words = shell ? 3 : 1;
+	size_t i;
+	for (i=0; i<len; i++) {
+		if ((lcd->cmdline [i] == ' ') || (lcd->cmdline [i] == '\t')) {
+			words++;
+		}
+	}
+	lcd->cmd_argv = malloc ((words + 1) * sizeof (char *) + len + 1);
+	if (lcd->cmd_argv == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	if (shell) {
+		lcd->cmd_argv [0] = "/bin/sh";
+		lcd->cmd_argv [1] = "-c";
+		lcd->cmd_argv [2] = lcd->cmdline;
+		lcd->cmd_argv [3] = NULL;
+		return true;
+	}
+	char *word = (char *) (lcd->cmd_argv + words + 1);
+	memcpy (word, lcd->cmdline, len + 1);
+	size_t argc = 0;
+	while (*word != '\0') {
+		if ((*word == ' ') || (*word == '\t')) {
+			*word++ = '\0';
+			continue;
+		}
+		lcd->cmd_argv [argc++] = word;
+		word += strcspn (word, " \t");
+	}
+	lcd->cmd_argv [argc] = NULL;
+	if (argc == 0) {
+		free (lcd->cmd_argv);
+		lcd->cmd_argv = NULL;
+		errno = EINVAL;
+		return false;
+	}
+	return true;
+}
+
+
+/* Add actions to close the file descriptors that a worker would inherit
+ * from Pulley, except stdin, stdout, stderr and the ones in keep [].
+ * Our own descriptors have FD_CLOEXEC set, but those of Pulley and other
+ * backends may not.  Failure to list them is not fatal.
+ */
+static void driver_closefds (posix_spawn_file_actions_t *fact, int keep [], int keepcnt) {
+	DIR *dir = opendir ("/proc/self/fd");
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent *de;
+	while ((de = readdir (dir)) != NULL) {
+		int fd = atoi (de->d_name);
+		if ((fd <= 2) || (fd == dirfd (dir))) {
+			continue;
+		}
+		int ki;
+		for (ki=0; ki<keepcnt; ki++) {
+			if (fd == keep [ki]) {
+				break;
+			}
+		}
+		if (ki == keepcnt) {
+			posix_spawn_file_actions_addclose (fact, fd);
+		}
+	}
+	closedir (dir);
+}
+
+
+/* Spawn the process for an lcworker, running its cmd_argv without the
+ * fork() of popen(), and without the file descriptors of Pulley.  The
+ * signal mask is cleared and SIGPIPE is restored to its default action.
+ * Its stdin is connected to a pipe, or under LCD_ACK to a socket that
+ * also serves as its stdout.  Our end of the connection is set to
+ * non-blocking mode.  Under LCD_SHM, a new shared memory ring is passed
+ * on file descriptor 3, and its doorbell on 4.
+ *
+ * Return success as true, failure as false with errno set.
+ */
+extern char **environ;
+//
+bool driver_spawn (struct lcworker *lcw) {
+	struct lcdriver *lcd = lcw->lcw_driver;
+	bool ack = ((lcd->lcd_flags & LCD_ACK) != 0);
+	bool shm = ((lcd->lcd_flags & LCD_SHM) != 0);
+	if (shm && !driver_shm_open (lcw)) {
+		return false;
+	}
+	int fds [2];
+	int ours, theirs;
+	if (ack) {
+		if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+			driver_shm_close (lcw);
+			return false;
+		}
+		ours   = fds [0];
+		theirs = fds [1];
+	} else {
+		if (pipe2 (fds, O_CLOEXEC) == -1) {
+			driver_shm_close (lcw);
+			return false;
+		}
+		ours   = fds [1];
+		theirs = fds [0];
+	}
+	posix_spawn_file_actions_t fact;
+	posix_spawnattr_t attr;
+	int err = posix_spawn_file_actions_init (&fact);
+	if (err == 0) {
+		int keep [] = { theirs, lcw->shm_fd, lcw->shm_bell };
+		driver_closefds (&fact, keep, 3);
+		err = posix_spawn_file_actions_adddup2 (&fact, theirs, 0);
+	}
+	if ((err == 0) && ack) {
+		err = posix_spawn_file_actions_adddup2 (&fact, theirs, 1);
+	}
+	if ((err == 0) && shm) {
+		err = posix_spawn_file_actions_adddup2 (&fact, lcw->shm_fd, 3);
+	}
+	if ((err == 0) && shm) {
+		err = posix_spawn_file_actions_adddup2 (&fact, lcw->shm_bell, 4);
+	}
+	if ((err == 0) && ((err = posix_spawnattr_init (&attr)) == 0)) {
+		sigset_t sigs;
+		sigemptyset (&sigs);
+		posix_spawnattr_setsigmask (&attr, &sigs);
+		sigaddset (&sigs, SIGPIPE);
+		posix_spawnattr_setsigdefault (&attr, &sigs);
+		posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+		err = posix_spawnp (&lcw->cmdpid, lcd->cmd_argv [0], &fact, &attr, lcd->cmd_argv, environ);
+		posix_spawnattr_destroy (&attr);
+	}
+	posix_spawn_file_actions_destroy (&fact);
+	close (theirs);
+	int flags = -1;
+	if (err == 0) {
+		flags = fcntl (ours, F_GETFL);
+		if ((flags == -1) || (fcntl (ours, F_SETFL, flags | O_NONBLOCK) == -1)) {
+			err = errno;
+		}
+	}
+	if (err != 0) {
+		close (ours);
+		driver_shm_close (lcw);
+		errno = err;
+		return false;
+	}
+	lcw->cmdfd = ours;
+#ifdef SYS_pidfd_open
+	lcw->pidfd = syscall (SYS_pidfd_open, lcw->cmdpid, 0);
+#else
+	lcw->pidfd = -1;
+#endif
+	lcw->tim_started = clock_now (lcw->lcw_driver->lcd_env);
+	lcw->tim_active = lcw->tim_started;
+	return true;
+}
+
+
+/* Prepare the buffers of an lcworker for its non-blocking output and,
+ * under LCD_ACK, its answers.
+ * Return success as true, failure as false with errno set.
+ */
+bool driver_output_open (struct lcworker *lcw) {
+	lcw->out_buf = malloc (DRIVER_OUTBUF);
+	if (lcw->out_buf == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	lcw->out_rd = lcw->out_wr = 0;
+	lcw->out_iovmax = 64;
+	lcw->out_iov = calloc (lcw->out_iovmax, sizeof (struct iovec));
+	if (lcw->out_iov == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	lcw->out_iovrd = lcw->out_iovcnt = DRIVER_IOVRING;
+	lcw->out_pend = 0;
+	if ((lcw->lcw_driver->lcd_flags & LCD_FRAMES) != 0) {
+		lcw->out_hdr = calloc (lcw->out_iovmax / 3, sizeof (struct lcframe));
+		if (lcw->out_hdr == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+	}
+	if ((lcw->lcw_driver->lcd_flags & LCD_ACK) != 0) {
+		lcw->in_buf = malloc (DRIVER_INBUF);
+		if (lcw->in_buf == NULL) {
+			errno = ENOMEM;
+			return false;
+		}
+	}
+	lcw->in_len = 0;
+	lcw->dsp_first = NULL;
+	lcw->dsp_last = &lcw->dsp_first;
+	lcw->cnt_inflight = 0;
+	return true;
+}
+
+
+/* Forget the dispatches in flight to an lcworker; their answers will
+ * not be read.
+ */
+void driver_forget (struct lcworker *lcw) {
+	while (lcw->dsp_first != NULL) {
+		struct lcdispatch *dsp = lcw->dsp_first;
+		lcw->dsp_first = dsp->dsp_next;
+		free (dsp);
+	}
+	lcw->dsp_last = &lcw->dsp_first;
+	lcw->cnt_inflight = 0;
+}
+
+
+/* Write any remaining output to an lcworker in blocking mode, and cleanup
+ * the ring buffer.  This is done while closing, just before the worker
+ * is waited for.  This runs in the Pulley thread, so SIGPIPE is blocked
+ * only while writing, and consumed when a worker has already exited.
+ * Dispatches still in flight are forgotten; their answers are not read.
+ */
+void driver_output_close (struct lcworker *lcw) {
+	driver_forget (lcw);
+	driver_shm_publish (lcw);
+	if (lcw->out_iov != NULL) {
+		free (lcw->out_iov);
+		lcw->out_iov = NULL;
+	}
+	if (lcw->out_hdr != NULL) {
+		free (lcw->out_hdr);
+		lcw->out_hdr = NULL;
+	}
+	if (lcw->in_buf != NULL) {
+		free (lcw->in_buf);
+		lcw->in_buf = NULL;
+	}
+	if ((lcw->out_buf == NULL) || (lcw->cmdfd < 0)) {
+		free (lcw->out_buf);
+		lcw->out_buf = NULL;
+		return;
+	}
+	sigset_t sigpipe, oldmask;
+	sigemptyset (&sigpipe);
+	sigaddset (&sigpipe, SIGPIPE);
+	pthread_sigmask (SIG_BLOCK, &sigpipe, &oldmask);
+	int flags = fcntl (lcw->cmdfd, F_GETFL);
+	if (flags != -1) {
+		fcntl (lcw->cmdfd, F_SETFL, flags & ~O_NONBLOCK);
+	}
+	while (lcw->out_rd != lcw->out_wr) {
+		uint32_t ofs = lcw->out_rd % DRIVER_OUTBUF;
+		uint32_t len = lcw->out_wr - lcw->out_rd;
+		if (len > DRIVER_OUTBUF - ofs) {
+			len = DRIVER_OUTBUF - ofs;
+		}
+		ssize_t done = write (lcw->cmdfd, lcw->out_buf + ofs, len);
+		if (done < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			syslog (LOG_ERR, "Dropping %d bytes of output to driver %s: %s", lcw->out_wr - lcw->out_rd, lcw->lcw_driver->cmdname, strerror (errno));
+			if (errno == EPIPE) {
+				struct timespec nowait = { 0, 0 };
+				sigtimedwait (&sigpipe, NULL, &nowait);
+			}
+			break;
+		}
+		lcw->out_rd += done;
+	}
+	pthread_sigmask (SIG_SETMASK, &oldmask, NULL);
+	free (lcw->out_buf);
+	lcw->out_buf = NULL;
+}
+
+
+/* Load the shared object for an lcdriver under LCD_PLUGIN, and have it
+ * initialise.  The cmdline holds its path, optionally followed by a
+ * space and config text for the plugin.
+ * Return success as true, failure as false with errno set.
+ */
+bool driver_plugin_load (struct lcdriver *lcd) {
+	char *config = strchrnul (lcd->cmdline, ' ');
+	char *path = strndup (lcd->cmdline, config - lcd->cmdline);
+	if (path == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	while (*config == ' ') {
+		config++;
+	}
+	lcd->plg_dlhandle = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+	free (path);
+	if (lcd->plg_dlhandle == NULL) {
+		syslog (LOG_ERR, "Failed to load plugin for driver %s: %s", lcd->cmdname, dlerror ());
+		errno = ENOENT;
+		return false;
+	}
+	lifecycle_plugin_init_t *init;
+	*(void **) &init          = dlsym (lcd->plg_dlhandle, "lifecycle_plugin_init");
+	*(void **) &lcd->plg_fire = dlsym (lcd->plg_dlhandle, "lifecycle_plugin_fire");
+	*(void **) &lcd->plg_fini = dlsym (lcd->plg_dlhandle, "lifecycle_plugin_fini");
+	if ((init == NULL) || (lcd->plg_fire == NULL) || (lcd->plg_fini == NULL)) {
+		syslog (LOG_ERR, "Plugin for driver %s lacks the lifecycle_plugin_* functions", lcd->cmdname);
+		dlclose (lcd->plg_dlhandle);
+		lcd->plg_dlhandle = NULL;
+		errno = ENOENT;
+		return false;
+	}
+	if (!init (&lcd->plg_handle, lcd->cmdname, config)) {
+		int err = errno;
+		syslog (LOG_ERR, "Plugin for driver %s failed to initialise: %s", lcd->cmdname, strerror (err));
+		dlclose (lcd->plg_dlhandle);
+		lcd->plg_dlhandle = NULL;
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+
+/* Cleanup the plugin of an lcdriver, inasfar as it was loaded.
+ */
+void driver_plugin_unload (struct lcdriver *lcd) {
+	if (lcd->plg_dlhandle == NULL) {
+		return;
+	}
+	lcd->plg_fini (lcd->plg_handle);
+	dlclose (lcd->plg_dlhandle);
+	lcd->plg_dlhandle = NULL;
+	lcd->plg_fire = NULL;
+	lcd->plg_fini = NULL;
+}
+
+
+/* Start the pool of lcworker processes for an lcdriver.  Under LCD_LAZY,
+ * the lcworkers are only prepared, and marked idle.
+ * Return success as true, failure as false with errno set.
+ */
+bool driver_start (struct lcdriver *lcd) {
+	if ((lcd->lcd_flags & LCD_PLUGIN) != 0) {
+		return driver_plugin_load (lcd);
+	}
+	if ((lcd->lcd_flags & LCD_SHARED) != 0) {
+		// The lcpool is joined by driver_share()
+		return true;
+	}
+	if (!driver_argv (lcd)) {
+		return false;
+	}
+	lcd->lcw_workers = calloc (lcd->cnt_workers, sizeof (struct lcworker));
+	if (lcd->lcw_workers == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	bool ok = true;
+	uint32_t wi;
+	for (wi=0; wi<lcd->cnt_workers; wi++) {
+		struct lcworker *lcw = &lcd->lcw_workers [wi];
+		lcw->lcw_driver = lcd;
+		lcw->cmdfd = -1;
+		lcw->cmdpid = -1;
+		lcw->pidfd = -1;
+		lcw->shm_fd = -1;
+		lcw->shm_bell = -1;
+		lcw->dsp_last = &lcw->dsp_first;
+		if (!ok) {
+			continue;
+		} else if ((lcd->lcd_flags & LCD_LAZY) != 0) {
+			lcw->lcw_flags |= LCW_IDLE;
+			ok = driver_output_open (lcw);
+		} else {
+			ok = driver_spawn (lcw) && driver_output_open (lcw);
+		}
+	}
+	return ok;
+}
+
+
+/* Stop the pool of lcworker processes for an lcdriver, inasfar as
+ * they were started.  Closing the connection tells a worker to finish,
+ * and we wait for it to do so.
+ */
+void driver_stop (struct lcdriver *lcd) {
+	driver_plugin_unload (lcd);
+	if (lcd->cmd_argv != NULL) {
+		free (lcd->cmd_argv);
+		lcd->cmd_argv = NULL;
+	}
+	if (lcd->lcw_workers == NULL) {
+		return;
+	}
+	uint32_t wi;
+	for (wi=0; wi<lcd->cnt_workers; wi++) {
+		struct lcworker *lcw = &lcd->lcw_workers [wi];
+		driver_output_close (lcw);
+		if (lcw->cmdfd >= 0) {
+			close (lcw->cmdfd);
+			lcw->cmdfd = -1;
+		}
+		if (lcw->pidfd >= 0) {
+			close (lcw->pidfd);
+			lcw->pidfd = -1;
+		}
+		driver_shm_close (lcw);
+		if (lcw->cmdpid > 0) {
+			int chex = 0;
+			while ((waitpid (lcw->cmdpid, &chex, 0) == -1) && (errno == EINTR)) {
+				;
+			}
+			if (chex != 0) {
+				syslog (LOG_ERR, "Error exit value %d from worker #%d of command pipe %s", chex, wi, lcd->cmdname ? lcd->cmdname : "(failed)");
+			}
+			lcw->cmdpid = -1;
+		}
+	}
+	free (lcd->lcw_workers);
+	lcd->lcw_workers = NULL;
+}
+
+
+/* Find the lcdriver for the lifecycle of an lcstate, or return NULL.
+ */
+struct lcdriver *driver_find (struct lcenv *lce, struct lcstate *lcs) {
+	char  *lcname    = lcs->txt_attr;
+	size_t lcnamelen = idlen (lcname);
+	struct lcdriver *lcd = lce->lcd_cmds;
+	uint32_t lcdnum      = lce->cnt_cmds;
+	while (lcdnum-- > 0) {
+		if (0 == strmemcmp (lcd->cmdname, lcname, lcnamelen)) {
+			return lcd;
+		}
+		lcd++;
+	}
+	return NULL;
+}
+
+
+/* Select the lcworker for an lcobject in an lcdriver.  The hash of the
+ * distinguishedName is used, so all events for an lcobject are sent to
+ * the same worker, in the order in which they are fired.
+ */
+struct lcworker *driver_worker (struct lcdriver *lcd, struct lcobject *lco) {
+	return &lcd->lcw_workers [lco->hsh_dn.hashv % lcd->cnt_workers];
+}
+
+
+/* Find the index of the next event in an lcstate, counting from 0.
+ * This is the number of words between the lifecycle name and the dot.
+ */
+static uint16_t driver_event_index (struct lcstate *lcs) {
+	uint16_t spaces = 0;
+	uint16_t ofs;
+	for (ofs=0; ofs<lcs->ofs_next; ofs++) {
+		if (lcs->txt_attr [ofs] == ' ') {
+			spaces++;
+		}
+	}
+	return (spaces >= 2) ? (spaces - 2) : 0;
+}
+
+
+/* Fill the lcframe header for a frame of the given length, which holds
+ * the distinguishedName and the lifecycleState of an lcstate.
+ */
+static void driver_frame (struct lcframe *hdr, uint32_t id, struct lcstate *lcs, size_t needed, size_t dnlen, size_t attrlen) {
+	hdr->frm_len     = htonl (needed - sizeof (hdr->frm_len));
+	hdr->frm_id      = htonl (id);
+	hdr->frm_event   = htons (driver_event_index (lcs));
+	hdr->frm_attempt = htons (lcs->cnt_missed);
+	hdr->frm_dnlen   = htons (dnlen);
+	hdr->frm_lcslen  = htons (attrlen);
+}
+
+
+/* Add an lcdispatch to an lcworker under LCD_ACK, to await the answer.
+ * The owner is the client lcdriver under LCD_SHARED, or NULL.
+ * Return whether it was added.
+ */
+static bool driver_dispatch (struct lcworker *lcw, struct lcdriver *owner, uint32_t id, char *dn, size_t dnlen, char *attr, size_t attrlen, time_t now) {
+	struct lcdispatch *dsp = malloc (sizeof (struct lcdispatch) + dnlen + 1 + attrlen + 1);
+	if (dsp == NULL) {
+		return false;
+	}
+	dsp->dsp_next = NULL;
+	dsp->dsp_owner = owner;
+	dsp->dsp_id = id;
+	dsp->tim_sent = now;
+	memcpy (dsp->txt_dn, dn, dnlen + 1);
+	dsp->txt_attr = dsp->txt_dn + dnlen + 1;
+	memcpy (dsp->txt_attr, attr, attrlen + 1);
+	*lcw->dsp_last = dsp;
+	lcw->dsp_last = &dsp->dsp_next;
+	lcw->cnt_inflight++;
+	return true;
+}
+
+
+/* Write a frame into the shared memory ring of an lcworker under LCD_SHM.
+ * It is published by driver_flush_all() at the end of the round.
+ * Return whether the frame was written.
+ */
+static bool driver_enqueue_shm (struct lcworker *lcw, struct lcdriver *owner, struct lcstate *lcs, char *dn, size_t dnlen, char *attr, size_t attrlen, size_t needed, time_t now) {
+	uint64_t tail = __atomic_load_n (&lcw->shm_ring->shm_tail, __ATOMIC_ACQUIRE);
+	uint32_t ofs  = lcw->shm_head % DRIVER_SHMRING;
+	size_t   rec  = (needed + 3) & ~((size_t) 3);
+	size_t   skip = (rec > DRIVER_SHMRING - ofs) ? (DRIVER_SHMRING - ofs) : 0;
+	if (skip + rec > DRIVER_SHMRING - (lcw->shm_head - tail)) {
+		return false;
+	}
+	uint32_t id = lcw->dsp_nextid++;
+	if (((lcw->lcw_driver->lcd_flags & LCD_ACK) != 0) &&
+			!driver_dispatch (lcw, owner, id, dn, dnlen, attr, attrlen, now)) {
+		return false;
+	}
+	char *ring = (char *) (lcw->shm_ring + 1);
+	if (skip > 0) {
+		// A frm_len of 0 tells the driver to continue at the start
+		memset (ring + ofs, 0, sizeof (uint32_t));
+		lcw->shm_head += skip;
+		ofs = 0;
+	}
+	driver_frame ((struct lcframe *) (ring + ofs), id, lcs, needed, dnlen, attrlen);
+	memcpy (ring + ofs + sizeof (struct lcframe), dn, dnlen);
+	memcpy (ring + ofs + sizeof (struct lcframe) + dnlen, attr, attrlen);
+	lcw->shm_head += rec;
+	lcw->tim_active = now;
+	return true;
+}
+
+
+/* Queue the distinguishedName of an lcobject and the lifecycleState of
+ * an lcstate for an lcworker, as a pair of lines or, under LCD_FRAMES,
+ * as a frame.  Either all is queued, or nothing.  The text is referenced
+ * in out_iov, so the lcobject and lcstate must not change before they
+ * are written or stashed by driver_flush_all() at the end of the round.
+ * Under LCD_SHM, the frame is written to the shared memory ring instead.
+ * Under LCD_ACK, an lcdispatch is added to await the answer, which is
+ * passed to the owner, the client lcdriver under LCD_SHARED, or NULL.
+ * Return whether the lines were queued.
+ */
+bool driver_enqueue (struct lcworker *lcw, struct lcdriver *owner, struct lcobject *lco, struct lcstate *lcs, time_t now) {
+	if ((lcw->lcw_flags & LCW_DEAD) != 0) {
+		return false;
+	}
+	uint32_t flags = lcw->lcw_driver->lcd_flags;
+	char  *dn      = lco->txt_dn;
+	char  *attr    = lcs->txt_attr;
+	size_t dnlen   = strlen (dn);
+	size_t attrlen = strlen (attr);
+	size_t needed;
+	if ((flags & (LCD_FRAMES | LCD_SHM)) != 0) {
+		if ((dnlen > 65535) || (attrlen > 65535)) {
+			syslog (LOG_ERR, "Cannot frame overlong lcstate %s", attr);
+			return false;
+		}
+		needed = sizeof (struct lcframe) + dnlen + attrlen;
+	} else {
+		needed = dnlen + 1 + attrlen + 1;
+	}
+	if ((flags & LCD_SHM) != 0) {
+		return driver_enqueue_shm (lcw, owner, lcs, dn, dnlen, attr, attrlen, needed, now);
+	}
+	if (needed > DRIVER_OUTBUF - (lcw->out_wr - lcw->out_rd) - lcw->out_pend) {
+		return false;
+	}
+	if (lcw->out_iovcnt + 4 > lcw->out_iovmax) {
+		uint32_t newmax = 2 * lcw->out_iovmax;
+		struct iovec *newiov = realloc (lcw->out_iov, newmax * sizeof (struct iovec));
+		if (newiov == NULL) {
+			return false;
+		}
+		lcw->out_iov = newiov;
+		if ((flags & LCD_FRAMES) != 0) {
+			struct lcframe *newhdr = realloc (lcw->out_hdr, (newmax / 3) * sizeof (struct lcframe));
+			if (newhdr == NULL) {
+				return false;
+			}
+			lcw->out_hdr = newhdr;
+			// Nothing was written yet, so every third entry is a header
+			uint32_t i;
+			for (i=DRIVER_IOVRING; i<lcw->out_iovcnt; i+=3) {
+				newiov [i].iov_base = &newhdr [(i - DRIVER_IOVRING) / 3];
+			}
+		}
+		lcw->out_iovmax = newmax;
+	}
+	uint32_t id = lcw->dsp_nextid++;
+	if (((flags & LCD_ACK) != 0) && !driver_dispatch (lcw, owner, id, dn, dnlen, attr, attrlen, now)) {
+		return false;
+	}
+	struct iovec *iov = &lcw->out_iov [lcw->out_iovcnt];
+	if ((flags & LCD_FRAMES) != 0) {
+		struct lcframe *hdr = &lcw->out_hdr [(lcw->out_iovcnt - DRIVER_IOVRING) / 3];
+		driver_frame (hdr, id, lcs, needed, dnlen, attrlen);
+		iov [0].iov_base = hdr;
+		iov [0].iov_len  = sizeof (struct lcframe);
+		iov [1].iov_base = dn;
+		iov [1].iov_len  = dnlen;
+		iov [2].iov_base = attr;
+		iov [2].iov_len  = attrlen;
+		lcw->out_iovcnt += 3;
+	} else {
+		iov [0].iov_base = dn;
+		iov [0].iov_len  = dnlen;
+		iov [1].iov_base = "\n";
+		iov [1].iov_len  = 1;
+		iov [2].iov_base = attr;
+		iov [2].iov_len  = attrlen;
+		iov [3].iov_base = "\n";
+		iov [3].iov_len  = 1;
+		lcw->out_iovcnt += 4;
+	}
+	lcw->out_pend += needed;
+	lcw->tim_active = now;
+	return true;
+}
+
+
+/* Copy the lines in out_iov that were not written into the ring buffer
+ * out_buf, so they survive the release of pth_envown.  There is always
+ * room, because driver_enqueue() reserves it.
+ */
+void driver_stash (struct lcworker *lcw) {
+	while (lcw->out_iovrd < lcw->out_iovcnt) {
+		char  *src = lcw->out_iov [lcw->out_iovrd].iov_base;
+		size_t len = lcw->out_iov [lcw->out_iovrd].iov_len;
+		while (len > 0) {
+			uint32_t ofs = lcw->out_wr % DRIVER_OUTBUF;
+			size_t now = DRIVER_OUTBUF - ofs;
+			if (now > len) {
+				now = len;
+			}
+			memcpy (lcw->out_buf + ofs, src, now);
+			lcw->out_wr += now;
+			src += now;
+			len -= now;
+		}
+		lcw->out_iovrd++;
+	}
+	lcw->out_iovrd = lcw->out_iovcnt = DRIVER_IOVRING;
+	lcw->out_pend = 0;
+}
+
+
+/* Have epoll watch an lcworker for what it needs: room for output when
+ * some is queued, and answers under LCD_ACK until the worker is dead.
+ */
+void driver_poll (struct lcenv *lce, struct lcworker *lcw) {
+	uint32_t want = 0;
+	if (lcw->out_rd != lcw->out_wr) {
+		want |= LCW_POLLOUT;
+	}
+	if (((lcw->lcw_driver->lcd_flags & LCD_ACK) != 0) && ((lcw->lcw_flags & LCW_DEAD) == 0)) {
+		want |= LCW_POLLIN;
+	}
+	uint32_t have = lcw->lcw_flags & (LCW_POLLOUT | LCW_POLLIN);
+	if (want == have) {
+		return;
+	}
+	struct epoll_event ev;
+	memset (&ev, 0, sizeof (ev));
+	ev.events = ((want & LCW_POLLOUT) ? EPOLLOUT : 0) | ((want & LCW_POLLIN) ? EPOLLIN : 0);
+	ev.data.ptr = (void *) lcw;
+	int op = (have == 0) ? EPOLL_CTL_ADD : (want == 0) ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	assert (0 == epoll_ctl (lce->fd_epoll, op, lcw->cmdfd, &ev));
+	lcw->lcw_flags = (lcw->lcw_flags & ~(LCW_POLLOUT | LCW_POLLIN)) | want;
+}
+
+/* Plan the restart of an lcworker with exponential fallback.
+ */
+static void driver_backoff (struct lcworker *lcw, time_t now) {
+	uint8_t shift = lcw->cnt_failing;
+	if (shift >= RESTART_MAXSHIFT) {
+		shift = RESTART_MAXSHIFT;
+	} else {
+		lcw->cnt_failing++;
+	}
+	lcw->tim_restart = now + (((time_t) 1) << shift);
+}
+
+
+/* Consider an lcworker dead, because it exited or broke its connection.
+ * The connection is closed and its output and dispatches are dropped;
+ * the lcstates involved are sent again after the restart.  A worker that
+ * is still running is asked to terminate, so it can be reaped.
+ */
+void driver_died (struct lcenv *lce, struct lcworker *lcw, time_t now) {
+	if ((lcw->lcw_flags & LCW_DEAD) != 0) {
+		return;
+	}
+	if ((lcw->lcw_flags & (LCW_POLLOUT | LCW_POLLIN)) != 0) {
+		assert (0 == epoll_ctl (lce->fd_epoll, EPOLL_CTL_DEL, lcw->cmdfd, NULL));
+		lcw->lcw_flags &= ~(LCW_POLLOUT | LCW_POLLIN);
+	}
+	close (lcw->cmdfd);
+	lcw->cmdfd = -1;
+	driver_shm_close (lcw);
+	lcw->out_rd = lcw->out_wr;
+	lcw->out_iovrd = lcw->out_iovcnt = DRIVER_IOVRING;
+	lcw->out_pend = 0;
+	lcw->in_len = 0;
+	driver_forget (lcw);
+	if (lcw->cmdpid > 0) {
+		kill (lcw->cmdpid, SIGTERM);
+	}
+	if (now - lcw->tim_started >= RESTART_STABLE) {
+		lcw->cnt_failing = 0;
+	}
+	driver_backoff (lcw, now);
+	lcw->lcw_flags &= ~LCW_CONGESTED;
+	lcw->lcw_flags |= LCW_DEAD;
+}
+
+
+/* Write as much of the queued output of an lcworker as it will take.
+ * The ring buffer comes first, followed by the lines referenced in
+ * out_iov, all in a single writev() when the worker takes it all.
+ * What remains of out_iov is stashed in the ring buffer.
+ * When output remains, have epoll tell us when the pipe has room for
+ * more; otherwise, stop polling the pipe for output.
+ */
+void driver_flush (struct lcenv *lce, struct lcworker *lcw) {
+	while ((lcw->out_rd != lcw->out_wr) || (lcw->out_iovrd < lcw->out_iovcnt)) {
+		// Refer to the ring buffer just before the lines in out_iov
+		uint32_t ofs = lcw->out_rd % DRIVER_OUTBUF;
+		uint32_t len = lcw->out_wr - lcw->out_rd;
+		uint32_t first = lcw->out_iovrd;
+		assert ((len == 0) || (first == DRIVER_IOVRING));
+		if (len > DRIVER_OUTBUF - ofs) {
+			first -= 2;
+			lcw->out_iov [first    ].iov_base = lcw->out_buf + ofs;
+			lcw->out_iov [first    ].iov_len  = DRIVER_OUTBUF - ofs;
+			lcw->out_iov [first + 1].iov_base = lcw->out_buf;
+			lcw->out_iov [first + 1].iov_len  = len - (DRIVER_OUTBUF - ofs);
+		} else if (len > 0) {
+			first -= 1;
+			lcw->out_iov [first    ].iov_base = lcw->out_buf + ofs;
+			lcw->out_iov [first    ].iov_len  = len;
+		}
+		uint32_t iovcnt = lcw->out_iovcnt - first;
+		if (iovcnt > DRIVER_MAXIOV) {
+			iovcnt = DRIVER_MAXIOV;
+		}
+		ssize_t done = writev (lcw->cmdfd, &lcw->out_iov [first], iovcnt);
+		if (done < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+			syslog (LOG_ERR, "Dropping %d bytes of output to driver %s: %s", len + lcw->out_pend, lcw->lcw_driver->cmdname, strerror (errno));
+			driver_died (lce, lcw, clock_now (lce));
+			return;
+		}
+		// Consume the ring buffer first, then the lines in out_iov
+		if ((uint32_t) done >= len) {
+			lcw->out_rd = lcw->out_wr;
+			done -= len;
+		} else {
+			lcw->out_rd += done;
+			done = 0;
+		}
+		while (done > 0) {
+			struct iovec *iov = &lcw->out_iov [lcw->out_iovrd];
+			size_t now = ((size_t) done < iov->iov_len) ? (size_t) done : iov->iov_len;
+			iov->iov_base = ((char *) iov->iov_base) + now;
+			iov->iov_len -= now;
+			lcw->out_pend -= now;
+			done -= now;
+			if (iov->iov_len == 0) {
+				lcw->out_iovrd++;
+			}
+		}
+	}
+	driver_stash (lcw);
+	driver_poll (lce, lcw);
+}
+
+
+/* Write queued output to all the lcworkers, as far as they take it.
+ * This is done at the end of every round of the service thread, so
+ * the lines referenced in out_iov are written or stashed before
+ * pth_envown is released.  Workers that are still polled for room
+ * in their pipe only have their lines stashed.  Records written to
+ * shared memory rings are published with one doorbell per worker.
+ */
+void driver_flush_all (struct lcenv *lce) {
+	uint32_t lcdnum = lce->cnt_cmds;
+	struct lcdriver *lcd = lce->lcd_cmds;
+	while (lcdnum-- > 0) {
+		uint32_t wi;
+		for (wi=0; (lcd->lcw_workers != NULL) && (wi<lcd->cnt_workers); wi++) {
+			struct lcworker *lcw = &lcd->lcw_workers [wi];
+			if ((lcw->out_buf == NULL) || ((lcw->lcw_flags & (LCW_DEAD | LCW_IDLE)) != 0)) {
+				continue;
+			}
+			if ((lcw->lcw_flags & LCW_POLLOUT) == 0) {
+				driver_flush (lce, lcw);
+			} else {
+				driver_stash (lcw);
+			}
+			driver_shm_publish (lcw);
+		}
+		lcd++;
+	}
+}
+
+
+/* Apply the verdict of a driver to an lcstate.  The verdict is one of
+ * LIFECYCLE_PLUGIN_OK or LIFECYCLE_PLUGIN_FAIL, or a positive number of
+ * seconds after which to retry.  Only an "ok" verdict resets cnt_missed,
+ * which otherwise tells that the lcstate may still need to be sent to a
+ * restarted worker.  The "ok" verdict renews the lease of the dispatch,
+ * the others end it so the lcstate may be dispatched again.
+ */
+void driver_apply (struct lcstate *lcs, int verdict, time_t now) {
+	if (verdict == LIFECYCLE_PLUGIN_OK) {
+		lcs->cnt_missed = 0;
+		lcs->tim_next = now + DRIVER_OKWAIT;
+		lcs->tim_lease = now + DRIVER_OKWAIT;
+		return;
+	}
+	lcs->tim_lease = 0;
+	if (verdict > 0) {
+		if (verdict > SCHED_HORIZON) {
+			verdict = SCHED_HORIZON;
+		}
+		lcs->tim_next = now + verdict;
+	} else {
+		backoff_lcstate_firetime (lcs, now);
+	}
+}
+
+
+/* Parse the answer of a driver into a verdict for driver_apply().  The
+ * answer is one of "ok", "fail" or "retry-after=N"; anything else is
+ * reported and treated like "fail".
+ */
+int driver_verdict (char *answer, char *attr) {
+	if (0 == strcmp (answer, "ok")) {
+		return LIFECYCLE_PLUGIN_OK;
+	} else if ((0 == strncmp (answer, "retry-after=", 12)) && isdigit (answer [12])) {
+		char *end;
+		unsigned long delay = strtoul (answer + 12, &end, 10);
+		if ((*end != '\0') || (delay > SCHED_HORIZON)) {
+			delay = SCHED_HORIZON;
+		}
+		return (delay > 0) ? (int) delay : 1;
+	} else if (0 != strcmp (answer, "fail")) {
+		syslog (LOG_ERR, "Unknown driver answer \"%s\" for %s, retrying", answer, attr);
+	}
+	return LIFECYCLE_PLUGIN_FAIL;
+}
+
+
+/* Apply a verdict to the lcstate of an lcdispatch, inasfar as LDAP has
+ * not replaced or removed it yet.  The lcobject is made dirty, so it
+ * will be filed with its new timer.
+ */
+void driver_settle (struct lcenv *lce, struct lcdispatch *dsp, int verdict, time_t now) {
+	struct lcobject *lco = find_lcobject (lce->lco_dnhash, dsp->txt_dn, strlen (dsp->txt_dn));
+	if (lco == NULL) {
+		debug ("Verdict %d for removed lcobject %s", verdict, dsp->txt_dn);
+		return;
+	}
+	struct lcstate **plcs = find_lcstate_ptr (&lco->lcs_first, NULL, dsp->txt_attr, strlen (dsp->txt_attr));
+	if ((plcs == NULL) || ((*plcs)->typ_next != '@')) {
+		debug ("Verdict %d for replaced lcstate %s", verdict, dsp->txt_attr);
+		return;
+	}
+	driver_apply (*plcs, verdict, now);
+	sched_dirty (lce, lco);
+}
+
+
+/* Pass an lcdispatch that was answered to the inbox of its owner, and
+ * wake up the service thread of the owner, like service_signal() does.
+ * This is done by the service thread of an lcpool.
+ */
+void driver_route (struct lcdispatch *dsp, char *answer) {
+	struct lcdriver *owner = dsp->dsp_owner;
+	dsp->dsp_verdict = driver_verdict (answer, dsp->txt_attr);
+	dsp->dsp_next = owner->dsp_inbox;
+	owner->dsp_inbox = dsp;
+	assert (0 == eventfd_write (owner->lcd_env->fd_sigpost, 1));
+}
+
+
+/* Take an lcdispatch out of the ones in flight for an lcworker.  Under
+ * LCD_FRAMES this is the one with the given dispatch id, otherwise it is
+ * the oldest one.  Return NULL when it is not found.
+ */
+struct lcdispatch *driver_inflight_take (struct lcworker *lcw, uint32_t id) {
+	bool by_id = ((lcw->lcw_driver->lcd_flags & LCD_FRAMES) != 0);
+	struct lcdispatch **pdsp = &lcw->dsp_first;
+	while (by_id && (*pdsp != NULL) && ((*pdsp)->dsp_id != id)) {
+		pdsp = &(*pdsp)->dsp_next;
+	}
+	struct lcdispatch *dsp = *pdsp;
+	if (dsp == NULL) {
+		return NULL;
+	}
+	*pdsp = dsp->dsp_next;
+	if (lcw->dsp_last == &dsp->dsp_next) {
+		lcw->dsp_last = pdsp;
+	}
+	lcw->cnt_inflight--;
+	return dsp;
+}
+
+
+/* Apply an answer to the lcdispatch that it belongs to.
+ */
+static void driver_answer_take (struct lcenv *lce, struct lcworker *lcw, uint32_t id, char *answer, time_t now) {
+	struct lcdispatch *dsp = driver_inflight_take (lcw, id);
+	if (dsp == NULL) {
+		syslog (LOG_ERR, "Driver %s answered \"%s\" without a request", lcw->lcw_driver->cmdname, answer);
+		return;
+	}
+	if (dsp->dsp_owner != NULL) {
+		driver_route (dsp, answer);
+	} else {
+		driver_settle (lce, dsp, driver_verdict (answer, dsp->txt_attr), now);
+		free (dsp);
+	}
+	lcw->tim_active = now;
+}
+
+
+/* Process the complete answers in the input buffer of an lcworker, and
+ * return the number of bytes consumed, or -1 for a framing error.  An
+ * answer line that does not fit in the buffer is dropped.
+ */
+static int32_t driver_answers_lines (struct lcenv *lce, struct lcworker *lcw, time_t now) {
+	char *line = lcw->in_buf;
+	char *nl;
+	while (nl = memchr (line, '\n', lcw->in_len - (line - lcw->in_buf)), nl != NULL) {
+		*nl = '\0';
+		driver_answer_take (lce, lcw, 0, line, now);
+		line = nl + 1;
+	}
+	if ((line == lcw->in_buf) && (lcw->in_len == DRIVER_INBUF)) {
+		syslog (LOG_ERR, "Driver %s answered with an overlong line", lcw->lcw_driver->cmdname);
+		return DRIVER_INBUF;
+	}
+	return line - lcw->in_buf;
+}
+//
+static int32_t driver_answers_frames (struct lcenv *lce, struct lcworker *lcw, time_t now) {
+	uint32_t ofs = 0;
+	while (lcw->in_len - ofs >= 8) {
+		uint32_t len, id;
+		memcpy (&len, lcw->in_buf + ofs,     4);
+		memcpy (&id,  lcw->in_buf + ofs + 4, 4);
+		len = ntohl (len);
+		if ((len < 4) || (len > LCFRAME_MAXANSWER - 4)) {
+			syslog (LOG_ERR, "Driver %s answered with a bad frame length %d", lcw->lcw_driver->cmdname, len);
+			return -1;
+		}
+		if (lcw->in_len - ofs < 4 + len) {
+			break;
+		}
+		char answer [64];
+		size_t anslen = len - 4;
+		if (anslen >= sizeof (answer)) {
+			anslen = sizeof (answer) - 1;
+		}
+		memcpy (answer, lcw->in_buf + ofs + 8, anslen);
+		answer [anslen] = '\0';
+		driver_answer_take (lce, lcw, ntohl (id), answer, now);
+		ofs += 4 + len;
+	}
+	return ofs;
+}
+
+
+/* Read the answers from an lcworker under LCD_ACK, and apply each to
+ * the lcdispatch in flight that it belongs to.  When the worker closes
+ * its end or breaks the framing, it is considered dead.
+ */
+void driver_receive (struct lcenv *lce, struct lcworker *lcw) {
+	time_t now = clock_now (lce);
+	bool dead = false;
+	while (!dead) {
+		ssize_t got = read (lcw->cmdfd, lcw->in_buf + lcw->in_len, DRIVER_INBUF - lcw->in_len);
+		if (got < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				dead = true;
+			}
+			break;
+		} else if (got == 0) {
+			dead = true;
+			break;
+		}
+		lcw->in_len += got;
+		int32_t used;
+		if ((lcw->lcw_driver->lcd_flags & LCD_FRAMES) != 0) {
+			used = driver_answers_frames (lce, lcw, now);
+		} else {
+			used = driver_answers_lines (lce, lcw, now);
+		}
+		if (used < 0) {
+			dead = true;
+		} else {
+			lcw->in_len -= used;
+			memmove (lcw->in_buf, lcw->in_buf + used, lcw->in_len);
+		}
+	}
+	if (dead) {
+		syslog (LOG_ERR, "Worker of driver %s closed its connection with %d dispatches in flight", lcw->lcw_driver->cmdname, lcw->cnt_inflight);
+		driver_died (lce, lcw, now);
+	}
+}
+
+
+/* Try to reap the process of an lcworker, without waiting for it.
+ * When it was reaped, report its exit status and stop watching its
+ * pidfd.  Return whether the process was reaped.
+ */
+bool driver_reap (struct lcenv *lce, struct lcworker *lcw) {
+	int chex = 0;
+	pid_t pid = waitpid (lcw->cmdpid, &chex, WNOHANG);
+	if ((pid == 0) || ((pid == -1) && (errno == EINTR))) {
+		return false;
+	}
+	// A pid of -1 with ECHILD means that SIGCHLD is ignored
+	if (((lcw->lcw_flags & LCW_IDLE) == 0) || (chex != 0)) {
+		syslog (LOG_ERR, "Worker of driver %s exited with value %d", lcw->lcw_driver->cmdname, chex);
+	}
+	lcw->cmdpid = -1;
+	if ((lcw->lcw_flags & LCW_WATCHED) != 0) {
+		assert (0 == epoll_ctl (lce->fd_epoll, EPOLL_CTL_DEL, lcw->pidfd, NULL));
+		lcw->lcw_flags &= ~LCW_WATCHED;
+	}
+	if (lcw->pidfd >= 0) {
+		close (lcw->pidfd);
+		lcw->pidfd = -1;
+	}
+	return true;
+}
+
+
+/* Send the lcstates for a restarted lcworker once more.  These are the
+ * lcstates that fired for its lcdriver and lcobjects but that were not
+ * replaced through LDAP or answered with "ok", as told by cnt_missed.
+ * They are made to fire now, ending their lease, because the dispatch
+ * was lost with the worker.  This runs over all lcobjects, which is
+ * acceptable for the rare event of a restart.
+ */
+void driver_replay (struct lcenv *lce, struct lcworker *lcw, time_t now) {
+	struct lcdriver *lcd = lcw->lcw_driver;
+	uint32_t replayed = 0;
+	struct lcobject *lco = lce->lco_first;
+	while (lco != NULL) {
+		bool replay = false;
+		if (driver_worker (lcd, lco) == lcw) {
+			struct lcstate *lcs = lco->lcs_first;
+			while (lcs != NULL) {
+				if ((lcs->typ_next == '@') && (lcs->cnt_missed > 0) &&
+						(0 == strmemcmp (lcd->cmdname, lcs->txt_attr, idlen (lcs->txt_attr)))) {
+					lcs->tim_next = now;
+					lcs->tim_lease = 0;
+					replay = true;
+					replayed++;
+				}
+				lcs = lcs->lcs_next;
+			}
+		}
+		if (replay) {
+			sched_dirty (lce, lco);
+		}
+		lco = lco->lco_next;
+	}
+	debug ("Replaying %d lcstates for driver %s", replayed, lcd->cmdname);
+}
+
+
+/* Restart a dead lcworker that has been reaped.  When this fails, plan
+ * another attempt with exponential fallback.
+ */
+void driver_respawn (struct lcenv *lce, struct lcworker *lcw, time_t now) {
+	struct lcdriver *lcd = lcw->lcw_driver;
+	if (!driver_spawn (lcw)) {
+		syslog (LOG_ERR, "Failed to restart worker of driver %s: %s", lcd->cmdname, strerror (errno));
+		driver_backoff (lcw, now);
+		return;
+	}
+	lcw->out_rd = lcw->out_wr = 0;
+	lcw->in_len = 0;
+	lcw->lcw_flags &= ~LCW_DEAD;
+	lcw->cnt_restarts++;
+	STAT_ADD (lcd->cnt_restarts, 1);
+	syslog (LOG_WARNING, "Restarted worker of driver %s, restart #%d for the driver", lcd->cmdname, lcd->cnt_restarts);
+	driver_replay (lce, lcw, now);
+	// The clients of an lcpool replay their own lcstates
+	if ((lcd->lcd_pool != NULL) && ((lcd->lcd_flags & LCD_SHARED) == 0)) {
+		struct lcdriver *client = lcd->lcd_pool->pol_clients;
+		while (client != NULL) {
+			assert (0 == eventfd_write (client->lcd_env->fd_sigpost, 1));
+			client = client->lcd_nextclient;
+		}
+	}
+}
+
+
+/* Supervise the lcpool of an lcdriver under LCD_SHARED on behalf of its
+ * client lcenv.  Collect the verdicts in the inbox, and replay the own
+ * lcstates for lcworkers that were restarted since we last looked.
+ */
+void driver_shared_supervise (struct lcenv *lce, struct lcdriver *lcd, time_t now) {
+	struct lcenv *poe = lcd->lcd_pool->pol_env;
+	struct lcdriver *pod = &poe->lcd_cmds [0];
+	envown_lock (poe, LIFECYCLE_LOCK_DISPATCH);
+	struct lcdispatch *inbox = lcd->dsp_inbox;
+	lcd->dsp_inbox = NULL;
+	uint32_t wi;
+	for (wi=0; wi<pod->cnt_workers; wi++) {
+		struct lcworker *lcw = &pod->lcw_workers [wi];
+		if (lcd->cnt_seen [wi] != lcw->cnt_restarts) {
+			lcd->cnt_seen [wi] = lcw->cnt_restarts;
+			driver_replay (lce, lcw, now);
+		}
+	}
+	envown_unlock (poe);
+	while (inbox != NULL) {
+		struct lcdispatch *dsp = inbox;
+		inbox = dsp->dsp_next;
+		driver_settle (lce, dsp, dsp->dsp_verdict, now);
+		free (dsp);
+	}
+}
+
+
+/* Return the number of bytes queued for an lcworker, but not yet taken
+ * by the worker.
+ */
+static uint64_t driver_queued (struct lcworker *lcw) {
+	if (lcw->shm_ring != NULL) {
+		return lcw->shm_head - __atomic_load_n (&lcw->shm_ring->shm_tail, __ATOMIC_ACQUIRE);
+	}
+	return (lcw->out_wr - lcw->out_rd) + lcw->out_pend;
+}
+
+
+/* Have epoll watch the pidfd of an lcworker, if it has one, to learn
+ * when the worker exits.
+ */
+static void driver_watch (struct lcenv *lce, struct lcworker *lcw) {
+	if ((lcw->pidfd >= 0) && ((lcw->lcw_flags & LCW_WATCHED) == 0)) {
+		struct epoll_event ev;
+		memset (&ev, 0, sizeof (ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = (void *) lce;
+		assert (0 == epoll_ctl (lce->fd_epoll, EPOLL_CTL_ADD, lcw->pidfd, &ev));
+		lcw->lcw_flags |= LCW_WATCHED;
+	}
+}
+
+
+/* Start an idle lcworker, because it has work to do.  A previous process
+ * that was retired must have been reaped first.  When the start fails,
+ * the worker is considered dead, and restarted with exponential fallback.
+ * Return whether the worker was started.
+ */
+bool driver_wake (struct lcenv *lce, struct lcworker *lcw, time_t now) {
+	if ((lcw->cmdpid > 0) && !driver_reap (lce, lcw)) {
+		return false;
+	}
+	lcw->lcw_flags &= ~LCW_IDLE;
+	if (!driver_spawn (lcw)) {
+		syslog (LOG_ERR, "Failed to start worker of driver %s: %s", lcw->lcw_driver->cmdname, strerror (errno));
+		lcw->lcw_flags |= LCW_DEAD;
+		driver_backoff (lcw, now);
+		return false;
+	}
+	debug ("Started idle worker of driver %s", lcw->lcw_driver->cmdname);
+	lcw->out_rd = lcw->out_wr = 0;
+	lcw->in_len = 0;
+	lcw->tim_active = now;
+	driver_watch (lce, lcw);
+	return true;
+}
+
+
+/* Retire an lcworker that had nothing to do for idle_secs.  Closing its
+ * connection tells it to finish, after which it is reaped.  It is idle
+ * until it is started again.
+ */
+void driver_retire (struct lcenv *lce, struct lcworker *lcw) {
+	debug ("Retiring idle worker of driver %s", lcw->lcw_driver->cmdname);
+	if ((lcw->lcw_flags & (LCW_POLLOUT | LCW_POLLIN)) != 0) {
+		assert (0 == epoll_ctl (lce->fd_epoll, EPOLL_CTL_DEL, lcw->cmdfd, NULL));
+		lcw->lcw_flags &= ~(LCW_POLLOUT | LCW_POLLIN);
+	}
+	close (lcw->cmdfd);
+	lcw->cmdfd = -1;
+	driver_shm_close (lcw);
+	lcw->lcw_flags &= ~LCW_CONGESTED;
+	lcw->lcw_flags |= LCW_IDLE;
+}
+
+
+/* Supervise all lcworkers.  Watch the pidfd of the running ones, and
+ * notice when they exited.  Reap the dead ones, and restart them when
+ * their time has come.  A dead worker that does not exit in time after
+ * being asked to terminate is killed.  Retire workers that were idle
+ * for idle_secs, or look again after idle_secs if they are still busy.
+ * Retired workers are only reaped.  Shared drivers are supervised by
+ * their lcpool, but collect their answers and replays here.
+ */
+void driver_supervise (struct lcenv *lce, time_t now) {
+	uint32_t lcdnum = lce->cnt_cmds;
+	struct lcdriver *lcd = lce->lcd_cmds;
+	while (lcdnum-- > 0) {
+		if (((lcd->lcd_flags & LCD_SHARED) != 0) && (lcd->lcd_pool != NULL)) {
+			driver_shared_supervise (lce, lcd, now);
+		}
+		uint32_t wi;
+		for (wi=0; (lcd->lcw_workers != NULL) && (wi<lcd->cnt_workers); wi++) {
+			struct lcworker *lcw = &lcd->lcw_workers [wi];
+			if ((lcw->lcw_flags & LCW_IDLE) != 0) {
+				if (lcw->cmdpid > 0) {
+					driver_reap (lce, lcw);
+				}
+				continue;
+			}
+			if ((lcw->lcw_flags & LCW_DEAD) == 0) {
+				if (driver_reap (lce, lcw)) {
+					driver_died (lce, lcw, now);
+				}
+			}
+			if ((lcw->lcw_flags & LCW_DEAD) != 0) {
+				if ((lcw->cmdpid > 0) && !driver_reap (lce, lcw)) {
+					if (lcw->tim_restart <= now) {
+						kill (lcw->cmdpid, SIGKILL);
+						lcw->tim_restart = now + 1;
+					}
+				} else if (lcw->tim_restart <= now) {
+					driver_respawn (lce, lcw, now);
+				}
+			} else if ((lcd->idle_secs > 0) && (lcw->tim_active + lcd->idle_secs <= now)) {
+				if ((driver_queued (lcw) == 0) && (lcw->cnt_inflight == 0)) {
+					driver_retire (lce, lcw);
+				} else {
+					lcw->tim_active = now;
+				}
+			}
+			driver_watch (lce, lcw);
+		}
+		lcd++;
+	}
+}
+
+
+/* Return the first time at which an lcworker needs attention, because
+ * it is dead or may have become idle, or MAX_TIME_T for none.
+ */
+time_t driver_next_restart (struct lcenv *lce) {
+	time_t first = MAX_TIME_T;
+	uint32_t lcdnum = lce->cnt_cmds;
+	struct lcdriver *lcd = lce->lcd_cmds;
+	while (lcdnum-- > 0) {
+		uint32_t wi;
+		for (wi=0; (lcd->lcw_workers != NULL) && (wi<lcd->cnt_workers); wi++) {
+			struct lcworker *lcw = &lcd->lcw_workers [wi];
+			time_t when = MAX_TIME_T;
+			if ((lcw->lcw_flags & LCW_DEAD) != 0) {
+				when = lcw->tim_restart;
+			} else if (((lcw->lcw_flags & LCW_IDLE) == 0) && (lcd->idle_secs > 0)) {
+				when = lcw->tim_active + lcd->idle_secs;
+			}
+			if (when < first) {
+				first = when;
+			}
+		}
+		lcd++;
+	}
+	return first;
+}
+
+
+/* Decide whether an lcworker takes more output, based on the watermarks
+ * of its lcdriver.  A worker that is congested takes nothing until its
+ * queue drains to wmk_low; a worker whose queue reaches wmk_high becomes
+ * congested.  A dead worker takes nothing either, and an idle worker is
+ * started first.
+ */
+bool driver_admit (struct lcenv *lce, struct lcworker *lcw, time_t now) {
+	struct lcdriver *lcd = lcw->lcw_driver;
+	if (((lcw->lcw_flags & LCW_IDLE) != 0) && !driver_wake (lce, lcw, now)) {
+		return false;
+	}
+	if ((lcw->lcw_flags & LCW_DEAD) != 0) {
+		return false;
+	}
+	uint64_t queued = driver_queued (lcw);
+	if ((lcw->lcw_flags & LCW_CONGESTED) != 0) {
+		if (queued > lcd->wmk_low) {
+			return false;
+		}
+		debug ("Worker of driver %s drained to %d bytes", lcd->cmdname, (int) queued);
+		lcw->lcw_flags &= ~LCW_CONGESTED;
+	}
+	if (queued >= lcd->wmk_high) {
+		debug ("Worker of driver %s congested with %d bytes", lcd->cmdname, (int) queued);
+		lcw->lcw_flags |= LCW_CONGESTED;
+		STAT_ADD (lcd->cnt_congested, 1);
+		return false;
+	}
+	return true;
+}
+
+
+
+/* Hand the output just queued for an lcworker of an lcpool over to it,
+ * while its pth_envown is held.  The lines are stashed right away,
+ * because the lcobject and lcstate of the client are not protected when
+ * the service thread of the lcpool writes them.  The service thread of
+ * the lcpool is woken up to write the output, like service_signal() does.
+ */
+void driver_handoff (struct lcenv *poe, struct lcworker *lcw) {
+	driver_stash (lcw);
+	assert (0 == eventfd_write (poe->fd_sigpost, 1));
+}
+
+
+/* The process-wide registry of lcpools.
+ */
+static struct lcpool *driver_pools = NULL;
+static pthread_mutex_t driver_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Remove an lcdriver under LCD_SHARED from its lcpool, inasfar as it
+ * was added.  Its dispatches in flight are orphaned, so their answers
+ * are ignored, and its inbox is cleared.  The last client to leave the
+ * lcpool stops it.  This is done while the pth_envown of the lcenv of
+ * the lcdriver is held.
+ */
+void driver_unshare (struct lcdriver *lcd) {
+	struct lcpool *pol = lcd->lcd_pool;
+	if (pol != NULL) {
+		struct lcenv *poe = pol->pol_env;
+		struct lcdriver *pod = &poe->lcd_cmds [0];
+		envown_lock (poe, LIFECYCLE_LOCK_CONTROL);
+		struct lcdriver **pclient = &pol->pol_clients;
+		while (*pclient != lcd) {
+			pclient = &(*pclient)->lcd_nextclient;
+		}
+		*pclient = lcd->lcd_nextclient;
+		uint32_t wi;
+		for (wi=0; wi<pod->cnt_workers; wi++) {
+			struct lcdispatch *dsp = pod->lcw_workers [wi].dsp_first;
+			while (dsp != NULL) {
+				if (dsp->dsp_owner == lcd) {
+					dsp->dsp_owner = NULL;
+				}
+				dsp = dsp->dsp_next;
+			}
+		}
+		while (lcd->dsp_inbox != NULL) {
+			struct lcdispatch *dsp = lcd->dsp_inbox;
+			lcd->dsp_inbox = dsp->dsp_next;
+			free (dsp);
+		}
+		envown_unlock (poe);
+		lcd->lcd_pool = NULL;
+		assert (!pthread_mutex_lock (&driver_pools_lock));
+		if (--pol->pol_refs == 0) {
+			struct lcpool **ppol = &driver_pools;
+			while (*ppol != pol) {
+				ppol = &(*ppol)->pol_next;
+			}
+			*ppol = pol->pol_next;
+		} else {
+			pol = NULL;
+		}
+		assert (!pthread_mutex_unlock (&driver_pools_lock));
+		if (pol != NULL) {
+			pulleyback_close (pol->pol_env);
+			free (pol->pol_spec);
+			free (pol);
+		}
+	}
+	free (lcd->cnt_seen);
+	lcd->cnt_seen = NULL;
+}
+
+
+
+/********** SERVICE THREAD **********/
+
+
+
+/* When a backend instance is openened, it is given its own thread.
+ * When the backend instance is closed, the thread is taken away.
+ * We refer to this thread as the service thread of an lcenv; it
+ * exists only because Pulley retains control while we would like
+ * to respond to timeouts, not just LDAP changes.
+ *
+ * The context of each thread is its own lcenv.  It passes lines
+ * to output drivers, multiple if need be -- LDAP can wait for us.
+ * Output drivers may be assumed to run without cross-connections, so
+ * we need not be afraid of deadlocks there either.
+ * 
+ * On a regular basis however, the thread releases its Mutex lock on
+ * lcenv, and after grabbing it again it will start from scratch.
+ * While the Mutex was held by LDAP, it may have added and deleted
+ * lcobject and lcstate representations, as the environment sees fit.
+ *
+ * The Mutex in the lcenv is claimed during transaction start, and
+ * released after transaction end, good or bad.
+ */
+
+
+
+/* Threads synchronise as follows:
+ *
+ *  0. The threads consist of a pulley backend and individual service
+ *     threads that each handle an lcenv with its subordinate lcobject
+ *     and lcstate data.
+ *  1. The new thread will loop, each time checking if the LCE_SERVICED
+ *     is still set in lce_flags.  This is always done after waiting for
+ *     a signal post, a timeout or driver output.
+ *  2. The main program never cancels the service thread, but resets the
+ *     flag and sends a signal over the fd_sigpost eventfd, which holds
+ *     on to it until the service thread waits for it.
+ *  3. The service thread normally sits waiting in epoll for fd_sigpost,
+ *     which is that new work has arrived.  A signal is sent by any
+ *     txn_done(), and spurious signals should also not wreak more heavoc
+ *     than making another run.  During the wait, changes to the flag
+ *     LCE_SERVICED in lce_flags might be made if the service thread
+ *     needs to finish.
+ *  4. Upon receiving the signal, a complete run through the logic is
+ *     made.  This is another loop however, and it is skipped when
+ *     LCE_SERVICED is no longer set in lce_flags.
+ *  5. When a timer has been set, the epoll wait is embellished with
+ *     its expiration time, and so is the fd_timer timerfd, which also
+ *     wakes the service thread when the wall clock is set.  This is
+ *     another trigger that could lead to a spark of activity in the
+ *     service thread, though specific to the findings during the
+ *     previous loop run.  The signal indicates whether other things
+ *     might also have changed.  Drivers with queued output are also
+ *     waited for, and written to when they have room.
+ *  6. The service thread and pulley backend share a mutex, which is not
+ *     held by the service thread while it waits, but serves to decide who
+ *     may make changes to the lcenv and any lcobject and lcstate
+ *     underneath.  Note that this is a strict hierarchy, without sharing
+ *     between threads.  Between txn_open() and either txn_break() or
+ *     txn_done(), the mutex is held by the transaction.  After a
+ *     preliminary txn_break() the mutex is already gone, and no signal
+ *     sent, but pulley may still believe it is using a transaction.
+ *     Since no further changes are made, this is fine.
+ */
+
+
+
+/* Count a dispatch of an lcstate to a driver, after its firing was
+ * counted.  A firing that was counted before is a retry.  This is done
+ * before tim_next moves on, so the lag of the dispatch can be recorded.
+ */
+void service_count_dispatch (struct lcenv *lce, struct lcdriver *lcd, struct lcobject *lco, struct lcstate *lcs) {
+	uint64_t due = lcs->tim_next * (uint64_t) 1000000000;
+	uint64_t now = lce->lce_clock->realtime_ns (lce->lce_clock);
+	uint64_t lag = (now > due) ? (now - due) : 0;
+	hist_record (&lcd->hst_lag, lag);
+	PROBE5 (dispatch, lcd->cmdname, lco->txt_dn, lcs->txt_attr, lcs->cnt_missed, lag);
+	STAT_ADD (lcd->cnt_dispatched, 1);
+	STAT_ADD (lce->lce_stats.dispatched, 1);
+	if (lcs->cnt_missed > 1) {
+		STAT_ADD (lcd->cnt_retried, 1);
+		STAT_ADD (lce->lce_stats.retried, 1);
+	}
+}
+
+
+/* Dispatch an lcstate to the lcworker of a driver process for its
+ * lcobject.  When the worker holds back, the lcstate is deferred for a
+ * short while; otherwise it is leased, or retried when the output did
+ * not fit.  Under LCD_SHARED, the worker is one of the lcpool, which is
+ * locked meanwhile, and the output is handed over to it.
+ */
+void service_dispatch (struct lcenv *lce, struct lcdriver *lcd, struct lcobject *lco, struct lcstate *lcs, uint16_t event, time_t now) {
+	struct lcenv *ioe = lce;
+	struct lcdriver *iod = lcd;
+	if ((lcd->lcd_flags & LCD_SHARED) != 0) {
+		if (lcd->lcd_pool == NULL) {
+			// Not connected to an lcpool, check again shortly
+			lcs->tim_next = now + DRIVER_RECHECK;
+			return;
+		}
+		ioe = lcd->lcd_pool->pol_env;
+		iod = &ioe->lcd_cmds [0];
+		envown_lock (ioe, LIFECYCLE_LOCK_DISPATCH);
+	}
+	struct lcworker *lcw = driver_worker (iod, lco);
+	if (!driver_admit (ioe, lcw, now)) {
+		// Backpressure from the driver, check again shortly
+		STAT_ADD (lcd->cnt_deferred, 1);
+		lcs->tim_next = now + DRIVER_RECHECK;
+	} else {
+		count_lcstate_firing (lcs);
+		lcs->evt_lease = event;
+		lcs->tim_lease = 0;
+		if (!driver_enqueue (lcw, (ioe != lce) ? lcd : NULL, lco, lcs, now)) {
+			debug ("Output for driver %s is full, will retry", lcd->cmdname);
+			backoff_lcstate_firetime (lcs, now);
+		} else {
+			if (ioe != lce) {
+				driver_handoff (ioe, lcw);
+			}
+			service_count_dispatch (lce, lcd, lco, lcs);
+			// Fire again later, unless LDAP replaces the lcstate
+			bool ack = ((lcd->lcd_flags & LCD_ACK) != 0);
+			lcs->tim_lease = now + (ack ? DRIVER_ACKWAIT : lcd->lease_secs);
+			backoff_lcstate_firetime (lcs, now);
+			if (lcs->tim_next < lcs->tim_lease) {
+				lcs->tim_next = lcs->tim_lease;
+			}
+		}
+	}
+	if (ioe != lce) {
+		envown_unlock (ioe);
+	}
+}
+
+
+/* When a service fires, run over all registered lcstate that have a timer
+ * set to at most the current time; this is always at least one lcstate.
+ *
+ * During the setup of a Pulley Backend instance, a series of drivers for
+ * lifecycle-named processes was started and kept in the
+ * lcenv.  Queue two lines for the driver process, one holding the
+ * distinguishedName of the lcobject, the second with the lifecycleState
+ * from the lcstate.  These are written later, by driver_flush().
+ *
+ * Every lcstate fired is setup for a retry with exponential fallback,
+ * which ends when LDAP replaces the lifecycleState.  The dispatch is
+ * leased, and not repeated before the lease ends, however short the
+ * fallback.  When the driver will answer, the lease lasts DRIVER_ACKWAIT,
+ * and the answer decides on the actual retry time.  A dead driver is
+ * noticed and restarted by driver_supervise().  A plugin driver is called
+ * directly, and answers right away.
+ */
+void service_fire_timer (struct lcobject *lco, struct lcenv *lce, time_t now) {
+	// Find at least one lcstate to fire
+	bool fired_some_lcstate_timer = false;
+	struct lcstate *lcs = lco->lcs_first;
+	debug ("Looking for timers up to %d", now);
+	while (lcs != NULL) {
+		// See if this lcstate wants to fire
+		debug ("Considering type '%c' timer %d", lcs->typ_next, lcs->tim_next);
+		if ((lcs->typ_next == '@') && (lcs->tim_next <= now)) {
+			// Every due lcstate is rescheduled, even without a driver
+			fired_some_lcstate_timer = true;
+			struct lcdriver *lcd = driver_find (lce, lcs);
+			uint16_t event = driver_event_index (lcs);
+			if (lcd == NULL) {
+				// Fire again later, though nobody listens
+				count_lcstate_firing (lcs);
+				backoff_lcstate_firetime (lcs, now);
+			} else if ((lcs->tim_lease > now) && (lcs->evt_lease == event)) {
+				// The previous dispatch is still in flight
+				debug ("Lease on %s holds until %d", lcs->txt_attr, lcs->tim_lease);
+				lcs->tim_next = lcs->tim_lease;
+			} else if ((lcd->lcd_flags & LCD_PLUGIN) != 0) {
+				count_lcstate_firing (lcs);
+				service_count_dispatch (lce, lcd, lco, lcs);
+				lcs->evt_lease = event;
+				lcs->tim_lease = 0;
+				driver_apply (lcs, lcd->plg_fire (lcd->plg_handle,
+						lco->txt_dn, lcs->txt_attr,
+						event, lcs->cnt_missed), now);
+			} else {
+				service_dispatch (lce, lcd, lco, lcs, event, now);
+			}
+		}
+		// Move to the next lcstate for this lcobject
+		lcs = lcs->lcs_next;
+	}
+	assert (fired_some_lcstate_timer);
+}
+
+
+/* Pass through all dirty objects, and check any lcname?events that can
+ * be advanced.  Any other types, such as '@' and '=' will block further
+ * progress, and count as things to report to the handler for the
+ * lifecycle, so it may cycle back through LDAP with updates.
+ *
+ * Objects that are not dirty need not be looked at, because their
+ * lifecycleStates have not changed since they were last advanced.
+ */
+void service_advance_events (struct lcenv *lce) {
+	struct lcobject *lco = lce->sch_timers.lco_dirty;
+	// One run suffices, because objects don't communicate
+	while (lco != NULL) {
+		advance_lcobject_events (lco);
+		lco = lco->lco_schnext;
+	}
+}
+
+
+/* Fire the lcobjects in the calendar slot under the cursor, inasfar as
+ * they are due, and file them anew with their next firing time.  The
+ * ones that are not due yet end up in the same slot again.
+ */
+void service_fire_slot (struct lcenv *lce, time_t now) {
+	struct lcsched *sch = &lce->sch_timers;
+	struct lcobject *todo = sch->lco_slots [sch->sch_cursor];
+	sch->lco_slots [sch->sch_cursor] = NULL;
+	while (todo != NULL) {
+		struct lcobject *lco = todo;
+		todo = lco->lco_schnext;
+		lco->sch_tier = SCHED_NONE;
+		sch->cnt_hot--;
+		if (lco->tim_first <= now) {
+			debug ("service_fire_timer() called because lco->tim_first %d before now %d", lco->tim_first, now);
+			service_fire_timer (lco, lce, now);
+			// Rework the firing time; more lcstate may want to fire
+			update_lcobject_firetime (lco, now);
+		}
+		sched_file (lce, lco);
+	}
+}
+
+
+/* Compare the progress of the wall clock and the monotonic clock since
+ * the previous round, to detect jumps in the wall clock.  A forward jump
+ * makes many timers due at once, so it starts catch-up mode.  A backward
+ * jump merely delays timers, and needs no special treatment.
+ */
+void service_check_clock (struct lcenv *lce, time_t now) {
+	struct lcsched *sch = &lce->sch_timers;
+	time_t mono = clock_mono (lce);
+	time_t jump = (now - sch->tim_lastreal) - (mono - sch->tim_lastmono);
+	if (jump > CLOCKJUMP_SECS) {
+		syslog (LOG_WARNING, "Wall clock jumped %lld seconds forward, catching up on timers", (long long) jump);
+		if (sch->tim_catchup == 0) {
+			sch->tim_catchup = now;
+			STAT_ADD (lce->lce_stats.catchups, 1);
 		}
-		// Move to the next lcstate for this lcobject
-		lcs = lcs->lcs_next;
+	} else if (jump < -CLOCKJUMP_SECS) {
+		syslog (LOG_WARNING, "Wall clock jumped %lld seconds backward, timers are delayed", (long long) -jump);
 	}
-	assert (fired_some_lcstate_timer);
+	sch->tim_lastreal = now;
+	sch->tim_lastmono = mono;
 }
 
 
-/* Pass through all events of all objects, and check any lcname?events
- * that can be advanced.  Any other types, such as '@' and '=' will
- * block further progress, and count as things to report to the handler
- * for the lifecycle, so it may cycle back through LDAP with updates.
+/* Run a round of catch-up mode.  Move the cursor to the current time,
+ * collecting all overdue timers into the late tier.  Then fire at most
+ * CATCHUP_BURST of them, oldest-first, and plan the next round after
+ * CATCHUP_PAUSE seconds.  Catch-up mode ends when the late tier drains.
  */
-void service_advance_events (struct lcenv *lce) {
-	struct lcobject *lco = lce->lco_first;
-	// One run suffices, because objects don't communicate
-	while (lco != NULL) {
-		advance_lcobject_events (lco);
-		lco = lco->lco_next;
+void service_catchup (struct lcenv *lce, time_t now) {
+	struct lcsched *sch = &lce->sch_timers;
+	sched_advance (lce, now);
+	// Move the overdue timers from the cursor slot to the late tier
+	struct lcobject *todo = sch->lco_slots [sch->sch_cursor];
+	sch->lco_slots [sch->sch_cursor] = NULL;
+	while (todo != NULL) {
+		struct lcobject *lco = todo;
+		todo = lco->lco_schnext;
+		lco->sch_tier = SCHED_NONE;
+		sch->cnt_hot--;
+		if (lco->tim_first <= now) {
+			heap_insert (&sch->hea_late, lco, SCHED_LATE);
+		} else {
+			sched_file (lce, lco);
+		}
+	}
+	debug ("Catch-up backlog is %d overdue lcobjects", sch->hea_late.cnt_heap);
+	// Fire the oldest overdue timers
+	uint32_t burst = CATCHUP_BURST;
+	struct lcobject *lco;
+	while ((burst-- > 0) && (lco = heap_top (&sch->hea_late), lco != NULL)) {
+		heap_remove (&sch->hea_late, lco);
+		service_fire_timer (lco, lce, now);
+		update_lcobject_firetime (lco, now);
+		sched_file (lce, lco);
+	}
+	// Plan the next round, or end catch-up mode
+	if (sch->hea_late.cnt_heap > 0) {
+		sch->tim_catchup = now + CATCHUP_PAUSE;
+	} else {
+		syslog (LOG_INFO, "Caught up on timers after the wall clock jump");
+		sch->tim_catchup = 0;
 	}
 }
 
 
-/* Pass through all objects, recomputing their timers when they are smudged
- * and the type is that of a timer, and finally sort the most likely timers
- * to fire soon.
- *
- * The "most likely timers" are a bit like the trickery of "utlist.h" sorting,
- * but the sorting is incomplete.  Only the beginning of the list ends up in
- * order.  Most of the remainder is left in the order it is at.  The entire
- * list is traversed however; this is generally necessary because there may
- * be new timers due to the advancing of services.
- *
- * The selection of "most likely timers" is a gradual process, and works
- * best with the most recent timers in the beginning.  The idea is to have
- * those in there that are at most twice as long away from now as the first
- * timer to expire.  Negative delays pass immediately, of course.  The ones
- * left are sorted by time.
- *
- * The processing that takes care of this is a bit like mitochondria digesting
- * chains of sugars or fats.  Taking a bit from the top, process it, move on.
- * When the time is too far in the future, it is left where it is, on the tail
- * behind the sorted list.  When the time is new enough, it is taken out and
- * inserted in the right place in the (hopefully short) prefix list.
+/* Pass through the dirty objects, recomputing their timers and filing
+ * them into the timer schedule.  Then fire any timers that are due.
  *
- * Once done, the first lcobject is the first to expire.  Any ones that fall
- * before now can be passed through immediately, but at some point the future
- * values show up, in sorted order.  From these, a future timer can be set
- * as an alternative to condition waiting.  But if the first is not a timer
- * then none exists in the list, and only condition waiting should be used.
+ * The timer schedule is a calendar queue, described with struct lcsched.
+ * Its hot tier covers the coming SCHED_HORIZON seconds in slots, and the
+ * far-future timers wait in the cold tier until the horizon reaches them.
+ * The work done here scales with the number of changed and due lcobjects,
+ * not with the total population, most of which sits in the cold tier,
+ * waiting for certificates to expire or to be deprecated.
  *
- * In the exceptional case that past timers take more time than the prepared
- * sorting time, the algorithm may need to run again.  This will be achieved
- * with an ugly goto statement, to avoid the suggestion that it would be a
- * structural action.
+ * Firing starts in the cursor slot, which holds the overdue timers.
+ * When time has moved beyond that slot, the cursor moves forward while
+ * collecting anything left in the slots passed, and promoting cold timers
+ * as the horizon moves along.  The new cursor slot is then fired too.
+ * After a jump of the wall clock, this is replaced with catch-up mode,
+ * to avoid firing a flood of overdue timers at once.
  */
 void service_update_timers (struct lcenv *lce) {
-	time_t now = time (NULL);
-	int32_t accept_upto;
-refresh:
+	struct lcsched *sch = &lce->sch_timers;
+	time_t now = clock_now (lce);
+	service_check_clock (lce, now);
 	//
-	// Construct a list with a time-ordered beginning.
+	// File the dirty objects with their recomputed firing time.
 	//
-	accept_upto = 0x7fffffff;
-	// Initially, we have no objects, just places to insert into
-	struct lcobject **phd = & lce->lco_first;
-	struct lcobject **ptl = phd;
-	struct lcobject  *cur = *phd;
-	// Loop over objects, possibly extending the head or tail
-	while (cur = *ptl, cur != NULL) {
-		bool use = false;
-		// If needed, update the firing time
-		if (smudged_lcobject_firetime (cur)) {
-			update_lcobject_firetime (cur);
-		}
-		// Find the future timing
-		if (cur->tim_first <= now) {
-			// Timer should have fired
-			use = true;
-		} else {
-			// Timer is in the future
-			time_t future = cur->tim_first - now;
-			if (future <= accept_upto) {
-				// Acceptably sized future
-				// (Initially matches almost anything)
-				use = true;
-				if (future < accept_upto/2) {
-					// Radically closer than before
-					accept_upto = future * 2;
-				}
-			}
-		}
-		// We now know if cur should be taken out for sorting
-		if (use) {
-			// Remove cur from the tail
-			*ptl = cur->lco_next;
-			cur->lco_next = NULL;
-			// Find the place for cur after *phead
-			struct lcobject **cmp = phd;
-			time_t curfire = cur->tim_first;
-			while (*cmp != NULL) {
-				if ((*cmp)->tim_first > curfire) {
-					break;
-				}
-				cmp = & (*cmp)->lco_next;
-			}
-			// Insert cur before *cmp (which may be NULL)
-			cur->lco_next = *cmp;
-			if (cmp == ptl) {
-				// Exceptional, insertion at the tail
-				// Avoid seeing the same object again
-				ptl = & cur->lco_next;
-			}
-			*cmp = cur;
-			// Unusual: keep ptl because *ptl has moved
-			continue;
-		} else {
-			// Current-cursor iteration beyond unchanged *ptl
-			ptl = & cur->lco_next;
-		}
+	struct lcobject *lco;
+	while (lco = sch->lco_dirty, lco != NULL) {
+		update_lcobject_firetime (lco, now);
+		sched_file (lce, lco);
 	}
 	//
-	// Run any events up to now in the list.
+	// Run any events up to now in the schedule, or catch up slowly.
 	//
-	time_t newnow;
-	struct lcobject *lco = lce->lco_first;
-	while (newnow = time (NULL),
-			(lco != NULL) && (lco->tim_first <= newnow)) {
-		if (lco->tim_first == (time_t) -1) {
-			//TODO// Quick Hack.  We set -1 in this routine...?
-			debug ("TODO: Quick Hack -- we set -1 in tim_first, probably in this routine?!?");
-			break;
+	if (sch->tim_catchup != 0) {
+		if (sch->tim_catchup <= now) {
+			service_catchup (lce, now);
 		}
-		// Hurry!  We should already have done this!
-		debug ("service_fire_timer() called because lco->tim_first %d before newnow %d", lco->tim_first, newnow);
-		service_fire_timer (lco, lce);
-		// Rework the firing time; more lcstate may want to fire
-		update_lcobject_firetime (lco);
-		// Only iterate when there is no more lcstate to fire
-		if (lco->tim_first > newnow) {
-			lco = lco->lco_next;
+	} else {
+		service_fire_slot (lce, now);
+		if (now - sch->sch_base >= SCHED_SLOTSECS) {
+			sched_advance (lce, now);
+			service_fire_slot (lce, now);
 		}
 	}
-	if (newnow - now > accept_upto) {
-		// We ran so much work that the partial sorting is drained
-		goto refresh;
-	}
+	STAT_SET (lce->lce_stats.backlog, sched_backlog (lce, now));
+	STAT_SET (lce->lce_stats.catching_up, (sch->tim_catchup != 0));
+	STAT_SET (lce->lce_stats.late, sch->hea_late.cnt_heap);
 	//
-	// The first lcobject to fire is now in lco_first, if any.
+	// The first timer to fire is now found with sched_first().
 	//
 	// Return.
 }
 
 
+/* Signal the service thread through its signal post.  This is safe to
+ * do with or without pth_envown; the eventfd remembers the signal until
+ * the service thread picks it up.
+ */
+void service_signal (struct lcenv *lce) {
+	assert (0 == eventfd_write (lce->fd_sigpost, 1));
+}
+
+
+/* Set the timerfd of an lcenv for the wall clock time of the deadline,
+ * or for MAX_TIME_T when there is none.  It is always set, because only
+ * a set timerfd is canceled when the wall clock is set.  Other clocks
+ * than the system clock have no relation to the wall clock, so their
+ * deadlines are left to the timeout_ms of the clock.
+ */
+void service_timer_set (struct lcenv *lce, time_t deadline) {
+	struct itimerspec its;
+	memset (&its, 0, sizeof (its));
+	its.it_value.tv_sec = (lce->lce_clock == &lifecycle_clock_system) ? deadline : MAX_TIME_T;
+	assert (0 == timerfd_settime (lce->fd_timer,
+			TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL));
+}
+
+
 /* We have done all we could, and are now waiting for something positive
- * to come our way.  This may take one of two forms:
- *  - a condition signal over lce_sigpost, indicating a txn_done()
- *  - a timer expiring, namely the first returned after service_update_timers()
+ * to come our way.  This may take one of three forms:
+ *  - a signal over fd_sigpost, indicating a txn_done()
+ *  - a timer expiring, namely the first returned by sched_first()
+ *  - the wall clock being set, which cancels fd_timer
+ *  - a driver pipe with room for more of its queued output
+ *  - a driver socket with answers to dispatches in flight
+ *  - a driver process that exited, or that is due for a restart
  * Note that the timer is optional; there may be none at all.
+ *
+ * The pth_envown mutex is released during the wait, so Pulley can run
+ * its transactions, and claimed again before returning.
  */
 void service_wait (struct lcenv *lce) {
-	// Decide if a timer is waiting to expire
-	time_t first_expiration = MAX_TIME_T;
-	if (lce->lco_first != NULL) {
-		first_expiration = lce->lco_first->tim_first;
+	// Decide if a timer or a driver restart is waiting to expire
+	time_t first_expiration = sched_first (lce);
+	STAT_SET (lce->lce_stats.deadline, (first_expiration < MAX_TIME_T) ? first_expiration : 0);
+	time_t first_restart = driver_next_restart (lce);
+	if (first_restart < first_expiration) {
+		first_expiration = first_restart;
 	}
 	bool with_timer = first_expiration < MAX_TIME_T;
-	// Wait for a condition, with or without a timer
+	int timeout_ms = -1;
 	if (with_timer) {
-		// Setup absolute time structure
-		struct timespec abstime;  /* tv_sec, tv_nsec */
-		memset (&abstime, 0, sizeof (abstime));
-		abstime.tv_sec  = first_expiration;
+		// Ask the clock for the relative time in milliseconds
+		timeout_ms = lce->lce_clock->timeout_ms (lce->lce_clock,
+				first_expiration * (uint64_t) 1000000000);
 		debug ("Service thread: Upcoming wait ends at %d", first_expiration);
-		// Wait for a signal or reaching the absolute time
-		assert (!pthread_cond_timedwait (
-				&lce->pth_sigpost,
-				&lce->pth_envown,
-				&abstime));
-		debug ("Service thread: Wakeup caused by commit, timeout or request to finish");
-	} else {
-		// Wait for a signal but not for a certain time
-		assert (!pthread_cond_wait (
-				&lce->pth_sigpost,
-				&lce->pth_envown));
-		debug ("Service thread: Wakeup caused by commit or request to finish");
 	}
+	service_timer_set (lce, first_expiration);
+	// Wait for a signal, driver output or the timer
+	struct epoll_event evs [16];
+	PROBE2 (service_sleep, lce, timeout_ms);
+	envown_unlock (lce);
+	int evcnt = epoll_wait (lce->fd_epoll, evs, 16, timeout_ms);
+	envown_lock (lce, LIFECYCLE_LOCK_SERVICE);
+	PROBE2 (service_wake, lce, evcnt);
+	if (evcnt < 0) {
+		assert (errno == EINTR);
+		evcnt = 0;
+	}
+	debug ("Service thread: Wakeup caused by %d commit, output or finish events", evcnt);
+	int evi;
+	for (evi=0; evi<evcnt; evi++) {
+		struct lcworker *lcw = (struct lcworker *) evs [evi].data.ptr;
+		if (lcw == NULL) {
+			// Reset the signal post; we will run anyway
+			eventfd_t posts;
+			eventfd_read (lce->fd_sigpost, &posts);
+			if (lce->tim_commit != 0) {
+				hist_record (&lce->hst_wakeup, monotime_ns () - lce->tim_commit);
+				lce->tim_commit = 0;
+			}
+		} else if ((void *) lcw == (void *) lce) {
+			// A worker exited; it is reaped during the next run
+			;
+		} else if ((void *) lcw == (void *) &lce->fd_timer) {
+			// The deadline passed, or the wall clock was set and
+			// the next run compares it to the monotonic clock
+			uint64_t expiries;
+			if ((read (lce->fd_timer, &expiries, sizeof (expiries)) == -1) && (errno == ECANCELED)) {
+				debug ("Service thread: Wall clock was set");
+			}
+		} else {
+			uint32_t what = evs [evi].events;
+			// The worker has answers, or closed its connection
+			if ((lcw->lcw_flags & LCW_POLLIN) && (what & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				driver_receive (lce, lcw);
+			}
+			// The worker has room for more output
+			if (what & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+				driver_flush (lce, lcw);
+			}
+		}
+	}
+}
+
+
+/* Count the rounds of the service thread that begin and end, and wake
+ * up pulleyback_lifecycle_sync() when one ends.  This is also done when
+ * the service thread stops, so the waiters notice that.  The counters
+ * have a mutex of their own, so waiting for them does not hold up the
+ * service thread, nor show up in the lock statistics of pth_envown.
+ */
+void service_round_begin (struct lcenv *lce) {
+	assert (!pthread_mutex_lock (&lce->pth_rounds));
+	lce->cnt_rounds++;
+	assert (!pthread_mutex_unlock (&lce->pth_rounds));
+}
+//
+void service_round_end (struct lcenv *lce) {
+	assert (!pthread_mutex_lock (&lce->pth_rounds));
+	lce->cnt_roundsdone = lce->cnt_rounds;
+	assert (!pthread_cond_broadcast (&lce->pth_roundend));
+	assert (!pthread_mutex_unlock (&lce->pth_rounds));
 }
 
 
@@ -917,24 +3318,36 @@ void service_wait (struct lcenv *lce) {
 void *service_main (void *ctx) {
 	struct lcenv *lce = (struct lcenv *) ctx;
 	assert (lce != NULL);
+	// Report a failed driver with EPIPE, not with SIGPIPE
+	sigset_t sigpipe;
+	sigemptyset (&sigpipe);
+	sigaddset (&sigpipe, SIGPIPE);
+	pthread_sigmask (SIG_BLOCK, &sigpipe, NULL);
 	// We claim lcobject and lcstate access
-	assert (!pthread_mutex_lock (&lce->pth_envown));
+	envown_lock (lce, LIFECYCLE_LOCK_SERVICE);
 	debug ("Service thread: Started");
 	// Enter the main loop of the service thread
 	while (lce->lce_flags & LCE_SERVICED) {
+		service_round_begin (lce);
+		// Reap and restart drivers that died, replaying their work
+		driver_supervise (lce, clock_now (lce));
 		// Advance any events that can proceed right now
 		debug ("Service thread: Advancing lcname?evname events");
 		service_advance_events (lce);
 		// Update timers and find the first @timer to fire
 		debug ("Service thread: Updating timers");
 		service_update_timers (lce);
+		// Write what the drivers take of the output queued
+		driver_flush_all (lce);
+		service_round_end (lce);
 		// Wait for commit from Pulley, or optional timer expiration
 		debug ("Service thread: Waiting for commit (or timer expiration)");
 		service_wait (lce);
 	}
 	// Free our mutex lock so the main thread can grab it back
 	debug ("Service thread: Stopping");
-	pthread_mutex_unlock (&lce->pth_envown);
+	service_round_end (lce);
+	envown_unlock (lce);
 	pthread_exit (NULL);
 	return NULL;
 }
@@ -946,9 +3359,25 @@ void service_start (struct lcenv *lce) {
 	// Check and set the LCE_SERVICED flag to allow looping
 	assert ((lce->lce_flags & LCE_SERVICED) == 0);
 	lce->lce_flags |= LCE_SERVICED;
-	// Prepare mutex and wait condition, then create the service thread
+	// Start the timer schedule from the current time
+	sched_init (lce, clock_now (lce));
+	// Prepare mutex, signal post, timer and epoll, then create the service thread
 	assert (!pthread_mutex_init (&lce->pth_envown,  NULL));
-	assert (!pthread_cond_init  (&lce->pth_sigpost, NULL));
+	assert (!pthread_mutex_init (&lce->pth_rounds,  NULL));
+	assert (!pthread_cond_init  (&lce->pth_roundend, NULL));
+	lce->fd_sigpost = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	assert (lce->fd_sigpost >= 0);
+	lce->fd_timer = timerfd_create (CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	assert (lce->fd_timer >= 0);
+	lce->fd_epoll = epoll_create1 (EPOLL_CLOEXEC);
+	assert (lce->fd_epoll >= 0);
+	struct epoll_event ev;
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	assert (0 == epoll_ctl (lce->fd_epoll, EPOLL_CTL_ADD, lce->fd_sigpost, &ev));
+	ev.data.ptr = &lce->fd_timer;
+	assert (0 == epoll_ctl (lce->fd_epoll, EPOLL_CTL_ADD, lce->fd_timer, &ev));
 	assert (!pthread_create     (&lce->pth_service, NULL,
 	                             service_main, (void *) lce));
 }
@@ -961,18 +3390,21 @@ void service_stop (struct lcenv *lce) {
 	assert ((lce->lce_flags & LCE_SERVICED) != 0);
 	lce->lce_flags &= ~LCE_SERVICED;
 	// Block the service thread at the end of the loop
-	assert (!pthread_mutex_lock (&lce->pth_envown));
+	envown_lock (lce, LIFECYCLE_LOCK_CONTROL);
 	debug ("Sending final signal to service thread");
-	assert (!pthread_cond_signal (&lce->pth_sigpost));
-	assert (!pthread_mutex_unlock (&lce->pth_envown));
-	// Stop the service thread and cleanup wait condition and mutex
+	service_signal (lce);
+	envown_unlock (lce);
+	// Stop the service thread and cleanup signal post, timer and mutex
 	void *exitval;
 	assert (!pthread_join (lce->pth_service, &exitval));
 	// Nobody is watching, so we can safely cleanup resources
-	assert (!pthread_cond_destroy  (&lce->pth_sigpost));
-	assert (!pthread_mutex_unlock  (&lce->pth_envown));
-	//LINUX_FAILS// assert (!pthread_mutex_destroy (&lce->pth_envown));
-	assert ((!pthread_mutex_destroy (&lce->pth_envown) || (errno == 0)));
+	close (lce->fd_epoll);
+	close (lce->fd_timer);
+	close (lce->fd_sigpost);
+	// The service thread unlocked the mutex as it ended
+	assert (!pthread_mutex_destroy (&lce->pth_envown));
+	assert (!pthread_cond_destroy  (&lce->pth_roundend));
+	assert (!pthread_mutex_destroy (&lce->pth_rounds));
 }
 
 
@@ -1036,6 +3468,10 @@ void debug_lcenv (struct lcenv *lce) {
 		lco = lco->lco_next;
 	}
 }
+#else
+void debug_lcenv (struct lcenv *lce) {
+	(void) lce;
+}
 #endif
 
 
@@ -1050,8 +3486,10 @@ void debug_lcenv (struct lcenv *lce) {
 void txn_open (struct lcenv *lce) {
 	assert (! txn_isactive  (lce));
 	assert (! txn_isaborted (lce));
-	// Obtain ownership of this lcenv
-	assert (!pthread_mutex_lock (&lce->pth_envown));
+	// Obtain ownership of this lcenv, timing how long Pulley is held up
+	uint64_t waited = envown_lock (lce, LIFECYCLE_LOCK_TXN);
+	hist_record (&lce->hst_addwait, waited);
+	PROBE2 (txn_open, lce, waited);
 	// Create the smallest transaction cycle, containing just us
 	lce->env_txncycle = lce;
 	// Setup each lcobject for attribute changes
@@ -1091,16 +3529,23 @@ void txn_break (struct lcenv *lce) {
 				struct lcstate *next = lcs->lcs_next;
 				lcs->lcs_next = NULL;
 				free_lcstate (&lcs);
+				STAT_SUB (lce->lce_stats.states, 1);
 				lcs = next;
 			}
 			lco->lcs_toadd = NULL;
 			lco->lcs_todel = NULL;
+			// Additions smudged tim_first, so reschedule
+			if (smudged_lcobject_firetime (lco)) {
+				sched_dirty (lce, lco);
+			}
 			lco = lco->lco_next;
 		}
 		// Communicate failure through the pulley backend
 		txn_isaborted_set (lce);
+		STAT_ADD (lce->lce_stats.txn_aborted, 1);
+		PROBE2 (txn_break, lce, lce->tim_envheld);
 		// Release the ownership hold on this lcenv
-		assert (!pthread_mutex_unlock (&lce->pth_envown));
+		envown_unlock (lce);
 		// Move to the next lcenv in the transaction cycle, if any
 		lce = txnext;
 	}
@@ -1126,6 +3571,10 @@ void txn_done (struct lcenv *lce) {
 			struct lcobject *lco = *plco;
 			struct lcstate **plcs = & lco->lcs_toadd;
 			struct lcstate *next;
+			if (lco->lcs_todel != NULL) {
+				// Deleted timers may have set tim_first
+				smudge_lcobject_firetime (lco);
+			}
 			while (next = *plcs, next != lco->lcs_todel) {
 				plcs = & next->lcs_next;
 			}
@@ -1135,6 +3584,7 @@ void txn_done (struct lcenv *lce) {
 				next = this->lcs_next;
 				this->lcs_next = NULL;
 				free_lcstate (&this);
+				STAT_SUB (lce->lce_stats.states, 1);
 			}
 			lco->lcs_first = lco->lcs_toadd;
 			lco->lcs_toadd = NULL;
@@ -1143,18 +3593,29 @@ void txn_done (struct lcenv *lce) {
 				// Empty object.  Cleanup and resample *plco
 				*plco = lco->lco_next;
 				HASH_DELETE (hsh_dn, lce->lco_dnhash, lco);
+				sched_unlink (lce, lco);
 				lco->lco_next = NULL;
 				free_lcobject (&lco);
+				STAT_SUB (lce->lce_stats.objects, 1);
 			} else {
-				// Proper object.  Continue to next *plco
+				// Proper object.  Reschedule if it changed
+				if (smudged_lcobject_firetime (lco)) {
+					sched_dirty (lce, lco);
+				}
+				// Continue to next *plco
 				plco = & lco->lco_next;
 			}
 		}
 		// Communicate success to the service thread
+		STAT_ADD (lce->lce_stats.txn_committed, 1);
+		if (lce->tim_commit == 0) {
+			lce->tim_commit = monotime_ns ();
+		}
 		debug ("Signaling the Service thread about the commit");
-		assert (!pthread_cond_signal (&lce->pth_sigpost));
+		service_signal (lce);
+		PROBE2 (txn_done, lce, lce->tim_envheld);
 		// Release the ownership hold on this lcenv
-		assert (!pthread_mutex_unlock (&lce->pth_envown));
+		envown_unlock (lce);
 		// Move to the next lcenv in the transaction cycle, if any
 		lce = txnext;
 	}
@@ -1177,6 +3638,148 @@ void txn_emptydata (struct lcenv *lce) {
 
 
 
+/********** RECORDING **********/
+
+
+
+/* The calls to the PulleyBack can be traced to a file, as described for
+ * struct lcrecord, to be replayed later as a benchmark or regression test
+ * without LDAP or Pulley.  The trace file is shared by all lcenvs in the
+ * process, and opened when the first one is opened.  Records are written
+ * through stdio buffers, which are flushed when a transaction ends.
+ */
+static FILE *record_file = NULL;
+static bool record_tried = false;
+static uint16_t record_envs = 0;
+static uint64_t record_start = 0;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Find the size of a DER value, including its header.  When its length
+ * cannot be parsed, only the header is counted, which will fail to parse
+ * again when it is replayed.
+ */
+size_t der_size (uint8_t *der) {
+	uint8_t lenbyte = der [1];
+	if ((lenbyte & 0x80) == 0x00) {
+		return 2 + lenbyte;
+	}
+	switch (lenbyte & 0x7f) {
+	case 1:
+		return 3 + der [2];
+	case 2:
+		return 4 + ((der [2] << 8) | der [3]);
+	default:
+		return 2;
+	}
+}
+
+
+/* Number a new lcenv for the trace, or return 0 when calls are not
+ * traced.  The first call opens the trace file, if one is named in the
+ * environment variable LCREC_ENVVAR.
+ */
+uint16_t record_open (void) {
+	assert (!pthread_mutex_lock (&record_lock));
+	if (!record_tried) {
+		record_tried = true;
+		char *path = getenv (LCREC_ENVVAR);
+		if (path != NULL) {
+			record_file = fopen (path, "wb");
+			uint32_t head [2] = { LCREC_MAGIC, LCREC_VERSION };
+			if ((record_file == NULL) || (fwrite (head, sizeof (head), 1, record_file) != 1)) {
+				syslog (LOG_ERR, "Failed to start trace file %s: %s", path, strerror (errno));
+				if (record_file != NULL) {
+					fclose (record_file);
+					record_file = NULL;
+				}
+			}
+			record_start = monotime_ns ();
+		}
+	}
+	uint16_t env = 0;
+	if ((record_file != NULL) && (record_envs < UINT16_MAX)) {
+		env = ++record_envs;
+	}
+	assert (!pthread_mutex_unlock (&record_lock));
+	return env;
+}
+
+
+/* Write a record to the trace file, with up to two pieces of data.
+ * The trace file is flushed when a transaction or lcenv ends.
+ */
+void record_write (uint8_t type, uint16_t env, int result, void *data1, size_t len1, void *data2, size_t len2) {
+	assert (!pthread_mutex_lock (&record_lock));
+	if (record_file != NULL) {
+		struct lcrecord rec;
+		memset (&rec, 0, sizeof (rec));
+		rec.rec_type   = type;
+		rec.rec_result = result;
+		rec.rec_env    = env;
+		rec.rec_len    = len1 + len2;
+		rec.rec_time   = monotime_ns () - record_start;
+		bool ok = (fwrite (&rec, sizeof (rec), 1, record_file) == 1);
+		ok = ok && ((len1 == 0) || (fwrite (data1, len1, 1, record_file) == 1));
+		ok = ok && ((len2 == 0) || (fwrite (data2, len2, 1, record_file) == 1));
+		if ((type == LCREC_COMMIT) || (type == LCREC_ROLLBACK) || (type == LCREC_CLOSE)) {
+			ok = ok && (fflush (record_file) == 0);
+		}
+		if (!ok) {
+			syslog (LOG_ERR, "Failed to write trace file, stopping the trace: %s", strerror (errno));
+			fclose (record_file);
+			record_file = NULL;
+		}
+	}
+	assert (!pthread_mutex_unlock (&record_lock));
+}
+
+
+/* Trace a call to pulleyback_open(), with its arguments.
+ */
+void record_args (uint16_t env, int result, int argc, char **argv, int varc) {
+	size_t len = sizeof (uint32_t);
+	int argi;
+	for (argi=0; argi<argc; argi++) {
+		len += strlen (argv [argi]) + 1;
+	}
+	char *args = malloc (len);
+	if (args == NULL) {
+		syslog (LOG_ERR, "Failed to trace pulleyback_open() for lack of memory");
+		return;
+	}
+	uint32_t varc32 = varc;
+	memcpy (args, &varc32, sizeof (varc32));
+	char *arg = args + sizeof (varc32);
+	for (argi=0; argi<argc; argi++) {
+		size_t arglen = strlen (argv [argi]) + 1;
+		memcpy (arg, argv [argi], arglen);
+		arg += arglen;
+	}
+	record_write (LCREC_OPEN, env, result, args, len, NULL, 0);
+	free (args);
+}
+
+
+/* Trace a call on an lcenv, if it is traced.  A fork is traced by its
+ * two DER values.
+ */
+void record_call (struct lcenv *lce, uint8_t type, int result) {
+	if (lce->rec_env != 0) {
+		record_write (type, lce->rec_env, result, NULL, 0, NULL, 0);
+	}
+}
+//
+void record_fork (struct lcenv *lce, uint8_t type, int result, der_t *forkdata) {
+	if (lce->rec_env != 0) {
+		record_write (type, lce->rec_env, result,
+				forkdata [0], der_size (forkdata [0]),
+				forkdata [1], der_size (forkdata [1]));
+	}
+}
+
+
+
 /********** PULLEY BACKEND **********/
 
 
@@ -1188,25 +3791,21 @@ struct fork {
 
 
 
-/* Open a PullayBack for Life Cycle Management.
+/* Open an lcenv with its drivers and service thread, without joining
+ * the lcpools of shared drivers and without tracing.  This is used for
+ * pulleyback_open() as well as for the lcenv of an lcpool.
  *
- * When our PulleyBack is opened, we load the external program
- * for each kind of life cycle.  We encapsulate them so that we
- * can cyclically pipe in two kinds of lines: *( DN, lcstate )
- *
- * The number of variables must be 2, for DN and lcstate.
- *
- * The handle returned is an lcenv pointer.
+ * Return the lcenv, or NULL with errno set.
  */
-void *pulleyback_open (int argc, char **argv, int varc) {
+static struct lcenv *_int_pb_open (int argc, char **argv, int varc) {
 	if ((argc < 2) || (varc != 2)) {
 		errno = EINVAL;
 		return NULL;
 	}
 	int argi;
 	for (argi=1; argi<argc; argi++) {
-		char sep = argv [argi] [idlen (argv [argi])];
-		if (sep != '=') {
+		struct lcdriver syntax;
+		if (driver_parse_arg (argv [argi], &syntax) == NULL) {
 			errno = EINVAL;
 			return NULL;
 		}
@@ -1222,16 +3821,21 @@ void *pulleyback_open (int argc, char **argv, int varc) {
 	//
 	// lco_first reset to NULL by calloc()
 	// env_txncycle reset to NULL by calloc()
-	// All lcdriver have a cmdname NULL and cmdpipe NULL, which is safe
+	lce->lce_clock = clock_default;
+	// All lcdriver have a cmdname NULL and lcw_workers NULL, which is safe
 	//
-	// Now to fill lcdriver: cmdname, cmdpipe, cmdproc.
+	// Now to fill lcdriver: cmdname, cmdline, options and workers.
 	lce->cnt_cmds = argc - 1;
 	struct lcdriver *lcd = &lce->lcd_cmds [0];
 	for (argi=1; argi<argc; argi++) {
 		size_t argl = idlen (argv [argi]);
+		lcd->cmdline = strdup (driver_parse_arg (argv [argi], lcd));
 		lcd->cmdname = strndup (argv [argi], argl);
-		lcd->cmdpipe = popen (argv [argi] + argl + 1, "w");
-		if ((lcd->cmdname == NULL) || (lcd->cmdpipe == NULL)) {
+		lcd->lcd_env = lce;
+		if ((lcd->cmdname == NULL) || (lcd->cmdline == NULL)) {
+			// errno is already set
+			bad++;
+		} else if (!driver_start (lcd)) {
 			// errno is already set
 			bad++;
 		}
@@ -1241,12 +3845,149 @@ void *pulleyback_open (int argc, char **argv, int varc) {
 	service_start (lce);
 	// Return the result
 done:
-	if (bad > 0) {
-		if (lce != NULL) {
+	if ((bad > 0) && (lce != NULL)) {
+		pulleyback_close ((void *) lce);
+		lce = NULL;
+	}
+	return lce;
+}
+
+
+/* Form the pol_spec of the lcpool for an lcdriver under LCD_SHARED, from
+ * the options that driver_parse_arg() filled in and the command.  It is
+ * the argument for the lcpool without its lifecycle name, so lcdrivers
+ * for other lifecycles can share it, and without the shared option, so
+ * the lcpool runs its own lcworkers.  The options are listed in a fixed
+ * order, so their order in the argument does not matter.
+ * Return the pol_spec, or NULL with errno set.
+ */
+char *driver_pool_spec (struct lcdriver *lcd) {
+	uint32_t flags = lcd->lcd_flags;
+	char opts [128];
+	snprintf (opts, sizeof (opts), ",workers:%u,lease:%u,idle:%u,high:%u,low:%u%s%s%s%s=",
+			lcd->cnt_workers, lcd->lease_secs, lcd->idle_secs,
+			lcd->wmk_high, lcd->wmk_low,
+			((flags & LCD_ACK   ) != 0) ? ",ack"    : "",
+			((flags & LCD_FRAMES) != 0) ? ",frames" : "",
+			((flags & LCD_SHM   ) != 0) ? ",shm"    : "",
+			((flags & LCD_LAZY  ) != 0) ? ",lazy"   : "");
+	char *spec = malloc (strlen (opts) + strlen (lcd->cmdline) + 1);
+	if (spec == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	strcpy (spec, opts);
+	strcat (spec, lcd->cmdline);
+	return spec;
+}
+
+
+/* Make an lcdriver under LCD_SHARED a client of the lcpool for its
+ * command and options, and start the lcpool if it is the first.  This
+ * is done after the service thread of the lcenv started, while its
+ * pth_envown is held, because the lcpool may signal it from then on.
+ * The lcenv of the lcpool is opened internally, under the lifecycle name
+ * of its first client, so it is not traced; replaying the trace of the
+ * clients sets it up again.
+ * Return success as true, failure as false with errno set.
+ */
+bool driver_share (struct lcdriver *lcd) {
+	// The lcpool has as many lcworkers as its options say
+	lcd->cnt_seen = calloc (lcd->cnt_workers, sizeof (uint32_t));
+	char *spec = driver_pool_spec (lcd);
+	if ((lcd->cnt_seen == NULL) || (spec == NULL)) {
+		free (spec);
+		errno = ENOMEM;
+		return false;
+	}
+	assert (!pthread_mutex_lock (&driver_pools_lock));
+	struct lcpool *pol = driver_pools;
+	while ((pol != NULL) && (0 != strcmp (pol->pol_spec, spec))) {
+		pol = pol->pol_next;
+	}
+	if (pol == NULL) {
+		pol = calloc (1, sizeof (struct lcpool));
+		char *arg = malloc (strlen (lcd->cmdname) + strlen (spec) + 1);
+		if (arg != NULL) {
+			strcpy (arg, lcd->cmdname);
+			strcat (arg, spec);
+		}
+		char *argv [] = { "lifecycle", arg, NULL };
+		if ((pol == NULL) || (arg == NULL) || ((pol->pol_env = _int_pb_open (2, argv, 2)) == NULL)) {
+			int err = ((pol == NULL) || (arg == NULL)) ? ENOMEM : errno;
+			assert (!pthread_mutex_unlock (&driver_pools_lock));
+			free (arg);
+			free (pol);
+			free (spec);
+			errno = err;
+			return false;
+		}
+		free (arg);
+		pol->pol_spec = spec;
+		spec = NULL;
+		pol->pol_next = driver_pools;
+		driver_pools = pol;
+	}
+	free (spec);
+	struct lcenv *poe = pol->pol_env;
+	struct lcdriver *pod = &poe->lcd_cmds [0];
+	pol->pol_refs++;
+	envown_lock (poe, LIFECYCLE_LOCK_CONTROL);
+	pod->lcd_pool = pol;
+	uint32_t wi;
+	for (wi=0; wi<pod->cnt_workers; wi++) {
+		lcd->cnt_seen [wi] = pod->lcw_workers [wi].cnt_restarts;
+	}
+	lcd->lcd_pool = pol;
+	lcd->lcd_nextclient = pol->pol_clients;
+	pol->pol_clients = lcd;
+	envown_unlock (poe);
+	assert (!pthread_mutex_unlock (&driver_pools_lock));
+	return true;
+}
+
+
+/* Open a PullayBack for Life Cycle Management.
+ *
+ * When our PulleyBack is opened, we load the external program
+ * for each kind of life cycle.  We encapsulate them so that we
+ * can cyclically pipe in two kinds of lines: *( DN, lcstate )
+ *
+ * The number of variables must be 2, for DN and lcstate.
+ *
+ * The handle returned is an lcenv pointer.
+ */
+void *pulleyback_open (int argc, char **argv, int varc) {
+	struct lcenv *lce = _int_pb_open (argc, argv, varc);
+	// Join the lcpools for shared drivers, now that we can be signaled
+	if (lce != NULL) {
+		int bad = 0;
+		envown_lock (lce, LIFECYCLE_LOCK_CONTROL);
+		struct lcdriver *lcd = &lce->lcd_cmds [0];
+		int argi;
+		for (argi=1; argi<argc; argi++) {
+			if ((bad == 0) && ((lcd->lcd_flags & LCD_SHARED) != 0)) {
+				if (!driver_share (lcd)) {
+					// errno is already set
+					bad++;
+				}
+			}
+			lcd++;
+		}
+		envown_unlock (lce);
+		if (bad > 0) {
+			int err = errno;
 			pulleyback_close ((void *) lce);
 			lce = NULL;
+			errno = err;
 		}
 	}
+	// Trace the call, and further calls if it succeeded
+	uint16_t rec_env = record_open ();
+	if (lce != NULL) {
+		lce->rec_env = rec_env;
+	}
+	record_args ((lce != NULL) ? rec_env : 0, (lce != NULL), argc, argv, varc);
 	return lce;
 }
 
@@ -1255,10 +3996,20 @@ done:
  */
 void pulleyback_close (void *pbh) {
 	struct lcenv *lce = (struct lcenv *) pbh;
+	record_call (lce, LCREC_CLOSE, 1);
 	// Inasfar as we are in a transaction, break it off
 	if (txn_isactive (lce)) {
 		txn_break (lce);
 	}
+	// Leave the lcpools of shared drivers, before they can signal us
+	envown_lock (lce, LIFECYCLE_LOCK_CONTROL);
+	uint32_t lcdi;
+	for (lcdi=0; lcdi<lce->cnt_cmds; lcdi++) {
+		if ((lce->lcd_cmds [lcdi].lcd_flags & LCD_SHARED) != 0) {
+			driver_unshare (&lce->lcd_cmds [lcdi]);
+		}
+	}
+	envown_unlock (lce);
 	// Ask the service thread to exit, and wait for it to happen
 	service_stop (lce);
 	// All lcobjects and lcstates will now be cleaned up
@@ -1270,16 +4021,15 @@ void pulleyback_close (void *pbh) {
 		free_lcobject (&lco);
 		lco = lcn;
 	}
+	sched_fini (lce);
 	// Cleanup lcdriver entries, inasfar as they are present:
 	uint32_t argi = 0;
 	struct lcdriver *lcd = &lce->lcd_cmds [0];
 	while (argi++ < lce->cnt_cmds) {
-		if (lcd->cmdpipe != NULL) {
-			int chex = pclose (lcd->cmdpipe);
-			if (chex != 0) {
-				syslog (LOG_ERR, "Error exit value %d from #%d commdn pipe %s", chex, argi-1, lcd->cmdname ? lcd->cmdname : "(failed)");
-			}
-			lcd->cmdpipe = NULL;
+		driver_stop (lcd);
+		if (lcd->cmdline != NULL) {
+			free (lcd->cmdline);
+			lcd->cmdline = NULL;
 		}
 		if (lcd->cmdname != NULL) {
 			free (lcd->cmdname);
@@ -1345,6 +4095,8 @@ static int _int_pb_addnotdel (bool add_not_del,
 	// In case of failure, stop now and make no changes
 	if (!success) {
 		debug ("Failed to add or delete an attribute");
+		STAT_ADD (lce->lce_stats.forks_rejected, 1);
+		PROBE4 (fork_reject, lce, add_not_del, dnstr, lcsstr);
 		// The transaction is open, so we must break it
 		txn_break (lce);
 		return 0;
@@ -1366,6 +4118,7 @@ static int _int_pb_addnotdel (bool add_not_del,
 			lco->lco_next = lce->lco_first;
 			lce->lco_first = lco;
 			HASH_ADD (hsh_dn, lce->lco_dnhash, txt_dn, dnlen, lco);
+			STAT_ADD (lce->lce_stats.objects, 1);
 			debug_lcenv (lce);
 		}
 		// While adding, we may have to add an lcstate for an LCS
@@ -1373,6 +4126,7 @@ static int _int_pb_addnotdel (bool add_not_del,
 		if (success) {
 			debug ("Addition without lifecycleState, will add it");
 			new_lcstate (lco, lcsstr, lcslen);
+			STAT_ADD (lce->lce_stats.states, 1);
 		} else {
 			debug ("Doubly added lifecycleState, rejecting");
 		}
@@ -1401,7 +4155,14 @@ static int _int_pb_addnotdel (bool add_not_del,
 	}
 	// Rollback the internal transaction if we failed
 	if (!success) {
+		PROBE4 (fork_reject, lce, add_not_del, dnstr, lcsstr);
 		txn_break (lce);
+	} else if (add_not_del) {
+		PROBE4 (fork_accept, lce, add_not_del, dnstr, lcsstr);
+		STAT_ADD (lce->lce_stats.forks_added, 1);
+	} else {
+		PROBE4 (fork_accept, lce, add_not_del, dnstr, lcsstr);
+		STAT_ADD (lce->lce_stats.forks_deleted, 1);
 	}
 	// Communicate to the Pulley Backend if we succeeded
 	return success ? 1 : 0;
@@ -1419,7 +4180,9 @@ static int _int_pb_addnotdel (bool add_not_del,
 int pulleyback_add (void *pbh, der_t *forkdata) {
 	struct lcenv *lce = (struct lcenv *) pbh;
 	struct fork *fd = (struct fork *) forkdata;
-	return _int_pb_addnotdel (true, lce, fd);
+	int rv = _int_pb_addnotdel (true, lce, fd);
+	record_fork (lce, LCREC_ADD, rv, forkdata);
+	return rv;
 }
 
 
@@ -1434,7 +4197,9 @@ int pulleyback_add (void *pbh, der_t *forkdata) {
 int pulleyback_del (void *pbh, der_t *forkdata) {
 	struct lcenv *lce = (struct lcenv *) pbh;
 	struct fork *fd = (struct fork *) forkdata;
-	return _int_pb_addnotdel (false, lce, fd);
+	int rv = _int_pb_addnotdel (false, lce, fd);
+	record_fork (lce, LCREC_DEL, rv, forkdata);
+	return rv;
 }
 
 
@@ -1442,11 +4207,13 @@ int pulleyback_del (void *pbh, der_t *forkdata) {
  */
 int pulleyback_reset (void *pbh) {
 	struct lcenv *lce = (struct lcenv *) pbh;
-	if (!txn_isactive (lce)) {
-		return 0;
+	int rv = 0;
+	if (txn_isactive (lce)) {
+		txn_emptydata (lce);
+		rv = 1;
 	}
-	txn_emptydata (lce);
-	return 1;
+	record_call (lce, LCREC_RESET, rv);
+	return rv;
 }
 
 
@@ -1463,7 +4230,9 @@ int pulleyback_reset (void *pbh) {
 int pulleyback_prepare   (void *pbh) {
 	struct lcenv *lce = (struct lcenv *) pbh;
 	// Only read txn_isaborted(); it is cleaned up in the decision
-	return txn_isaborted (lce) ? 0 : 1;
+	int rv = txn_isaborted (lce) ? 0 : 1;
+	record_call (lce, LCREC_PREPARE, rv);
+	return rv;
 }
 
 
@@ -1472,18 +4241,21 @@ int pulleyback_prepare   (void *pbh) {
  */
 int pulleyback_commit    (void *pbh) {
 	struct lcenv *lce = (struct lcenv *) pbh;
+	int rv;
 	if (txn_isaborted (lce)) {
 		// Caller had better used used pulleyback_prepare()
 		txn_isaborted_clr (lce);
-		return 0;
+		rv = 0;
 	} else if (txn_isactive (lce)) {
 		// Commit changes and return the result
 		txn_done (lce);
-		return 1;
+		rv = 1;
 	} else {
 		// Trivial, nothing has been done
-		return 1;
+		rv = 1;
 	}
+	record_call (lce, LCREC_COMMIT, rv);
+	return rv;
 }
 
 
@@ -1500,13 +4272,16 @@ void pulleyback_rollback (void *pbh) {
 	}
 	// Suppress the txn_isaborted() flag that should now be raised
 	txn_isaborted_clr (lce);
+	record_call (lce, LCREC_ROLLBACK, 1);
 }
 
 
-/* Merge two transactions.  The commit or failure of one will lead
+/* Internal Function:
+ *
+ * Merge two transactions.  The commit or failure of one will lead
  * to the same result in the other.
  */
-int pulleyback_collaborate (void *pbh1, void *pbh2) {
+static int _int_pb_collaborate (void *pbh1, void *pbh2) {
 	struct lcenv *lce1 = (struct lcenv *) pbh1;
 	struct lcenv *lce2 = (struct lcenv *) pbh2;
 	assert (txn_isactive (lce1) || txn_isaborted (lce1));
@@ -1538,3 +4313,188 @@ int pulleyback_collaborate (void *pbh1, void *pbh2) {
 	}
 }
 
+
+/* Merge two transactions, as above, and trace it in the first lcenv.
+ */
+int pulleyback_collaborate (void *pbh1, void *pbh2) {
+	struct lcenv *lce1 = (struct lcenv *) pbh1;
+	struct lcenv *lce2 = (struct lcenv *) pbh2;
+	int rv = _int_pb_collaborate (pbh1, pbh2);
+	if (lce1->rec_env != 0) {
+		record_write (LCREC_COLLABORATE, lce1->rec_env, rv,
+				&lce2->rec_env, sizeof (lce2->rec_env), NULL, 0);
+	}
+	return rv;
+}
+
+
+/* Take a snapshot of the statistics of a PulleyBack instance.  This may
+ * be done from any thread, without waiting for pth_envown.
+ */
+bool pulleyback_lifecycle_stats (void *pbh, struct lifecycle_stats *sts) {
+	struct lcenv *lce = (struct lcenv *) pbh;
+	if ((lce == NULL) || (sts == NULL)) {
+		errno = EINVAL;
+		return false;
+	}
+	struct lifecycle_stats *src = &lce->lce_stats;
+	sts->objects         = STAT_GET (src->objects        );
+	sts->states          = STAT_GET (src->states         );
+	sts->txn_committed   = STAT_GET (src->txn_committed  );
+	sts->txn_aborted     = STAT_GET (src->txn_aborted    );
+	sts->forks_added     = STAT_GET (src->forks_added    );
+	sts->forks_deleted   = STAT_GET (src->forks_deleted  );
+	sts->forks_rejected  = STAT_GET (src->forks_rejected );
+	sts->dispatched      = STAT_GET (src->dispatched     );
+	sts->retried         = STAT_GET (src->retried        );
+	sts->backlog         = STAT_GET (src->backlog        );
+	sts->deadline        = STAT_GET (src->deadline       );
+	sts->catchups        = STAT_GET (src->catchups       );
+	sts->catching_up     = STAT_GET (src->catching_up    );
+	sts->late            = STAT_GET (src->late           );
+	sts->envown_acquired = STAT_GET (src->envown_acquired);
+	sts->envown_wait_ns  = STAT_GET (src->envown_wait_ns );
+	sts->envown_hold_ns  = STAT_GET (src->envown_hold_ns );
+	return true;
+}
+
+
+/* Take a snapshot of the statistics of one driver of a PulleyBack
+ * instance.  This may be done from any thread, like the above.
+ */
+bool pulleyback_lifecycle_driver_stats (void *pbh, unsigned driver,
+				struct lifecycle_driver_stats *lds) {
+	struct lcenv *lce = (struct lcenv *) pbh;
+	if ((lce == NULL) || (lds == NULL)) {
+		errno = EINVAL;
+		return false;
+	}
+	if (driver >= lce->cnt_cmds) {
+		errno = ENOENT;
+		return false;
+	}
+	struct lcdriver *lcd = &lce->lcd_cmds [driver];
+	lds->lifecycle  = lcd->cmdname;
+	lds->dispatched = STAT_GET (lcd->cnt_dispatched);
+	lds->retried    = STAT_GET (lcd->cnt_retried   );
+	lds->deferred   = STAT_GET (lcd->cnt_deferred  );
+	lds->congested  = STAT_GET (lcd->cnt_congested );
+	lds->restarts   = STAT_GET (lcd->cnt_restarts  );
+	return true;
+}
+
+
+/* Take a snapshot of a histogram of a PulleyBack instance.  This may be
+ * done from any thread, like the above.
+ */
+bool pulleyback_lifecycle_histogram (void *pbh, enum lifecycle_histogram_kind kind,
+				unsigned driver, struct lifecycle_histogram *hst) {
+	struct lcenv *lce = (struct lcenv *) pbh;
+	if ((lce == NULL) || (hst == NULL)) {
+		errno = EINVAL;
+		return false;
+	}
+	struct lifecycle_histogram *src;
+	switch (kind) {
+	case LIFECYCLE_HIST_LAG:
+		if (driver >= lce->cnt_cmds) {
+			errno = ENOENT;
+			return false;
+		}
+		src = &lce->lcd_cmds [driver].hst_lag;
+		break;
+	case LIFECYCLE_HIST_WAKEUP:
+		src = &lce->hst_wakeup;
+		break;
+	case LIFECYCLE_HIST_ADDWAIT:
+		src = &lce->hst_addwait;
+		break;
+	default:
+		errno = EINVAL;
+		return false;
+	}
+	hst->count = STAT_GET (src->count);
+	hst->max   = STAT_GET (src->max  );
+	unsigned bucket;
+	for (bucket=0; bucket<LIFECYCLE_HIST_BUCKETS; bucket++) {
+		hst->buckets [bucket] = STAT_GET (src->buckets [bucket]);
+	}
+	return true;
+}
+
+
+/* Return the latency at a percentile of a histogram.  The count may be
+ * a little off from the buckets in a torn snapshot, so the buckets are
+ * summed up first.
+ */
+uint64_t lifecycle_histogram_percentile (const struct lifecycle_histogram *hst, double pct) {
+	uint64_t total = 0;
+	unsigned bucket;
+	for (bucket=0; bucket<LIFECYCLE_HIST_BUCKETS; bucket++) {
+		total += hst->buckets [bucket];
+	}
+	if ((total == 0) || (pct >= 100.0)) {
+		return hst->max;
+	}
+	uint64_t want = (uint64_t) (pct * total / 100.0);
+	uint64_t seen = 0;
+	for (bucket=0; bucket<LIFECYCLE_HIST_BUCKETS; bucket++) {
+		seen += hst->buckets [bucket];
+		if (seen > want) {
+			break;
+		}
+	}
+	uint64_t top = hist_bucket_top (bucket);
+	return (top < hst->max) ? top : hst->max;
+}
+
+
+/* Take a snapshot of the lock statistics of a PulleyBack instance for
+ * one code path.  This may be done from any thread, like the above.
+ */
+bool pulleyback_lifecycle_lock_stats (void *pbh, enum lifecycle_lock_path path,
+				struct lifecycle_lock_stats *lks) {
+	struct lcenv *lce = (struct lcenv *) pbh;
+	if ((lce == NULL) || (lks == NULL) || (path >= LIFECYCLE_LOCK_PATHS)) {
+		errno = EINVAL;
+		return false;
+	}
+	struct lifecycle_lock_stats *src = &lce->lck_stats [path];
+	lks->acquired    = STAT_GET (src->acquired   );
+	lks->contended   = STAT_GET (src->contended  );
+	lks->wait_ns     = STAT_GET (src->wait_ns    );
+	lks->hold_ns     = STAT_GET (src->hold_ns    );
+	lks->wait_max_ns = STAT_GET (src->wait_max_ns);
+	lks->hold_max_ns = STAT_GET (src->hold_max_ns);
+	return true;
+}
+
+
+/* Wait for the service thread to complete a round after it is signaled.
+ * A round that began before the call may not see the state that the
+ * caller set up, so the wait is for the round after the last that began.
+ * The service thread announces the end of every round on pth_roundend.
+ */
+bool pulleyback_lifecycle_sync (void *pbh) {
+	struct lcenv *lce = (struct lcenv *) pbh;
+	if (lce == NULL) {
+		errno = EINVAL;
+		return false;
+	}
+	if (txn_isactive (lce)) {
+		errno = EBUSY;
+		return false;
+	}
+	assert (!pthread_mutex_lock (&lce->pth_rounds));
+	uint64_t round = lce->cnt_rounds + 1;
+	service_signal (lce);
+	while ((lce->cnt_roundsdone < round) && ((lce->lce_flags & LCE_SERVICED) != 0)) {
+		assert (!pthread_cond_wait (&lce->pth_roundend, &lce->pth_rounds));
+	}
+	bool done = (lce->cnt_roundsdone >= round);
+	assert (!pthread_mutex_unlock (&lce->pth_rounds));
+	if (!done) {
+		errno = ECANCELED;
+	}
+	return done;
+}
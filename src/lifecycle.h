@@ -22,8 +22,16 @@
 
 #include <pthread.h>
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include "uthash.h"
 
+#include "lifecycle_plugin.h"
+#include "lifecycle_driver.h"
+#include "lifecycle_stats.h"
+#include "lifecycle_clock.h"
+
 
 
 // One lifecycleState attribute value, stored as NUL-terminated ASCII.
@@ -32,12 +40,21 @@
 //  - ofs_next is the offset of the next word (initially after the dot).
 //  - typ_next is the character '@' or '?' or NUL for timer, event, done.
 //  - cnt_missed is the number of missed occurrences (for exp fallback).
+//  - tim_lease is the end of the lease on a dispatch in flight, if any.
+//  - evt_lease is the index of the event dispatched under the lease.
 //  - txt_attr is the NUL-terminated attribute value.
 //
+// The lease fields form the in-flight table, keyed by the lcobject that
+// holds the lcstate, the lcstate and the event index.  While the lease
+// lasts, the event is not dispatched again.  The entry is gone when the
+// lcstate is removed, which is normally how LDAP reports progress.
+//
 struct lcstate {
 	struct lcstate *lcs_next;
 	time_t          tim_next;
+	time_t          tim_lease;
 	uint16_t        ofs_next;
+	uint16_t        evt_lease;
 	uint8_t         typ_next;
 	uint8_t         cnt_missed;
 	char            txt_attr [1];
@@ -50,6 +67,10 @@ struct lcstate {
 //  - lcs_toadd is a prefix to lcs_first to be added upon transaction commit.
 //  - lcs_todel is a tail of lcs_first to be deleted upon transaction commit.
 //  - tim_next is the first lifecycleState timer to expire (0 for "dirty").
+//  - lco_schnext is the next lcobject in a calendar slot or dirty list.
+//  - lco_schprev points to the pointer that holds us in that list.
+//  - idx_heap is our position in the cold or late heap, if we are in one.
+//  - sch_tier tells where the lcobject is filed in the timer schedule.
 //  - hsh_dn is a hash of the distinguishedName string.
 //  - txt_dn is the NUL-terminated distinguishedName string.
 //
@@ -68,6 +89,10 @@ struct lcobject {
 	struct lcstate  *lcs_toadd;
 	struct lcstate  *lcs_todel;
 	time_t           tim_first;
+	struct lcobject *lco_schnext;
+	struct lcobject**lco_schprev;
+	uint32_t         idx_heap;
+	uint8_t          sch_tier;
 	UT_hash_handle   hsh_dn;
 	char             txt_dn [1];
 };
@@ -75,20 +100,380 @@ struct lcobject {
 
 // Is there a POSIX-standard way of quoting the maximum time_t value?
 // The following assumes it is a signed type, so 32 bits go up to 2038.
+// Note that shifting ~(time_t)0 would sign-extend to -1 instead.
+//
+#define MAX_TIME_T ((time_t) ((((uintmax_t) 1) << (8 * sizeof (time_t) - 1)) - 1))
+
+
+// The timer schedule of an lcenv is a calendar queue with two tiers.
+//
+// The hot tier holds the lcobjects with tim_first within SCHED_HORIZON
+// seconds from sch_base.  It is a ring of SCHED_SLOTS unsorted slots,
+// each covering SCHED_SLOTSECS seconds; sch_cursor is the slot that
+// starts at sch_base, and it also collects any timers that are overdue.
+//
+// The cold tier holds the lcobjects that fire further away, which is
+// the vast majority for certificates that expire after months.  It is a
+// compact array in binary heap order on tim_heap, so the nearest ones
+// can be promoted to the hot tier as sch_base moves forward.
+//
+// The late tier is only used in catch-up mode, after the wall clock has
+// jumped forward.  It holds the overdue lcobjects in the same heap form,
+// so they can be fired oldest-first at a bounded rate.
+//
+// The dirty list holds lcobjects whose tim_first was smudged, so they
+// need their events advanced and their timers recomputed by the service
+// thread.  This way, the service thread only needs to look at work that
+// changed or that is due, rather than at the entire lcobject population.
 //
-#define MAX_TIME_T ((~(time_t)0)>>1)
+#define SCHED_SLOTSECS	64
+#define SCHED_SLOTS	1350
+#define SCHED_HORIZON	(SCHED_SLOTSECS * SCHED_SLOTS)
+
+// When the wall clock jumps forward by more than CLOCKJUMP_SECS relative
+// to the monotonic clock, as after a VM resume or an NTP step, the overdue
+// timers are not fired at once.  Instead, catch-up mode fires at most
+// CATCHUP_BURST of them every CATCHUP_PAUSE seconds, oldest-first, until
+// the late tier has drained.  Its size is the catch-up backlog.
+//
+// A step of the wall clock is noticed immediately, because it cancels
+// the timerfd that the service thread waits for, as described for the
+// fd_timer of struct lcenv.  A VM resume is noticed when that timerfd
+// expires, since it is set for the wall clock rather than relative to
+// the monotonic clock that stood still during the suspend.
+//
+#define CLOCKJUMP_SECS	60
+#define CATCHUP_BURST	100
+#define CATCHUP_PAUSE	1
+
+#define SCHED_NONE	0
+#define SCHED_DIRTY	1
+#define SCHED_HOT	2
+#define SCHED_COLD	3
+#define SCHED_LATE	4
+
+struct lcheapent {
+	time_t           tim_heap;
+	struct lcobject *lco_heap;
+};
+
+struct lcheap {
+	uint32_t          cnt_heap;	// number of entries in ary_heap
+	uint32_t          max_heap;	// allocated entries in ary_heap
+	struct lcheapent *ary_heap;	// heap-ordered on tim_heap
+};
+
+struct lcsched {
+	time_t           sch_base;	// start time of the sch_cursor slot
+	uint32_t         sch_cursor;	// slot index covering sch_base
+	uint32_t         cnt_hot;	// number of lcobjects in the hot tier
+	struct lcheap    hea_cold;	// timers beyond the horizon
+	struct lcheap    hea_late;	// overdue timers during catch-up
+	struct lcobject *lco_dirty;	// list of smudged lcobjects
+	time_t           tim_lastreal;	// wall clock at the previous round
+	time_t           tim_lastmono;	// monotonic clock at the previous round
+	time_t           tim_catchup;	// next catch-up round, 0 when not
+	struct lcobject *lco_slots [SCHED_SLOTS];
+};
 
 
-// An lcdriver or Life Cycle Driver is a command to be opened with popen()
+// An lcdriver or Life Cycle Driver is a command to be started with a pipe
 // to receive any number of pairs of lines: DN, attr.  Both are printed as
 // the string that they are in LDAP, without headers or prefixes.  Neither
 // should hold a newline, so this ought to work.
 //
+// The lcdriver is configured with a pulleyback_open() argument of the form
+// lifecycle[,option]*=command that sets cmdname, options and cmdline.
+// The option workers:N sets cnt_workers to run a pool of N processes for
+// the lifecycle, each an lcworker.  Dispatches are distributed over the
+// lcworkers by the hash of the distinguishedName, so events for the same
+// lcobject stay in order, while distinct lcobjects are handled in parallel.
+//
+// The option ack sets LCD_ACK in lcd_flags, and connects the lcworkers
+// with a socket instead of a pipe.  The driver answers every pair of
+// lines, in order, with a line "ok" or "fail" or "retry-after=N" for N
+// seconds.  Until the answer arrives, the lcstate is not fired again.
+//
+// The option frames sets LCD_FRAMES in lcd_flags, and replaces the pair
+// of lines with an lcframe header followed by the distinguishedName and
+// lifecycleState, without newlines.  Under LCD_ACK, the answers are then
+// framed too, as a 32-bit length of what follows, the 32-bit dispatch id
+// and the answer text; these answers may arrive in any order.
+//
+// The lcworkers are started from cmd_argv.  This splits a simple cmdline
+// into words, which are run without a shell.  A cmdline that uses shell
+// syntax is run as /bin/sh -c cmdline instead.
+//
+// The lcworkers are supervised, and restarted when they die.  The number
+// of restarts over all lcworkers is counted in cnt_restarts.
+//
+// Every dispatch is leased for lease_secs, which may be set with the
+// option lease:N and defaults to DRIVER_LEASE.  Under LCD_ACK, the lease
+// lasts DRIVER_ACKWAIT, or DRIVER_OKWAIT after the "ok" answer.
+//
+// Output to an lcworker is held back when its queue fills up to wmk_high
+// bytes, and until it drains to wmk_low bytes.  These watermarks may be
+// set with the options high:N and low:N, and default to 3/4 and 1/4 of
+// the queue.  The lcstates held back are deferred for DRIVER_RECHECK
+// seconds, without counting them as missed, so a slow driver does not
+// hold up others.  Deferrals are counted in cnt_deferred, and the times
+// that lcworkers became congested in cnt_congested.
+//
+// The dispatches to the lcdriver are counted in cnt_dispatched, and the
+// ones that repeat the firing of an event in cnt_retried.  How late they
+// were dispatched after their tim_next is collected in hst_lag.
+//
+// The option lazy sets LCD_LAZY in lcd_flags, and starts the lcworkers
+// when their first dispatch comes up.  The option idle:N sets idle_secs,
+// after which an lcworker without work is asked to finish, to be started
+// again on demand.  The default idle_secs of 0 keeps lcworkers running.
+//
+// The option shm sets LCD_SHM in lcd_flags, and passes the dispatches
+// through a shared memory ring instead of the pipe, as described for
+// struct lcshm.  The pipe remains, to tell the driver to finish with
+// its end-of-file, and for answers under LCD_ACK.
+//
+// The option shared sets LCD_SHARED in lcd_flags, and uses the lcworkers
+// of an lcpool instead of starting its own.  The lcdriver is a client of
+// the lcpool, listed from pol_clients through lcd_nextclient, and has
+// no lcworkers of its own.  The lcenv of the lcdriver is in lcd_env.
+// Answers for its dispatches are put in its dsp_inbox by the lcpool, and
+// the restarts of the lcworkers that it has seen are kept in cnt_seen.
+//
+// The option plugin sets LCD_PLUGIN in lcd_flags, and loads the shared
+// object named in cmdline, along with any config text after a space,
+// as described in lifecycle_plugin.h.  There are no lcworkers in this
+// case, but the plg_dlhandle from dlopen(), the plg_handle set by the
+// plugin and its functions plg_fire and plg_fini.
+//
 struct lcdriver {
-	char *cmdname;
-	FILE *cmdpipe;
+	char            *cmdname;
+	char            *cmdline;
+	char           **cmd_argv;
+	uint32_t         lcd_flags;
+	uint32_t         cnt_workers;
+	struct lcworker *lcw_workers;
+	uint32_t         cnt_restarts;
+	uint32_t         lease_secs;
+	uint32_t         idle_secs;
+	uint32_t         wmk_high;
+	uint32_t         wmk_low;
+	uint64_t         cnt_deferred;
+	uint32_t         cnt_congested;
+	uint64_t         cnt_dispatched;
+	uint64_t         cnt_retried;
+	struct lifecycle_histogram hst_lag;
+	struct lcenv    *lcd_env;
+	struct lcpool   *lcd_pool;
+	struct lcdriver *lcd_nextclient;
+	struct lcdispatch *dsp_inbox;
+	uint32_t        *cnt_seen;
+	void                    *plg_dlhandle;
+	void                    *plg_handle;
+	lifecycle_plugin_fire_t *plg_fire;
+	lifecycle_plugin_fini_t *plg_fini;
 };
 
+#define DRIVER_MAXWORKERS	64
+#define DRIVER_LEASE		60
+#define DRIVER_RECHECK		1
+
+#define LCD_ACK		0x00000001
+#define LCD_FRAMES	0x00000002
+#define LCD_PLUGIN	0x00000004
+#define LCD_SHM		0x00000008
+#define LCD_LAZY	0x00000010
+#define LCD_SHARED	0x00000020
+
+
+// An lcpool is a set of lcworkers shared by the lcdrivers of any number
+// of lcenvs in this process, when they have the shared option and the
+// same command and other options, for any lifecycle name.  The lcpools
+// are registered in a process-wide list, with the options and command
+// as their pol_spec, and are counted in pol_refs.  The lcworkers are run
+// by a private lcenv in pol_env, which has no lcobjects but the single
+// lcdriver of the lcpool, and which runs its own service thread.  The
+// lcdriver of the lcpool has lcd_pool set, but not LCD_SHARED.
+//
+// Clients queue their dispatches while they hold pth_envown of pol_env,
+// which is also needed for pol_clients.  The service thread of pol_env
+// never waits for the pth_envown of a client, so this cannot deadlock.
+//
+struct lcpool {
+	struct lcpool   *pol_next;
+	char            *pol_spec;
+	uint32_t         pol_refs;
+	struct lcenv    *pol_env;
+	struct lcdriver *pol_clients;
+};
+
+// The shared memory ring of an lcworker under LCD_SHM holds DRIVER_SHMRING
+// bytes after its struct lcshm, which is described in lifecycle_driver.h.
+// The lcworker keeps its own shm_head, which it publishes once per round.
+//
+#define DRIVER_SHMRING	(1 << 20)
+
+
+// An lcrecord is the header of a record in a trace of the calls made to
+// the PulleyBack.  Tracing is done when the environment variable named
+// LCREC_ENVVAR holds a file name when pulleyback_open() is first called.
+// The file starts with LCREC_MAGIC and LCREC_VERSION, each in 32 bits,
+// followed by the records.  All fields are in host byte order.
+//
+// Every record holds the rec_type of the call, its rec_result and the
+// rec_env that numbers the handle from pulleyback_open(), counting from
+// 1.  The rec_time is in nanoseconds since the trace started.  The rec_len
+// bytes after the header depend on the rec_type:
+//  - LCREC_OPEN has the varc in 32 bits, then argv as NUL-terminated
+//    strings; rec_env is 0 when the call failed;
+//  - LCREC_ADD and LCREC_DEL have the DER values of the distinguishedName
+//    and lifecycleState, each holding their own length;
+//  - LCREC_COLLABORATE has the rec_env of the second handle in 16 bits;
+//  - the others have no further data.
+//
+struct lcrecord {
+	uint8_t  rec_type;
+	uint8_t  rec_result;
+	uint16_t rec_env;
+	uint32_t rec_len;
+	uint64_t rec_time;
+};
+
+#define LCREC_ENVVAR	"PULLEYBACK_LIFECYCLE_RECORD"
+#define LCREC_MAGIC	0x6c637263
+#define LCREC_VERSION	1
+
+#define LCREC_OPEN		1
+#define LCREC_CLOSE		2
+#define LCREC_ADD		3
+#define LCREC_DEL		4
+#define LCREC_RESET		5
+#define LCREC_PREPARE		6
+#define LCREC_COMMIT		7
+#define LCREC_ROLLBACK		8
+#define LCREC_COLLABORATE	9
+
+
+// An lcdispatch is a pair of lines sent to an lcworker that awaits an
+// acknowledgement.  It holds copies of the distinguishedName and the
+// lifecycleState, because these may be removed before the answer comes.
+// The txt_attr points into the same allocation as txt_dn.  The dsp_id
+// is the dispatch id, which is sent under LCD_FRAMES.  For an lcpool,
+// dsp_owner is the client lcdriver, which gets the dsp_verdict of the
+// answer in its dsp_inbox.
+//
+struct lcdispatch {
+	struct lcdispatch *dsp_next;
+	struct lcdriver   *dsp_owner;
+	int                dsp_verdict;
+	uint32_t           dsp_id;
+	time_t             tim_sent;
+	char              *txt_attr;
+	char               txt_dn [1];
+};
+
+
+// An lcworker is one process for an lcdriver, with process id cmdpid.
+//
+// The cmdfd is the file descriptor of its pipe or socket, set to non-blocking.
+// Lines are not written directly, but are queued in a ring buffer out_buf
+// of DRIVER_OUTBUF bytes.  The free-running offsets out_rd and out_wr mark
+// the queued bytes.  The service thread writes as much as the worker will
+// take, and polls for more room when LCW_POLLOUT is set in lcw_flags.
+// A slow worker thereby backs up its own queue, but not the service thread.
+//
+// The lines fired during a service round are not copied into out_buf,
+// but collected in out_iov as references to txt_dn and txt_attr.  There
+// are out_iovcnt entries, starting at DRIVER_IOVRING, with out_pend bytes
+// in total, of which the ones before out_iovrd have been written.  At the
+// end of the round, while pth_envown is still held, these are written
+// in one writev() after what remains in out_buf, and only the part that
+// the worker did not take is copied into out_buf.  The entries before
+// DRIVER_IOVRING are used to refer to out_buf in the same writev().
+// Under LCD_FRAMES, the headers are in out_hdr, one for every three
+// entries in out_iov, and dispatch ids are taken from dsp_nextid.
+//
+// Under LCD_SHM, the shared memory ring is mapped at shm_ring, from the
+// memfd shm_fd, with doorbell shm_bell.  Records are written directly
+// into the ring, up to shm_head, which is published to the driver at
+// the end of the round.
+//
+// An lcworker that is not running until it gets work has LCW_IDLE set,
+// and no cmdfd.  The cmdpid remains set until a retired process has been
+// reaped.  Running workers were last active at tim_active.
+//
+// When the queued output reaches the wmk_high of the lcdriver, the
+// lcworker is congested and LCW_CONGESTED is set, until it drains to
+// the wmk_low of the lcdriver.
+//
+// Under LCD_ACK, answers are collected in in_buf until a newline shows
+// up, while LCW_POLLIN is set in lcw_flags.  The lcdispatch sent are
+// queued from dsp_first to dsp_last, with cnt_inflight entries, and are
+// removed as their answers arrive.
+//
+// The lcworker is supervised through pidfd, if the kernel offers it,
+// which is watched by epoll under LCW_WATCHED.  When the worker exits
+// or breaks its connection, LCW_DEAD is set and the cmdfd is closed.
+// The cmdpid remains set until the process has been reaped.  A restart
+// is planned at tim_restart, with exponential fallback counted in
+// cnt_failing for workers that die within RESTART_STABLE seconds after
+// they were started at tim_started.  Restarts are counted in cnt_restarts.
+//
+struct lcworker {
+	struct lcdriver   *lcw_driver;
+	pid_t              cmdpid;
+	int                cmdfd;
+	uint32_t           lcw_flags;
+	uint32_t           out_rd;
+	uint32_t           out_wr;
+	char              *out_buf;
+	uint32_t           out_pend;
+	uint32_t           out_iovrd;
+	uint32_t           out_iovcnt;
+	uint32_t           out_iovmax;
+	struct iovec      *out_iov;
+	struct lcframe    *out_hdr;
+	uint32_t           dsp_nextid;
+	int                shm_fd;
+	int                shm_bell;
+	struct lcshm      *shm_ring;
+	uint64_t           shm_head;
+	uint32_t           in_len;
+	char              *in_buf;
+	uint32_t           cnt_inflight;
+	struct lcdispatch *dsp_first;
+	struct lcdispatch**dsp_last;
+	int                pidfd;
+	uint8_t            cnt_failing;
+	uint32_t           cnt_restarts;
+	time_t             tim_started;
+	time_t             tim_restart;
+	time_t             tim_active;
+};
+
+#define DRIVER_OUTBUF	65536
+#define DRIVER_IOVRING	2
+#define DRIVER_MAXIOV	1024
+#define DRIVER_INBUF	LCFRAME_MAXANSWER
+
+#define LCW_POLLOUT	0x00000001
+#define LCW_POLLIN	0x00000002
+#define LCW_DEAD	0x00000004
+#define LCW_WATCHED	0x00000008
+#define LCW_CONGESTED	0x00000010
+#define LCW_IDLE	0x00000020
+
+#define RESTART_STABLE	60
+#define RESTART_MAXSHIFT	6
+
+
+// When a driver under LCD_ACK does not answer in DRIVER_ACKWAIT seconds,
+// the lcstate fires again.  After an "ok" answer, the update through LDAP
+// is awaited for DRIVER_OKWAIT seconds before the lcstate fires again.
+//
+#define DRIVER_ACKWAIT	600
+#define DRIVER_OKWAIT	300
+
 
 // An LDAP environment, possibly mixing states of a transaction.
 //
@@ -101,30 +486,75 @@ struct lcdriver {
 // resets to NULL.  From this time on, transaction updates will
 // fail consistently.
 //
+// sch_timers is the timer schedule, filing each lcobject in lco_first
+// with its tim_first.  It is only used under pth_envown.
+//
 // pth_service is the service thread dedicated to this lcenv.
-// pth_sigpost is the wait condition / signal post to inform it
-// of a successful commit.  pth_envown is used to decide on who
-// owns the lcobject and lcservice data underneath, as well as
-// generally controls (most of) the lcenv object.
+// fd_sigpost is an eventfd that serves as the signal post to inform
+// it of a successful commit.  fd_timer is a timerfd on the wall clock,
+// set for the first deadline of the service thread and canceled when
+// the wall clock is set.  fd_epoll is what the service thread waits
+// on, for fd_sigpost, fd_timer and for drivers that have room for more
+// output.  pth_envown is used to decide on who owns the lcobject and
+// lcservice data underneath, as well as generally controls (most of)
+// the lcenv object.  It is released while waiting on fd_epoll.
+//
+// lce_stats holds the statistics of the lcenv, as described in
+// lifecycle_stats.h, and tim_envheld the time in nanoseconds at which
+// the current holder of pth_envown acquired it, for the code path in
+// lck_path.  The lock statistics for each path are in lck_stats.  The
+// histograms are in hst_wakeup and hst_addwait.  The former is fed from
+// tim_commit, the time in nanoseconds of the first commit that the
+// service thread has not woken up for yet, or 0.
 //
 // lce_flags holds a number of flags about the lcenv:
 //  - LCE_ABORTED indicates an aborted transaction
 //  - LCE_SERVICED indicates that the service thread may continue
 //
+// rec_env numbers the lcenv in the trace of calls, or is 0 when the
+// calls are not traced, as described for struct lcrecord.
+//
+// lce_clock is the clock that tells the time for the lcenv, as described
+// in lifecycle_clock.h.  It is set when the lcenv is allocated.
+//
 // LDAP environments are single-threaded, so re-entry is unsafe.
 //
 struct lcenv {
 	pthread_mutex_t  pth_envown;	// lcobject/lcstat ownership?
-	pthread_cond_t   pth_sigpost;	// signal from pulley, wait by service
+	int              fd_sigpost;	// signal from pulley, wait by service
+	int              fd_timer;	// timerfd for deadlines, wait by service
+	int              fd_epoll;	// wait by service for signal or output
 	pthread_t        pth_service;	// this lcenv's service thread
 	struct lcobject *lco_first;	// rd/wr only under pth_envown
+	struct lcsched   sch_timers;	// rd/wr only under pth_envown
 	struct lcobject *lco_dnhash;	// owned by pulley backend
 	struct lcenv    *env_txncycle;	// owned by pulley backend
 	uint32_t         lce_flags;	// owned by pulley backend
+	pthread_mutex_t  pth_rounds;	// guards cnt_rounds, cnt_roundsdone
+	pthread_cond_t   pth_roundend;	// signals the end of a round
+	uint64_t         cnt_rounds;	// service rounds begun
+	uint64_t         cnt_roundsdone;	// service rounds ended
+	uint64_t         tim_envheld;	// rd/wr only under pth_envown
+	enum lifecycle_lock_path lck_path;	// rd/wr only under pth_envown
+	struct lifecycle_lock_stats lck_stats [LIFECYCLE_LOCK_PATHS];
+	struct lifecycle_stats lce_stats;	// wr only under pth_envown
+	struct lifecycle_histogram hst_wakeup;	// wr only under pth_envown
+	struct lifecycle_histogram hst_addwait;	// wr only under pth_envown
+	uint64_t         tim_commit;	// rd/wr only under pth_envown
+	uint16_t         rec_env;	// owned by pulley backend
+	struct lifecycle_clock *lce_clock;	// only written before service
 	uint32_t         cnt_cmds;	// only written before service
 	struct lcdriver  lcd_cmds [1];	// only written before service
 };
 
+// Statistics are only updated while pth_envown is held, but they may be
+// read by any thread, so they are stored and loaded as relaxed atomics.
+//
+#define STAT_ADD(ctr,n)	__atomic_store_n (&(ctr), (ctr) + (n), __ATOMIC_RELAXED)
+#define STAT_SUB(ctr,n)	__atomic_store_n (&(ctr), (ctr) - (n), __ATOMIC_RELAXED)
+#define STAT_SET(ctr,v)	__atomic_store_n (&(ctr), (v), __ATOMIC_RELAXED)
+#define STAT_GET(ctr)	__atomic_load_n  (&(ctr), __ATOMIC_RELAXED)
+
 #define LCE_ABORTED	0x00000001
 
 #define LCE_SERVICED	0x00000002
@@ -0,0 +1,105 @@
+/* Life Cycle Management clocks, as used by the PulleyBack.
+ *
+ * Every PulleyBack instance reads time from the clock that was in use
+ * when pulleyback_open() created it.  This is the time at which timers
+ * are due, including the ones that are due as soon as possible, the
+ * time that drivers are restarted or retired, and the time that the
+ * service thread waits for.  By default this is the system clock.
+ *
+ * A simulated clock only moves when it is advanced.  Tests and
+ * benchmarks use it to pass through months of lifecycles in seconds,
+ * and to get the same firings in the same order every time they run.
+ * After advancing it, pulleyback_lifecycle_sync() waits until the
+ * service thread has fired what became due.
+ *
+ * The cost of the work itself, such as the time spent on locks and the
+ * wakeup latency after commits, is still timed with the system clock.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef LIFECYCLE_CLOCK_H
+#define LIFECYCLE_CLOCK_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <time.h>
+
+
+/* A clock is a set of functions that are passed the clock itself, so
+ * an implementation can extend this structure with its own data:
+ *  - realtime_ns returns the wall clock time in nanoseconds since the
+ *    epoch, which is compared with the timers in lifecycleStates;
+ *  - monotime_ns returns a time in nanoseconds that does not jump, to
+ *    notice when the wall clock jumps;
+ *  - timeout_ms returns the milliseconds of real time that the service
+ *    thread should wait for a realtime_ns deadline, which is 0 when it
+ *    has passed, or -1 to wait until the service thread is signaled.
+ * The functions are called from several threads.
+ */
+struct lifecycle_clock {
+	uint64_t (*realtime_ns) (struct lifecycle_clock *clk);
+	uint64_t (*monotime_ns) (struct lifecycle_clock *clk);
+	int      (*timeout_ms)  (struct lifecycle_clock *clk, uint64_t deadline_ns);
+};
+
+
+/* The system clock, which is the default.
+ */
+extern struct lifecycle_clock lifecycle_clock_system;
+
+
+/* A simulated clock, with its monotonic time in sim_ns and its wall
+ * clock time jump_ns ahead of that, counting modulo 2^64 so it may also
+ * be behind.  It never times out a wait for a future deadline, so the
+ * service thread only runs when it is signaled.
+ */
+struct lifecycle_clock_sim {
+	struct lifecycle_clock clk;
+	uint64_t sim_ns;
+	uint64_t jump_ns;
+};
+
+
+/* Initialise a simulated clock to start at a wall clock time.
+ */
+void lifecycle_clock_sim_init (struct lifecycle_clock_sim *sim, time_t start);
+
+
+/* Advance a simulated clock by a number of nanoseconds.  This may be
+ * done from any thread.  The PulleyBack instances that use the clock
+ * are not signaled; use pulleyback_lifecycle_sync() for that.
+ */
+void lifecycle_clock_sim_advance (struct lifecycle_clock_sim *sim, uint64_t ns);
+
+
+/* Jump the wall clock of a simulated clock forward by a number of
+ * nanoseconds, or backward when it is negative, while its monotonic
+ * time stays put.  This is how a VM resume or an NTP step looks to the
+ * PulleyBack instances that use the clock.  Like above, they are not
+ * signaled.
+ */
+void lifecycle_clock_sim_jump (struct lifecycle_clock_sim *sim, int64_t ns);
+
+
+/* Use a clock for the PulleyBack instances that are opened afterwards,
+ * or the system clock for NULL.  The clock must stay valid until those
+ * instances are closed.  This is not thread-safe with respect to
+ * pulleyback_open().
+ */
+void lifecycle_clock_use (struct lifecycle_clock *clk);
+
+
+/* Signal the service thread of a PulleyBack instance and wait until it
+ * has completed a round, so that the timers that were due on its clock
+ * have fired.  This cannot be done during a transaction, and it fails
+ * with ECANCELED when the service thread stops meanwhile.
+ * Return success as true, failure as false with errno set.
+ */
+bool pulleyback_lifecycle_sync (void *pbh);
+
+
+#endif /* LIFECYCLE_CLOCK_H */
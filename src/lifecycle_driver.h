@@ -0,0 +1,120 @@
+/* Life Cycle Management driver protocol, as spoken by the PulleyBack.
+ *
+ * A driver process is started for a lifecycle with a driver argument
+ * to the PulleyBack of the form
+ *
+ *	lifecycle[,option]*=command
+ *
+ * as described in doc/DRIVERS.MD.  Without options, it is sent two lines
+ * for every event that fires, with the distinguishedName and with the
+ * lifecycleState, each ending in a newline.  The options that change
+ * this are described below.
+ *
+ * With the ack option, the driver answers every dispatch with a line
+ * holding one of these answers:
+ *  - "ok" when the event was handled, after which the update of the
+ *    lifecycleState through LDAP is awaited for a while;
+ *  - "fail" to retry the event with exponential fallback;
+ *  - "retry-after=N" to retry the event after N seconds.
+ * Anything else is reported and treated like "fail".  The lines answer
+ * the dispatches in the order in which they were sent.
+ *
+ * With the frames option, every dispatch is sent as a frame, which is
+ * a struct lcframe followed by the distinguishedName and lifecycleState,
+ * without NUL or newline.  With ack as well, the answers are frames in
+ * turn, and they may come in any order.  Every answer frame holds
+ *  - a 32-bit length of the rest of the frame, at least 4;
+ *  - the 32-bit frm_id of the dispatch that it answers;
+ *  - the text of the answer, as above, without NUL or newline.
+ * Like in struct lcframe, the numbers are in network byte order.  An
+ * answer frame may be up to LCFRAME_MAXANSWER bytes long, including its
+ * length; a longer one breaks the connection to the driver.  Only the
+ * first 63 bytes of answer text are looked at.
+ *
+ * With the shm option, the dispatches are not sent over standard input,
+ * but written as records into a shared memory ring, which starts with
+ * a struct lcshm.  Standard input stays open until the driver should
+ * finish, and answers under ack are still written to standard output,
+ * as lines or frames.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef LIFECYCLE_DRIVER_H
+#define LIFECYCLE_DRIVER_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* The header of a frame sent to a driver under the frames option.  All
+ * fields are in network byte order.  The frm_len counts the bytes that
+ * follow it, so the remaining header fields and the frm_dnlen bytes of
+ * distinguishedName and frm_lcslen bytes of lifecycleState.  The frm_id
+ * is the dispatch id, frm_event is the index of the event to fire in the
+ * lifecycleState, counting from 0, and frm_attempt counts the times that
+ * the lcstate fired since it was set or answered with "ok", starting at
+ * 1 and saturating at 255.
+ */
+struct lcframe {
+	uint32_t frm_len;
+	uint32_t frm_id;
+	uint16_t frm_event;
+	uint16_t frm_attempt;
+	uint16_t frm_dnlen;
+	uint16_t frm_lcslen;
+};
+
+
+/* The longest answer frame that a driver may send.
+ */
+#define LCFRAME_MAXANSWER	4096
+
+
+/* The header of the shared memory ring of a driver under the shm option.
+ * The driver finds the ring in a memfd on file descriptor 3, which it
+ * maps with MAP_SHARED for reading and writing in full, as told by
+ * fstat().  It also finds an eventfd doorbell on file descriptor 4.
+ *
+ * The shm_magic holds LCSHM_MAGIC, and shm_size is the size in bytes of
+ * the ring, a multiple of 4, which directly follows this header of 192
+ * bytes.  The shm_head and shm_tail are byte counts that only grow, and
+ * that are taken modulo shm_size for the position in the ring.  They are
+ * padded into cache lines of their own, so the two sides do not slow down
+ * the other by writing them.  The header is in host byte order.
+ *
+ * The shm_head is only written by the PulleyBack, with release semantics,
+ * after it wrote the records before it.  It then writes to the doorbell.
+ * The driver reads the doorbell to reset it, and then loads shm_head
+ * with acquire semantics before it reads the records up to it.  The
+ * shm_tail is only written by the driver, with release semantics, when
+ * it is done with the records before it, so they may be overwritten.
+ * A new doorbell may come for records that were already taken.
+ *
+ * Every record is a struct lcframe, in network byte order, followed by
+ * the distinguishedName and lifecycleState, padded with up to three
+ * bytes to start the next record at a multiple of 4.  So a record takes
+ * LCSHM_RECSIZE (frm_len) bytes, for frm_len in host byte order.  Records
+ * do not wrap around the end of the ring.  When the next one does not
+ * fit, a 32-bit frm_len of 0 is written instead, after which the driver
+ * continues at the start of the ring, with its tail at the next
+ * multiple of shm_size.  When the ring is full, the PulleyBack retries
+ * the dispatches later on.
+ */
+struct lcshm {
+	uint32_t shm_magic;
+	uint32_t shm_size;
+	uint8_t  shm_pad0 [56];
+	uint64_t shm_head;
+	uint8_t  shm_pad1 [56];
+	uint64_t shm_tail;
+	uint8_t  shm_pad2 [56];
+};
+
+#define LCSHM_MAGIC	0x6c637368
+#define LCSHM_RECSIZE(len)	(((len) + sizeof (uint32_t) + 3) & ~((size_t) 3))
+
+
+#endif /* LIFECYCLE_DRIVER_H */
@@ -0,0 +1,64 @@
+/* Life Cycle Management plugin drivers, loaded into the PulleyBack.
+ *
+ * A driver argument to the PulleyBack of the form
+ *
+ *	lifecycle,plugin=/path/to/plugin.so [config]
+ *
+ * loads the named shared object instead of starting a driver process.
+ * It must export the functions declared below.  Their names are fixed,
+ * so every lifecycle with a plugin driver loads its own shared object.
+ *
+ * The plugin is called from the service thread, while it holds the
+ * lock that Pulley needs to pass LDAP changes.  It should therefore
+ * act quickly and not block, for instance by writing to a local queue.
+ * Slow actions are better handled by a driver process.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef LIFECYCLE_PLUGIN_H
+#define LIFECYCLE_PLUGIN_H
+
+
+#include <stdbool.h>
+
+
+/* Initialise the plugin for the given lifecycle name, with the config
+ * text that followed the path of the plugin, or an empty string.  Set
+ * a handle for the plugin in *plugin, which may be NULL if the plugin
+ * has no need for it.  Return success as true, failure as false with
+ * errno set.
+ */
+bool lifecycle_plugin_init (void **plugin, const char *lifecycle, const char *config);
+
+
+/* Fire an lcstate for a distinguishedName and lifecycleState, which are
+ * only valid during the call.  The event is the index of the event to
+ * fire in the lifecycleState, counting from 0, and attempt counts the
+ * number of times that it fired, starting at 1.
+ *
+ * Return LIFECYCLE_PLUGIN_OK when done, after which the update through
+ * LDAP is awaited, or LIFECYCLE_PLUGIN_FAIL to retry with exponential
+ * fallback, or a positive number of seconds after which to retry.
+ */
+int lifecycle_plugin_fire (void *plugin, const char *dn, const char *lcs,
+				unsigned event, unsigned attempt);
+
+#define LIFECYCLE_PLUGIN_OK	0
+#define LIFECYCLE_PLUGIN_FAIL	(-1)
+
+
+/* Cleanup the plugin.
+ */
+void lifecycle_plugin_fini (void *plugin);
+
+
+/* Types for the above functions, as found with dlsym().
+ */
+typedef bool lifecycle_plugin_init_t (void **, const char *, const char *);
+typedef int  lifecycle_plugin_fire_t (void *, const char *, const char *, unsigned, unsigned);
+typedef void lifecycle_plugin_fini_t (void *);
+
+
+#endif /* LIFECYCLE_PLUGIN_H */
@@ -0,0 +1,186 @@
+/* Life Cycle Management statistics, as counted by the PulleyBack.
+ *
+ * The counters below can be read at any time, from any thread, with the
+ * handle returned by pulleyback_open().  They are updated as the work
+ * is done, without extra locking, so a snapshot may be slightly torn
+ * between counters, but every counter by itself is accurate.
+ *
+ * Counters only increase, except where they describe the current state,
+ * such as the live lcobjects and lcstates, the backlog and the deadline.
+ *
+ * Latencies are collected in histograms, where they are counted in
+ * buckets on a logarithmic scale, so that rare stalls of seconds can be
+ * told apart from a bulk of milliseconds, which averages would hide.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef LIFECYCLE_STATS_H
+#define LIFECYCLE_STATS_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <time.h>
+
+
+/* Statistics for a PulleyBack instance:
+ *  - objects and states are the lcobjects and lcstates that are live,
+ *    including those in a transaction that is not done yet.
+ *  - txn_committed and txn_aborted count finished transactions.
+ *  - forks_added and forks_deleted count the accepted forks from Pulley,
+ *    and forks_rejected those that failed DER or grammar checks.
+ *  - dispatched and retried count the firings passed to any driver, and
+ *    how many of those were repeated firings of the same event.
+ *  - backlog is the number of lcobjects that were due but not fired at
+ *    the end of the last service round; it grows when firing falls behind.
+ *  - deadline is the first time at which a timer is due, or 0 for none.
+ *  - catchups counts the times that the wall clock jumped forward and
+ *    catch-up mode started, catching_up tells if it is still on, and
+ *    late is the part of the backlog that it has yet to fire.
+ *  - envown_* time the lock that the Pulley and service threads share,
+ *    in nanoseconds waited for it and held, over envown_acquired locks.
+ */
+struct lifecycle_stats {
+	uint64_t objects;
+	uint64_t states;
+	uint64_t txn_committed;
+	uint64_t txn_aborted;
+	uint64_t forks_added;
+	uint64_t forks_deleted;
+	uint64_t forks_rejected;
+	uint64_t dispatched;
+	uint64_t retried;
+	uint64_t backlog;
+	time_t   deadline;
+	uint64_t catchups;
+	bool     catching_up;
+	uint64_t late;
+	uint64_t envown_acquired;
+	uint64_t envown_wait_ns;
+	uint64_t envown_hold_ns;
+};
+
+
+/* Statistics for one driver of a PulleyBack instance:
+ *  - lifecycle is the name of the driver, valid while the handle is open.
+ *  - dispatched and retried count the firings passed to the driver, and
+ *    how many of those were repeated firings of the same event.
+ *  - deferred counts firings held back under backpressure, and congested
+ *    the times that a worker of the driver became congested.
+ *  - restarts counts the times that a worker of the driver was restarted.
+ */
+struct lifecycle_driver_stats {
+	const char *lifecycle;
+	uint64_t dispatched;
+	uint64_t retried;
+	uint64_t deferred;
+	uint64_t congested;
+	uint64_t restarts;
+};
+
+
+/* Statistics for the lock that the Pulley and service threads share,
+ * split by the code path that took it:
+ *  - LIFECYCLE_LOCK_TXN for transactions, from their first fork to
+ *    their commit or rollback;
+ *  - LIFECYCLE_LOCK_SERVICE for the rounds of the service thread,
+ *    between its waits;
+ *  - LIFECYCLE_LOCK_DISPATCH for other instances that dispatch to the
+ *    shared drivers of this one, or supervise them;
+ *  - LIFECYCLE_LOCK_CONTROL for opening and closing, and for joining
+ *    and leaving shared drivers.
+ * For every path, the locks acquired are counted, and how many of those
+ * were contended because another path held the lock.  The time waited
+ * and held is summed up in nanoseconds, and its maximum is kept.
+ */
+enum lifecycle_lock_path {
+	LIFECYCLE_LOCK_TXN,
+	LIFECYCLE_LOCK_SERVICE,
+	LIFECYCLE_LOCK_DISPATCH,
+	LIFECYCLE_LOCK_CONTROL,
+	LIFECYCLE_LOCK_PATHS
+};
+
+struct lifecycle_lock_stats {
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+	uint64_t wait_max_ns;
+	uint64_t hold_max_ns;
+};
+
+
+/* Histograms of latencies in nanoseconds.  Every power of two is split
+ * into 1 << LIFECYCLE_HIST_SUBBITS buckets, so the relative error stays
+ * within 12.5% over the full range.  Values below 8 have their own
+ * buckets.  Besides the counts per bucket, the number of values and the
+ * largest value are kept.
+ *
+ * The histograms describe:
+ *  - LIFECYCLE_HIST_LAG, for a driver, the delay from the tim_next of
+ *    an lcstate to its actual dispatch;
+ *  - LIFECYCLE_HIST_WAKEUP, the delay from a commit to the wakeup of
+ *    the service thread that acts on it;
+ *  - LIFECYCLE_HIST_ADDWAIT, the time that pulleyback_add() and
+ *    pulleyback_del() were blocked to lock out the service thread.
+ */
+#define LIFECYCLE_HIST_SUBBITS	3
+#define LIFECYCLE_HIST_BUCKETS	((64 - LIFECYCLE_HIST_SUBBITS + 1) << LIFECYCLE_HIST_SUBBITS)
+
+struct lifecycle_histogram {
+	uint64_t count;
+	uint64_t max;
+	uint64_t buckets [LIFECYCLE_HIST_BUCKETS];
+};
+
+enum lifecycle_histogram_kind {
+	LIFECYCLE_HIST_LAG,
+	LIFECYCLE_HIST_WAKEUP,
+	LIFECYCLE_HIST_ADDWAIT,
+};
+
+
+/* Take a snapshot of the statistics of a PulleyBack instance.
+ * Return success as true, failure as false with errno set.
+ */
+bool pulleyback_lifecycle_stats (void *pbh, struct lifecycle_stats *sts);
+
+
+/* Take a snapshot of the statistics of a driver, counting from 0 in the
+ * order in which the drivers were given to pulleyback_open().
+ * Return success as true, or false with errno set to ENOENT after the
+ * last driver.
+ */
+bool pulleyback_lifecycle_driver_stats (void *pbh, unsigned driver,
+				struct lifecycle_driver_stats *lds);
+
+
+/* Take a snapshot of the lock statistics of a PulleyBack instance for
+ * one code path.  The totals over all paths are in lifecycle_stats.
+ * Return success as true, failure as false with errno set.
+ */
+bool pulleyback_lifecycle_lock_stats (void *pbh, enum lifecycle_lock_path path,
+				struct lifecycle_lock_stats *lks);
+
+
+/* Take a snapshot of a histogram of a PulleyBack instance.  The driver
+ * is only used for LIFECYCLE_HIST_LAG, and counts like above.
+ * Return success as true, or false with errno set to ENOENT after the
+ * last driver.
+ */
+bool pulleyback_lifecycle_histogram (void *pbh, enum lifecycle_histogram_kind kind,
+				unsigned driver, struct lifecycle_histogram *hst);
+
+
+/* Return the latency at a percentile of a histogram, as the upper bound
+ * of the bucket in which it falls.  The 100th percentile is the largest
+ * value.  Return 0 for an empty histogram.
+ */
+uint64_t lifecycle_histogram_percentile (const struct lifecycle_histogram *hst, double pct);
+
+
+#endif /* LIFECYCLE_STATS_H */
@@ -9,6 +9,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "lifecycle.h"
 #include <steamworks/pulleyback.h>
@@ -18,6 +19,69 @@ void debug_lcenv (struct lcenv *lce);
 void debug_lcobject (struct lcobject *lco);
 
 
+/* Add and delete a lifecycleState that needs the long form of the DER
+ * length, with one or two bytes of length.  Return the number of failed
+ * operations.
+ */
+static int add_del_long (struct lcenv *lce, uint8_t *der_dn, size_t lcslen) {
+	uint8_t der_at [4 + 300];
+	size_t hdrlen = (lcslen < 256) ? 3 : 4;
+	der_at [0] = 0x04;
+	der_at [1] = (lcslen < 256) ? 0x81 : 0x82;
+	der_at [2] = (lcslen < 256) ? lcslen : (lcslen >> 8);
+	der_at [3] = lcslen & 0xff;
+	char *lcs = (char *) der_at + hdrlen;
+	size_t len = sprintf (lcs, "x");
+	while (len + 13 + 4 < lcslen - 6) {
+		len += sprintf (lcs + len, " w=0123456789");
+	}
+	len += sprintf (lcs + len, " v=%0*d", (int) (lcslen - 6 - len - 3), 0);
+	strcpy (lcs + len, " . go@");
+	uint8_t *der [] = { der_dn, der_at };
+	int failed = 0;
+	if (pulleyback_add (lce, der) == 0) {
+		fprintf (stderr, "Failed to add lifecycleState of %zd bytes\n", lcslen);
+		failed++;
+	}
+	if (pulleyback_commit (lce) == 0) {
+		failed++;
+	}
+	if (pulleyback_del (lce, der) == 0) {
+		fprintf (stderr, "Failed to delete lifecycleState of %zd bytes\n", lcslen);
+		failed++;
+	}
+	if (pulleyback_commit (lce) == 0) {
+		failed++;
+	}
+	return failed;
+}
+
+
+/* Add a lifecycleState with a timer that is due, for a lifecycle that
+ * has no driver.  It is fired anyway, and must be retried later rather
+ * than break the service thread.  Return the number of failed operations.
+ */
+static int add_del_nodriver (struct lcenv *lce, uint8_t *der_dn) {
+	uint8_t *der_at = (uint8_t *) "\x04\x0fnodriver . ev@1";
+	uint8_t *der [] = { der_dn, der_at };
+	int failed = 0;
+	if ((pulleyback_add (lce, der) == 0) || (pulleyback_commit (lce) == 0)) {
+		fprintf (stderr, "Failed to add lifecycleState without a driver\n");
+		failed++;
+	}
+	// Wait for the service thread to fire the timer, twice
+	if (!pulleyback_lifecycle_sync (lce) || !pulleyback_lifecycle_sync (lce)) {
+		perror ("Failed to sync");
+		failed++;
+	}
+	if ((pulleyback_del (lce, der) == 0) || (pulleyback_commit (lce) == 0)) {
+		fprintf (stderr, "Failed to delete lifecycleState without a driver\n");
+		failed++;
+	}
+	return failed;
+}
+
+
 int main (int argc, char **argv) {
 	uint8_t *der_dn1 = (uint8_t *) "\x04\x1cuid=bakker,dc=orvelte,dc=nep";
 	uint8_t *der_dn2 = (uint8_t *) "\x04\x1auid=smid,dc=orvelte,dc=nep";
@@ -76,7 +140,14 @@ int main (int argc, char **argv) {
 	pulleyback_rollback (lce);
 	debug_lcenv (lce);
 */
+	int failed = 0;
+	fprintf (stderr, "Adding and deleting long lifecycleStates\n");
+	failed += add_del_long (lce, der_dn1, 200);
+	failed += add_del_long (lce, der_dn1, 300);
+	fprintf (stderr, "Firing a timer without a driver\n");
+	failed += add_del_nodriver (lce, der_dn2);
+	debug_lcenv (lce);
 	pulleyback_close ((void *) lce);
 	fprintf (stderr, "Closed PulleyBack instance\n");
-	exit (0);
+	exit ((failed == 0) ? 0 : 1);
 }
@@ -0,0 +1,596 @@
+/* Benchmark the certification flow of doc/CERTFLOW.MD in a closed loop.
+ *
+ * Certificates are started with the four lifecycleStates for x509, acme,
+ * dane and tlspool.  The drivers are stood in for by plugin_certflow,
+ * which queues the firings.  This program takes them from the queue and
+ * completes each after a simulated delay, as its driver would, by moving
+ * the dot beyond the event and stamping the time on it.  Some events also
+ * set future times, such as cached_dns after added_dns, and deprecated
+ * and historic when the certificate goes into public_use.  The updated
+ * lifecycleState is fed back as LDAP would, with pulleyback_del() and
+ * pulleyback_add() in a transaction that ends with pulleyback_commit().
+ * A certificate lifecycle is complete when all four lifecycleStates are
+ * done, after which its forks are deleted.
+ *
+ * The backend runs on a simulated clock, which jumps to the next time at
+ * which a driver completes or a timer is due, so the certificates live
+ * through their lifetime in no time.  We report the completed lifecycles
+ * per second of real time, and for every stage how long it waited in
+ * simulated time, from the update of its lifecycleState to its firing.
+ * Waits for other lifecycles, such as dane?cached_dns, are part of that.
+ *
+ * Usage: bench_certflow -p plugin_certflow.so [-n certificates] [-l lifetime_days]
+ *
+ * Build without DEBUG for meaningful numbers.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dlfcn.h>
+
+#include "lifecycle.h"
+#include "test_util.h"
+#include <steamworks/pulleyback.h>
+
+
+typedef bool plugin_certflow_take_t (char **, char **, unsigned *);
+
+
+// A fixed start, so that every run sees the same times
+//
+#define SIM_START	1700000000
+
+// The delay that DNS caches add to the visibility of TLSA records
+//
+#define DNS_DELAY	2000
+
+#define LIFECYCLES	4
+#define LCS_MAX		256
+#define WORDS_MAX	32
+
+
+static char *lifecycles [LIFECYCLES] = { "x509", "acme", "dane", "tlspool" };
+
+static char *initial [LIFECYCLES] = {
+	"x509 . keygen@ request@ acme?download certified@ dane?cached_dns public_use@ deprecated@ historic@",
+	"acme . x509?request upload@ proof_dns@ download@ removed_dns@ clean_dns@",
+	"dane . x509?certified added_dns@ cached_dns@ x509?historic removed_dns@ clean_dns@",
+	"tlspool . x509?public_use assigned_tls@ removed_tls@",
+};
+
+
+/* The simulated seconds that a driver works on an event.  Any other
+ * events are merely stamped with the time.
+ */
+static struct {
+	char *event;
+	time_t delay;
+} delays [] = {
+	{ "keygen",       2 },
+	{ "request",      1 },
+	{ "upload",       5 },
+	{ "proof_dns",   30 },
+	{ "download",    10 },
+	{ "certified",    1 },
+	{ "added_dns",    5 },
+	{ "removed_dns",  5 },
+	{ "clean_dns",    5 },
+	{ "assigned_tls", 1 },
+	{ "removed_tls",  1 },
+	{ NULL,           0 }
+};
+
+
+/* A certificate with its lifecycleStates as they are in LDAP, the time
+ * that each was last updated, and whether a driver works on it.
+ */
+struct cert {
+	char   lcs [LIFECYCLES] [LCS_MAX];
+	time_t tim_update [LIFECYCLES];
+	bool   pending [LIFECYCLES];
+	time_t tim_historic;
+};
+
+
+/* Work of the drivers in progress, in a heap ordered on the time it
+ * completes.
+ */
+struct work {
+	time_t   due;
+	uint32_t cert;
+	uint16_t lc;
+	uint16_t event;
+};
+
+
+/* The waits of one stage, which is an event of a lifecycle.
+ */
+struct stage {
+	char      name [64];
+	uint64_t  count;
+	uint64_t  max;
+	uint32_t *waits;
+};
+
+
+static void *pbh;
+static struct cert *certs;
+static uint64_t certcnt = 10000;
+static time_t lifetime = 90 * 86400;
+static struct work *heap;
+static uint64_t heapcnt;
+static struct stage stages [64];
+static int stagecnt;
+static uint64_t rejected;
+
+
+static void *alloc (size_t size) {
+	void *mem = malloc (size);
+	if (mem == NULL) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	return mem;
+}
+
+
+/* Pass a fork to Pulley, as LDAP would for an added or deleted value.
+ */
+static void feed (bool add, uint32_t ci, char *lcs) {
+	char dn [100];
+	uint8_t der_dn [128];
+	uint8_t der_lcs [LCS_MAX + 4];
+	uint8_t *fork [] = { der_dn, der_lcs };
+	snprintf (dn, sizeof (dn), "cn=host%lu.example.com,ou=certs,o=arpa2,dc=example,dc=nep", (unsigned long) ci);
+	der_string (der_dn, dn);
+	der_string (der_lcs, lcs);
+	if (!(add ? pulleyback_add (pbh, fork) : pulleyback_del (pbh, fork))) {
+		if (rejected++ < 10) {
+			fprintf (stderr, "Rejected %s of \"%s\" for %s\n", add ? "addition" : "deletion", lcs, dn);
+		}
+	}
+}
+
+
+static void commit (void) {
+	if (pulleyback_commit (pbh) == 0) {
+		fprintf (stderr, "Commit failed\n");
+		exit (1);
+	}
+}
+
+
+static bool work_before (struct work *a, struct work *b) {
+	if (a->due != b->due) {
+		return a->due < b->due;
+	}
+	if (a->cert != b->cert) {
+		return a->cert < b->cert;
+	}
+	return a->lc < b->lc;
+}
+
+
+static void work_push (struct work *wrk) {
+	uint64_t idx = heapcnt++;
+	while (idx > 0) {
+		uint64_t up = (idx - 1) / 2;
+		if (!work_before (wrk, &heap [up])) {
+			break;
+		}
+		heap [idx] = heap [up];
+		idx = up;
+	}
+	heap [idx] = *wrk;
+}
+
+
+static void work_pop (struct work *wrk) {
+	*wrk = heap [0];
+	struct work last = heap [--heapcnt];
+	uint64_t idx = 0;
+	while (2 * idx + 1 < heapcnt) {
+		uint64_t down = 2 * idx + 1;
+		if ((down + 1 < heapcnt) && work_before (&heap [down + 1], &heap [down])) {
+			down++;
+		}
+		if (!work_before (&heap [down], &last)) {
+			break;
+		}
+		heap [idx] = heap [down];
+		idx = down;
+	}
+	heap [idx] = last;
+}
+
+
+/* Split an lcstate into its events, leaving out the lifecycle name and
+ * the dot, whose position is returned in *dot.  The buffer is modified.
+ * Return the number of events.
+ */
+static int split (char *buf, char **words, int *dot) {
+	int wordcnt = 0;
+	char *save;
+	char *word = strtok_r (buf, " ", &save);
+	*dot = -1;
+	while ((word = strtok_r (NULL, " ", &save)) != NULL) {
+		if (strcmp (word, ".") == 0) {
+			*dot = wordcnt;
+		} else if (wordcnt < WORDS_MAX) {
+			words [wordcnt++] = word;
+		}
+	}
+	return wordcnt;
+}
+
+
+/* Copy the name of an event from its word, without the '@' or '?' part.
+ */
+static void event_name (char *word, char *name, size_t namelen) {
+	char *sep = strpbrk (word, "@?");
+	size_t len = (sep != NULL) ? (size_t) (sep - word) : strlen (word);
+	if (word [len] == '?') {
+		word = sep + 1;
+		len = strlen (word);
+	}
+	snprintf (name, namelen, "%.*s", (int) len, word);
+}
+
+
+/* Some drivers learn about times in the future, and set them on later
+ * events.  Return such a time for a later event, or 0 for none.
+ */
+static time_t future_time (struct cert *crt, char *done, char *later, time_t now) {
+	if ((strcmp (done, "added_dns") == 0) && (strcmp (later, "cached_dns@") == 0)) {
+		return now + DNS_DELAY;
+	}
+	if ((strcmp (done, "public_use") == 0) && (strcmp (later, "deprecated@") == 0)) {
+		return now + lifetime * 2 / 3;
+	}
+	if ((strcmp (done, "public_use") == 0) && (strcmp (later, "historic@") == 0)) {
+		return crt->tim_historic;
+	}
+	if ((strcmp (done, "assigned_tls") == 0) && (strcmp (later, "removed_tls@") == 0)) {
+		return crt->tim_historic;
+	}
+	return 0;
+}
+
+
+/* Complete an event of an lcstate as its driver would.  The events that
+ * the dot passes are stamped with the time if they have none yet, and the
+ * dot is moved beyond the event.  Return false when the event is not a
+ * timer after the dot.
+ */
+static bool complete (struct cert *crt, int lc, unsigned event, time_t now, char *out) {
+	char buf [LCS_MAX];
+	char *words [WORDS_MAX];
+	int dot;
+	strcpy (buf, crt->lcs [lc]);
+	int wordcnt = split (buf, words, &dot);
+	if ((dot < 0) || ((int) event < dot) || ((int) event >= wordcnt) ||
+			(strchr (words [event], '@') == NULL)) {
+		return false;
+	}
+	char done [LCS_MAX];
+	event_name (words [event], done, sizeof (done));
+	if (strcmp (done, "public_use") == 0) {
+		crt->tim_historic = now + lifetime;
+	}
+	size_t len = snprintf (out, LCS_MAX, "%s", lifecycles [lc]);
+	int wi;
+	for (wi=0; wi<wordcnt; wi++) {
+		char *word = words [wi];
+		size_t wlen = strlen (word);
+		time_t stamp = 0;
+		if (word [wlen - 1] == '@') {
+			if (wi <= (int) event) {
+				stamp = now;
+			} else {
+				stamp = future_time (crt, done, word, now);
+			}
+		}
+		if (stamp != 0) {
+			len += snprintf (out + len, LCS_MAX - len, " %s%lu", word, (unsigned long) stamp);
+		} else {
+			len += snprintf (out + len, LCS_MAX - len, " %s", word);
+		}
+		if (wi == (int) event) {
+			len += snprintf (out + len, LCS_MAX - len, " .");
+		}
+	}
+	return len < LCS_MAX;
+}
+
+
+static bool is_done (char *lcs) {
+	size_t len = strlen (lcs);
+	return (len >= 2) && (strcmp (lcs + len - 2, " .") == 0);
+}
+
+
+/* Count the wait of a stage.
+ */
+static void stage_record (int lc, char *event, time_t wait) {
+	char name [64];
+	snprintf (name, sizeof (name), "%s %s", lifecycles [lc], event);
+	int si;
+	for (si=0; si<stagecnt; si++) {
+		if (strcmp (stages [si].name, name) == 0) {
+			break;
+		}
+	}
+	struct stage *stg = &stages [si];
+	if (si == stagecnt) {
+		if (stagecnt == 64) {
+			return;
+		}
+		stagecnt++;
+		strcpy (stg->name, name);
+	}
+	if (stg->count == stg->max) {
+		stg->max = (stg->max == 0) ? 1024 : (2 * stg->max);
+		stg->waits = realloc (stg->waits, stg->max * sizeof (uint32_t));
+		if (stg->waits == NULL) {
+			fprintf (stderr, "Out of memory\n");
+			exit (1);
+		}
+	}
+	stg->waits [stg->count++] = wait;
+}
+
+
+static int cmp_uint32 (const void *a, const void *b) {
+	uint32_t ua = *(const uint32_t *) a;
+	uint32_t ub = *(const uint32_t *) b;
+	return (ua > ub) - (ua < ub);
+}
+
+
+/* Take the firings from the queue of plugin_certflow, and start work on
+ * them.  A firing that is already worked on, or that is about an older
+ * lifecycleState, is a repeat.  Return the number of firings taken.
+ */
+static uint64_t take_firings (plugin_certflow_take_t *take, time_t now, uint64_t *repeats) {
+	uint64_t taken = 0;
+	char *dn;
+	char *lcs;
+	unsigned event;
+	while (take (&dn, &lcs, &event)) {
+		taken++;
+		unsigned long ci = certcnt;
+		sscanf (dn, "cn=host%lu.", &ci);
+		int lc;
+		for (lc=0; lc<LIFECYCLES; lc++) {
+			size_t len = strlen (lifecycles [lc]);
+			if ((strncmp (lcs, lifecycles [lc], len) == 0) && (lcs [len] == ' ')) {
+				break;
+			}
+		}
+		struct cert *crt = (ci < certcnt) ? &certs [ci] : NULL;
+		if ((crt == NULL) || (lc == LIFECYCLES) || crt->pending [lc] ||
+				(strcmp (lcs, crt->lcs [lc]) != 0)) {
+			(*repeats)++;
+		} else {
+			char buf [LCS_MAX];
+			char *words [WORDS_MAX];
+			int dot;
+			strcpy (buf, lcs);
+			char name [LCS_MAX] = "?";
+			if ((int) event < split (buf, words, &dot)) {
+				event_name (words [event], name, sizeof (name));
+			}
+			stage_record (lc, name, now - crt->tim_update [lc]);
+			time_t delay = 0;
+			int di;
+			for (di=0; delays [di].event != NULL; di++) {
+				if (strcmp (delays [di].event, name) == 0) {
+					// Spread the work, rather than run in lockstep
+					delay = delays [di].delay + ci % (delays [di].delay + 1);
+				}
+			}
+			struct work wrk = { now + delay, ci, lc, event };
+			crt->pending [lc] = true;
+			work_push (&wrk);
+		}
+		free (dn);
+		free (lcs);
+	}
+	return taken;
+}
+
+
+/* Complete the work that is due, and feed the updates back in one
+ * transaction.  Return the number of updates.
+ */
+static uint64_t complete_work (time_t now, uint64_t *completed, uint32_t *durations) {
+	uint64_t updates = 0;
+	while ((heapcnt > 0) && (heap [0].due <= now)) {
+		struct work wrk;
+		work_pop (&wrk);
+		struct cert *crt = &certs [wrk.cert];
+		char next [LCS_MAX];
+		if (!complete (crt, wrk.lc, wrk.event, now, next)) {
+			fprintf (stderr, "Cannot complete event %d of \"%s\"\n", wrk.event, crt->lcs [wrk.lc]);
+			exit (1);
+		}
+		crt->pending [wrk.lc] = false;
+		feed (false, wrk.cert, crt->lcs [wrk.lc]);
+		strcpy (crt->lcs [wrk.lc], next);
+		crt->tim_update [wrk.lc] = now;
+		int lc;
+		for (lc=0; lc<LIFECYCLES; lc++) {
+			if (!is_done (crt->lcs [lc])) {
+				break;
+			}
+		}
+		if (lc < LIFECYCLES) {
+			feed (true, wrk.cert, next);
+		} else {
+			// The certificate lifecycle is complete; remove it
+			for (lc=0; lc<LIFECYCLES; lc++) {
+				if (lc != wrk.lc) {
+					feed (false, wrk.cert, crt->lcs [lc]);
+				}
+			}
+			durations [(*completed)++] = now - SIM_START;
+		}
+		updates++;
+	}
+	if (updates > 0) {
+		commit ();
+	}
+	return updates;
+}
+
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s -p plugin_certflow.so [-n certificates] [-l lifetime_days]\n", prog);
+	exit (1);
+}
+
+
+int main (int argc, char **argv) {
+	char *plugin = NULL;
+	int opt;
+	while ((opt = getopt (argc, argv, "p:n:l:")) != -1) {
+		switch (opt) {
+		case 'p':
+			plugin = optarg;
+			break;
+		case 'n':
+			certcnt = strtoull (optarg, NULL, 10);
+			break;
+		case 'l':
+			lifetime = atol (optarg) * 86400;
+			break;
+		default:
+			usage (argv [0]);
+		}
+	}
+	if ((plugin == NULL) || (certcnt == 0) || (lifetime <= 0)) {
+		usage (argv [0]);
+	}
+	//
+	// Open the backend on the simulated clock, with the four drivers
+	//
+	struct lifecycle_clock_sim sim;
+	lifecycle_clock_sim_init (&sim, SIM_START);
+	lifecycle_clock_use (&sim.clk);
+	char drivers [LIFECYCLES] [1024];
+	char *args [LIFECYCLES + 2] = { argv [0] };
+	int lc;
+	for (lc=0; lc<LIFECYCLES; lc++) {
+		snprintf (drivers [lc], sizeof (drivers [lc]), "%s,plugin=%s", lifecycles [lc], plugin);
+		args [lc + 1] = drivers [lc];
+	}
+	pbh = pulleyback_open (LIFECYCLES + 1, args, 2);
+	lifecycle_clock_use (NULL);
+	if (pbh == NULL) {
+		fprintf (stderr, "Failed to open Pulley Backend\n");
+		exit (1);
+	}
+	void *dlh = dlopen (plugin, RTLD_NOW | RTLD_NOLOAD);
+	plugin_certflow_take_t *take;
+	*(void **) &take = (dlh == NULL) ? NULL : dlsym (dlh, "plugin_certflow_take");
+	if (take == NULL) {
+		fprintf (stderr, "Plugin %s does not queue firings\n", plugin);
+		exit (1);
+	}
+	//
+	// Start all certificate lifecycles
+	//
+	double start = now_secs ();
+	certs = alloc (certcnt * sizeof (struct cert));
+	heap = alloc (certcnt * LIFECYCLES * sizeof (struct work));
+	uint32_t *durations = alloc (certcnt * sizeof (uint32_t));
+	uint64_t ci;
+	for (ci=0; ci<certcnt; ci++) {
+		struct cert *crt = &certs [ci];
+		memset (crt, 0, sizeof (*crt));
+		for (lc=0; lc<LIFECYCLES; lc++) {
+			strcpy (crt->lcs [lc], initial [lc]);
+			crt->tim_update [lc] = SIM_START;
+			feed (true, ci, crt->lcs [lc]);
+		}
+		if (((ci + 1) % 1000 == 0) || (ci + 1 == certcnt)) {
+			commit ();
+		}
+	}
+	//
+	// Run the drivers and jump the clock until all lifecycles complete
+	//
+	time_t now = SIM_START;
+	uint64_t completed = 0;
+	uint64_t firings = 0;
+	uint64_t repeats = 0;
+	uint64_t updates = 0;
+	uint64_t jumps = 0;
+	while (completed < certcnt) {
+		if (!pulleyback_lifecycle_sync (pbh)) {
+			perror ("Failed to sync");
+			exit (1);
+		}
+		uint64_t taken = take_firings (take, now, &repeats);
+		uint64_t done = complete_work (now, &completed, durations);
+		firings += taken;
+		updates += done;
+		if ((taken > 0) || (done > 0)) {
+			continue;
+		}
+		time_t next = (heapcnt > 0) ? heap [0].due : MAX_TIME_T;
+		struct lifecycle_stats sts;
+		if (pulleyback_lifecycle_stats (pbh, &sts) && (sts.deadline != 0) && (sts.deadline < next)) {
+			next = sts.deadline;
+		}
+		if (next == MAX_TIME_T) {
+			fprintf (stderr, "Stuck with %lu of %lu lifecycles completed\n",
+					(unsigned long) completed, (unsigned long) certcnt);
+			break;
+		}
+		if (next <= now) {
+			next = now + 1;
+		}
+		lifecycle_clock_sim_advance (&sim, (next - now) * (uint64_t) 1000000000);
+		now = next;
+		jumps++;
+	}
+	double secs = now_secs () - start;
+	//
+	// Report
+	//
+	printf ("certflow: %lu of %lu lifecycles completed in %.3f s, %.0f lifecycles/s\n",
+			(unsigned long) completed, (unsigned long) certcnt, secs, completed / secs);
+	printf ("certflow: %lu firings, %lu repeated, %lu updates, %lu clock jumps, %lu rejected\n",
+			(unsigned long) firings, (unsigned long) repeats, (unsigned long) updates,
+			(unsigned long) jumps, (unsigned long) rejected);
+	if (completed > 0) {
+		qsort (durations, completed, sizeof (uint32_t), cmp_uint32);
+		printf ("certflow: lifecycle took p50 %.2f days, max %.2f days of simulated time\n",
+				durations [completed / 2] / 86400.0, durations [completed - 1] / 86400.0);
+	}
+	int si;
+	for (si=0; si<stagecnt; si++) {
+		struct stage *stg = &stages [si];
+		qsort (stg->waits, stg->count, sizeof (uint32_t), cmp_uint32);
+		printf ("stage %-20s %8lu fired, waited p50 %lu s, p99 %lu s, max %lu s\n",
+				stg->name, (unsigned long) stg->count,
+				(unsigned long) stg->waits [stg->count / 2],
+				(unsigned long) stg->waits [stg->count * 99 / 100],
+				(unsigned long) stg->waits [stg->count - 1]);
+		free (stg->waits);
+	}
+	pulleyback_close (pbh);
+	dlclose (dlh);
+	free (durations);
+	free (heap);
+	free (certs);
+	exit ((completed == certcnt) && (rejected == 0) ? 0 : 1);
+}
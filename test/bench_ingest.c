@@ -0,0 +1,222 @@
+/* Benchmark the ingestion of forks from Pulley.
+ *
+ * Synthetic forks are generated, each a distinguishedName in the style
+ * of a certificate flow, with a lifecycleState for x509, dane or acme.
+ * They are added in transactions of a given size, and then deleted in
+ * the same way.  We report the forks per second for both phases, the
+ * latency percentiles for pulleyback_commit() and the peak RSS, along
+ * with the statistics of the backend after each phase.
+ *
+ * Usage: bench_ingest [-n forks] [-c forks_per_commit] [-f] [driver...]
+ *
+ * The drivers default to stand-ins that discard their input.  The timers
+ * in the generated lifecycleStates are in the future, so the drivers
+ * are hardly bothered while forks are being ingested.  With -f they are
+ * due right away, so the service thread fires them while more forks come
+ * in, and the lock statistics show how the two threads contend.
+ *
+ * Build without DEBUG for meaningful numbers.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include "lifecycle.h"
+#include "test_util.h"
+#include <steamworks/pulleyback.h>
+
+
+/* Generate fork number i, as DER for its distinguishedName and its
+ * lifecycleState.  Three forks share each distinguishedName, one for
+ * every lifecycle.
+ */
+static void gen_fork (uint64_t i, time_t base, bool fire, uint8_t *der_dn, uint8_t *der_lcs) {
+	char dn [200];
+	char lcs [200];
+	uint64_t obj = i / 3;
+	snprintf (dn, sizeof (dn), "cn=host%lu.dept%lu.example%lu.com,ou=certs,o=arpa2,dc=example,dc=nep",
+			(unsigned long) obj, (unsigned long) (obj % 97), (unsigned long) (obj % 1009));
+	time_t later = fire ? base : (base + 86400 + (time_t) (obj % 86400));
+	switch (i % 3) {
+	case 0:
+		snprintf (lcs, sizeof (lcs), "x509 csr@%lu . sign@%lu renew@ expire@",
+				(unsigned long) base, (unsigned long) later);
+		break;
+	case 1:
+		snprintf (lcs, sizeof (lcs), "dane . x509?sign publish@ retract@%lu",
+				(unsigned long) later);
+		break;
+	default:
+		snprintf (lcs, sizeof (lcs), "acme order@%lu . fetch@%lu install@",
+				(unsigned long) base, (unsigned long) later);
+		break;
+	}
+	der_string (der_dn, dn);
+	der_string (der_lcs, lcs);
+}
+
+
+static int cmp_double (const void *a, const void *b) {
+	double da = *(const double *) a;
+	double db = *(const double *) b;
+	return (da > db) - (da < db);
+}
+
+
+/* Run one phase of adding or deleting all forks, with a commit after
+ * every batch.  Store the commit latencies and return the seconds used.
+ */
+static double run_phase (void *pbh, int add, uint64_t forks, uint64_t batch, time_t base, bool fire, double *lat, uint64_t *latcnt) {
+	uint8_t der_dn [256];
+	uint8_t der_lcs [256];
+	uint8_t *fork [] = { der_dn, der_lcs };
+	uint64_t rejected = 0;
+	double start = now_secs ();
+	uint64_t i;
+	for (i=0; i<forks; i++) {
+		gen_fork (i, base, fire, der_dn, der_lcs);
+		int ok = add ? pulleyback_add (pbh, fork) : pulleyback_del (pbh, fork);
+		if (!ok) {
+			rejected++;
+		}
+		if (((i + 1) % batch == 0) || (i + 1 == forks)) {
+			double t0 = now_secs ();
+			if (pulleyback_commit (pbh) == 0) {
+				fprintf (stderr, "Commit failed after fork %lu\n", (unsigned long) i);
+			}
+			lat [(*latcnt)++] = now_secs () - t0;
+		}
+	}
+	if (rejected > 0) {
+		fprintf (stderr, "Rejected %lu forks while %s\n", (unsigned long) rejected, add ? "adding" : "deleting");
+	}
+	return now_secs () - start;
+}
+
+
+static void report (char *phase, uint64_t forks, double secs, double *lat, uint64_t latcnt) {
+	qsort (lat, latcnt, sizeof (double), cmp_double);
+	printf ("%s: %lu forks in %.3f s, %.0f forks/s\n", phase,
+			(unsigned long) forks, secs, forks / secs);
+	printf ("%s: %lu commits, latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", phase,
+			(unsigned long) latcnt,
+			1e3 * lat [latcnt * 50 / 100],
+			1e3 * lat [latcnt * 90 / 100],
+			1e3 * lat [latcnt * 99 / 100],
+			1e3 * lat [latcnt - 1]);
+}
+
+
+static void report_stats (char *phase, void *pbh) {
+	struct lifecycle_stats sts;
+	if (!pulleyback_lifecycle_stats (pbh, &sts)) {
+		return;
+	}
+	printf ("%s: %lu objects, %lu states, %lu commits, %lu aborts, %lu added, %lu deleted, %lu rejected\n", phase,
+			(unsigned long) sts.objects, (unsigned long) sts.states,
+			(unsigned long) sts.txn_committed, (unsigned long) sts.txn_aborted,
+			(unsigned long) sts.forks_added, (unsigned long) sts.forks_deleted,
+			(unsigned long) sts.forks_rejected);
+	printf ("%s: lock taken %lu times, waited %.3f ms, held %.3f ms\n", phase,
+			(unsigned long) sts.envown_acquired,
+			sts.envown_wait_ns / 1e6, sts.envown_hold_ns / 1e6);
+	struct lifecycle_histogram hst;
+	if (pulleyback_lifecycle_histogram (pbh, LIFECYCLE_HIST_WAKEUP, 0, &hst)) {
+		printf ("%s: commit to wakeup p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", phase,
+				lifecycle_histogram_percentile (&hst, 50) / 1e6,
+				lifecycle_histogram_percentile (&hst, 99) / 1e6,
+				lifecycle_histogram_percentile (&hst, 100) / 1e6);
+	}
+	if (pulleyback_lifecycle_histogram (pbh, LIFECYCLE_HIST_ADDWAIT, 0, &hst)) {
+		printf ("%s: blocked on lock p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", phase,
+				lifecycle_histogram_percentile (&hst, 50) / 1e6,
+				lifecycle_histogram_percentile (&hst, 99) / 1e6,
+				lifecycle_histogram_percentile (&hst, 100) / 1e6);
+	}
+	static char *paths [LIFECYCLE_LOCK_PATHS] = { "txn", "service", "dispatch", "control" };
+	int path;
+	for (path=0; path<LIFECYCLE_LOCK_PATHS; path++) {
+		struct lifecycle_lock_stats lks;
+		if (!pulleyback_lifecycle_lock_stats (pbh, path, &lks) || (lks.acquired == 0)) {
+			continue;
+		}
+		printf ("%s: lock for %s taken %lu times, %lu contended, waited %.3f ms (max %.3f), held %.3f ms (max %.3f)\n",
+				phase, paths [path],
+				(unsigned long) lks.acquired, (unsigned long) lks.contended,
+				lks.wait_ns / 1e6, lks.wait_max_ns / 1e6,
+				lks.hold_ns / 1e6, lks.hold_max_ns / 1e6);
+	}
+}
+
+
+int main (int argc, char **argv) {
+	uint64_t forks = 100000;
+	uint64_t batch = 10000;
+	bool fire = false;
+	int opt;
+	while ((opt = getopt (argc, argv, "n:c:f")) != -1) {
+		switch (opt) {
+		case 'n':
+			forks = strtoull (optarg, NULL, 10);
+			break;
+		case 'c':
+			batch = strtoull (optarg, NULL, 10);
+			break;
+		case 'f':
+			fire = true;
+			break;
+		default:
+			fprintf (stderr, "Usage: %s [-n forks] [-c forks_per_commit] [-f] [driver...]\n", argv [0]);
+			exit (1);
+		}
+	}
+	if ((forks == 0) || (batch == 0)) {
+		fprintf (stderr, "Need at least one fork and commit\n");
+		exit (1);
+	}
+	char *stand_ins [] = { argv [0],
+		"x509=cat >/dev/null",
+		"dane=cat >/dev/null",
+		"acme=cat >/dev/null",
+		NULL };
+	char **drivers = stand_ins;
+	int drivercnt = 4;
+	if (optind < argc) {
+		drivers = argv + optind - 1;
+		drivercnt = argc - optind + 1;
+	}
+	void *pbh = pulleyback_open (drivercnt, drivers, 2);
+	if (pbh == NULL) {
+		fprintf (stderr, "Failed to open Pulley Backend\n");
+		exit (1);
+	}
+	uint64_t commits = (forks + batch - 1) / batch;
+	double *lat = calloc (commits, sizeof (double));
+	if (lat == NULL) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	time_t base = time (NULL);
+	uint64_t latcnt = 0;
+	double secs = run_phase (pbh, 1, forks, batch, base, fire, lat, &latcnt);
+	report ("add", forks, secs, lat, latcnt);
+	report_stats ("add", pbh);
+	latcnt = 0;
+	secs = run_phase (pbh, 0, forks, batch, base, fire, lat, &latcnt);
+	report ("del", forks, secs, lat, latcnt);
+	report_stats ("del", pbh);
+	struct rusage ru;
+	getrusage (RUSAGE_SELF, &ru);
+	printf ("peak RSS: %ld kB\n", ru.ru_maxrss);
+	pulleyback_close (pbh);
+	free (lat);
+	exit (0);
+}
@@ -0,0 +1,590 @@
+/* Benchmark the parsers that check every fork from Pulley.
+ *
+ * A corpus of DER values is generated, holding realistic and adversarial
+ * distinguishedNames and lifecycleStates: certificate flows, long chains
+ * of events, values of the maximum DER length, and malformed values that
+ * could make the regular expressions work hard.  Every input is passed
+ * through parse_der() and then through grammar_dn() or grammar_lcstate(),
+ * and for lifecycleStates, find_type() and idlen() are run over their
+ * words.  We report the average and the worst nanoseconds per byte for
+ * every function on every kind of input, so that a spike on one input
+ * stands out.  The verdicts of the grammars are checked as well.
+ *
+ * Usage: bench_parse [-r repeats] [-w corpusdir]
+ *
+ * With -w the corpus is written to a directory, one DER value per file,
+ * instead of being measured.  Compiled with FUZZING, this file provides
+ * LLVMFuzzerTestOneInput() instead of main(), which takes any DER value
+ * like the ones in that corpus.
+ *
+ * Build without DEBUG for meaningful numbers.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lifecycle.h"
+
+
+bool parse_der (uint8_t *der, char **ptr, size_t *len);
+bool grammar_lcstate (char *lcs);
+bool grammar_dn (char *dn);
+size_t idlen (char *idstr);
+char find_type (char *next);
+
+
+/* Run the parsers on a DER value of a given size, as Pulley would pass
+ * it to pulleyback_add(), with a few bytes of slack after it.  Return the
+ * text in a NUL-terminated copy that must be freed, or NULL when parsing
+ * fails.
+ */
+static char *run_der (uint8_t *der, size_t size) {
+	char *ptr;
+	size_t len;
+	if ((size < 2) || !parse_der (der, &ptr, &len) ||
+			((uint8_t *) ptr + len > der + size)) {
+		return NULL;
+	}
+	char *str = malloc (len + 1);
+	if (str == NULL) {
+		return NULL;
+	}
+	memcpy (str, ptr, len);
+	str [len] = '\0';
+	if (memchr (str, '\0', len) != NULL) {
+		free (str);
+		return NULL;
+	}
+	return str;
+}
+
+
+/* Run find_type() at the start of every word, as the service thread does
+ * when it moves through the events of an lcstate.  Return the number of
+ * events of the '@' type.
+ */
+static unsigned run_words (char *lcs) {
+	unsigned timers = 0;
+	char *word = lcs;
+	while (word != NULL) {
+		if (find_type (word) == '@') {
+			timers++;
+		}
+		word = strchr (word + idlen (word), ' ');
+		if (word != NULL) {
+			word++;
+		}
+	}
+	return timers;
+}
+
+
+#ifdef FUZZING
+
+
+int LLVMFuzzerTestOneInput (const uint8_t *data, size_t size) {
+	uint8_t *der = calloc (size + 4, 1);
+	if (der == NULL) {
+		return 0;
+	}
+	memcpy (der, data, size);
+	char *str = run_der (der, size);
+	if (str != NULL) {
+		grammar_dn (str);
+		if (grammar_lcstate (str)) {
+			run_words (str);
+		}
+		free (str);
+	}
+	free (der);
+	return 0;
+}
+
+
+#else
+
+
+// The maximum length of a DER value with a 2-byte length
+//
+#define DER_MAX		65535
+
+
+/* A corpus entry, with the kind of input, the DER value, and whether the
+ * grammar should accept it, or -1 when either is fine.
+ */
+struct input {
+	const char *kind;
+	bool is_dn;
+	int expect;
+	size_t size;
+	uint8_t *der;
+};
+
+static struct input *corpus;
+static unsigned inputcnt;
+static unsigned inputmax;
+
+
+/* A fixed pseudo-random sequence, so every run has the same corpus.
+ */
+static uint64_t rnd_state = 0x2545f4914f6cdd1dULL;
+//
+static uint32_t rnd (uint32_t range) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return (uint32_t) (rnd_state >> 32) % range;
+}
+
+
+/* A growing text buffer, to build inputs into.
+ */
+static char text [DER_MAX + 1];
+static size_t textlen;
+//
+static void text_reset (void) {
+	textlen = 0;
+	text [0] = '\0';
+}
+//
+static bool text_add (const char *fmt, ...) {
+	va_list args;
+	va_start (args, fmt);
+	int len = vsnprintf (text + textlen, sizeof (text) - textlen, fmt, args);
+	va_end (args);
+	if ((len < 0) || (textlen + len >= sizeof (text))) {
+		text [textlen] = '\0';
+		return false;
+	}
+	textlen += len;
+	return true;
+}
+
+
+/* Add the text as a DER OCTET STRING to the corpus.
+ */
+static void add_input (const char *kind, bool is_dn, int expect) {
+	if (inputcnt == inputmax) {
+		inputmax = (inputmax == 0) ? 256 : (2 * inputmax);
+		corpus = realloc (corpus, inputmax * sizeof (struct input));
+		if (corpus == NULL) {
+			fprintf (stderr, "Out of memory\n");
+			exit (1);
+		}
+	}
+	struct input *in = &corpus [inputcnt++];
+	in->kind = kind;
+	in->is_dn = is_dn;
+	in->expect = expect;
+	in->der = malloc (textlen + 4 + 4);
+	if (in->der == NULL) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	size_t hdr;
+	in->der [0] = 0x04;
+	if (textlen < 128) {
+		in->der [1] = textlen;
+		hdr = 2;
+	} else if (textlen < 256) {
+		in->der [1] = 0x81;
+		in->der [2] = textlen;
+		hdr = 3;
+	} else {
+		in->der [1] = 0x82;
+		in->der [2] = textlen >> 8;
+		in->der [3] = textlen & 0xff;
+		hdr = 4;
+	}
+	memcpy (in->der + hdr, text, textlen);
+	memset (in->der + hdr + textlen, 0, 4);
+	in->size = hdr + textlen;
+}
+
+
+/* Add a raw DER header without a proper value.
+ */
+static void add_raw (const char *kind, uint8_t *der, size_t size) {
+	text_reset ();
+	add_input (kind, false, 0);
+	struct input *in = &corpus [inputcnt - 1];
+	memcpy (in->der, der, size);
+	in->size = size;
+}
+
+
+static void gen_identifier (unsigned len) {
+	static const char *alpha = "abcdefghijklmnopqrstuvwxyz_-";
+	while (len-- > 0) {
+		text_add ("%c", alpha [rnd (28)]);
+	}
+}
+
+
+static void gen_lcs_real (void) {
+	static const char *flows [] = {
+		"x509 keygen@%u request@%u acme?download . certified@ dane?cached_dns public_use@ deprecated@ historic@",
+		"acme x509?request upload@%u proof_dns@%u . download@ removed_dns@ clean_dns@",
+		"dane x509?certified added_dns@%u . cached_dns@%u x509?historic removed_dns@ clean_dns@",
+		"tlspool x509?public_use assigned_tls@%u . removed_tls@%u",
+		"x509 csr@%u . sign@%u renew@ expire@",
+		"dane . x509?sign publish@ retract@%u",
+		"acme order@%u . fetch@%u install@",
+		"pkix csr@%u . sign@ serial=%u",
+	};
+	int i;
+	for (i=0; i<400; i++) {
+		unsigned stamp = 1700000000 + rnd (100000000);
+		text_reset ();
+		text_add (flows [i % 8], stamp, stamp + rnd (86400));
+		add_input ("lcs-real", false, 1);
+	}
+}
+
+
+static void gen_lcs_long (void) {
+	unsigned events;
+	for (events=16; events<=4096; events*=2) {
+		text_reset ();
+		text_add ("chain");
+		unsigned e;
+		for (e=0; (e<events) && text_add (" ev%u@%u", e, 1700000000 + e); e++) {
+			;
+		}
+		text_add (" .");
+		add_input ("lcs-long", false, 1);
+	}
+	// The longest value that DER can carry, with events to do
+	text_reset ();
+	text_add ("chain .");
+	while ((textlen < DER_MAX - 32) && text_add (" other?ev%u", rnd (1000000))) {
+		;
+	}
+	add_input ("lcs-max", false, 1);
+	text_reset ();
+	text_add ("chain");
+	while ((textlen < DER_MAX - 32) && text_add (" var%u=%u", rnd (1000), rnd (1000000))) {
+		;
+	}
+	text_add (" .");
+	add_input ("lcs-max", false, 1);
+}
+
+
+static void gen_lcs_bad (void) {
+	unsigned size;
+	for (size=64; size<=DER_MAX/2; size*=4) {
+		// A long chain without a dot
+		text_reset ();
+		text_add ("chain");
+		while ((textlen < size) && text_add (" ev@%u", rnd (1000000))) {
+			;
+		}
+		add_input ("lcs-bad", false, 0);
+		// A long chain with the dot, ending in a bad character
+		text_reset ();
+		text_add ("chain .");
+		while ((textlen < size) && text_add (" x?y")) {
+			;
+		}
+		text_add (" !");
+		add_input ("lcs-bad", false, 0);
+		// One long identifier with digits inside
+		text_reset ();
+		while (textlen < size) {
+			gen_identifier (8);
+			text_add ("0");
+		}
+		text_add (" .");
+		add_input ("lcs-bad", false, 0);
+		// Words that are ambiguous between events, until the last
+		text_reset ();
+		text_add ("a");
+		while ((textlen < size) && text_add (" a=a@a?a")) {
+			;
+		}
+		text_add (" . a@a");
+		add_input ("lcs-bad", false, 0);
+		// Two dots and a trailing space
+		text_reset ();
+		text_add ("x");
+		while ((textlen < size) && text_add (" ev@1 .")) {
+			;
+		}
+		text_add (" ");
+		add_input ("lcs-bad", false, 0);
+		// Many spaces
+		text_reset ();
+		text_add ("x");
+		while ((textlen < size) && text_add ("  ")) {
+			;
+		}
+		text_add (".");
+		add_input ("lcs-bad", false, 0);
+	}
+}
+
+
+static void gen_dn_real (void) {
+	int i;
+	for (i=0; i<400; i++) {
+		unsigned obj = rnd (1000000);
+		text_reset ();
+		switch (i % 4) {
+		case 0:
+			text_add ("cn=host%u.dept%u.example%u.com,ou=certs,o=arpa2,dc=example,dc=nep",
+					obj, obj % 97, obj % 1009);
+			break;
+		case 1:
+			text_add ("uid=user%u,ou=people,dc=orvelte,dc=nep", obj);
+			break;
+		case 2:
+			text_add ("uid=\"user %u\",dc=orvelte,dc=nep", obj);
+			break;
+		default:
+			text_add ("cn=svc%u+uid=%u,ou=services,1.3.6.1.4.1.44469=x,dc=nep", obj, obj);
+			break;
+		}
+		add_input ("dn-real", true, 1);
+	}
+}
+
+
+static void gen_dn_long (void) {
+	unsigned size;
+	for (size=256; size<=DER_MAX; size*=4) {
+		text_reset ();
+		text_add ("cn=leaf");
+		while ((textlen < size - 32) && text_add (",ou=level%u", rnd (1000))) {
+			;
+		}
+		add_input ("dn-long", true, 1);
+		text_reset ();
+		text_add ("cn=multi");
+		while ((textlen < size - 32) && text_add ("+uid=%u", rnd (1000000))) {
+			;
+		}
+		text_add (",dc=nep");
+		add_input ("dn-long", true, 1);
+	}
+}
+
+
+static void gen_dn_bad (void) {
+	unsigned size;
+	for (size=64; size<=DER_MAX/2; size*=4) {
+		// An unterminated quote is accepted as a plain value
+		text_reset ();
+		text_add ("uid=\"");
+		while ((textlen < size) && text_add ("a b ")) {
+			;
+		}
+		add_input ("dn-bad", true, -1);
+		// Values that look like types, ending without a type
+		text_reset ();
+		text_add ("a");
+		while ((textlen < size) && text_add ("=a")) {
+			;
+		}
+		text_add (",=");
+		add_input ("dn-bad", true, 0);
+		// Many empty RDNs
+		text_reset ();
+		text_add ("cn=x");
+		while ((textlen < size) && text_add (",,")) {
+			;
+		}
+		add_input ("dn-bad", true, 0);
+		// An OID type with a leading zero at the end
+		text_reset ();
+		text_add ("1");
+		while ((textlen < size) && text_add (".%u", 1 + rnd (99))) {
+			;
+		}
+		text_add (".0=x");
+		add_input ("dn-bad", true, 0);
+	}
+}
+
+
+static void gen_der_bad (void) {
+	uint8_t indefinite [] = { 0x04, 0x80, 0x00, 0x00 };
+	uint8_t lenlen3 [] = { 0x04, 0x83, 0x01, 0x00, 0x00 };
+	uint8_t short_hdr [] = { 0x04, 0x82, 0xff };
+	uint8_t past_end [] = { 0x04, 0x82, 0xff, 0xff, 'x' };
+	add_raw ("der-bad", indefinite, sizeof (indefinite));
+	add_raw ("der-bad", lenlen3, sizeof (lenlen3));
+	add_raw ("der-bad", short_hdr, sizeof (short_hdr));
+	add_raw ("der-bad", past_end, sizeof (past_end));
+}
+
+
+static uint64_t now_ns (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+
+/* Write the corpus to a directory, for use by a fuzzer.
+ */
+static void write_corpus (char *dir) {
+	unsigned i;
+	for (i=0; i<inputcnt; i++) {
+		char path [1024];
+		snprintf (path, sizeof (path), "%s/%s-%04u.der", dir, corpus [i].kind, i);
+		FILE *f = fopen (path, "wb");
+		if ((f == NULL) || (fwrite (corpus [i].der, corpus [i].size, 1, f) != 1)) {
+			perror (path);
+			exit (1);
+		}
+		fclose (f);
+	}
+	printf ("corpus: %u inputs written to %s\n", inputcnt, dir);
+}
+
+
+/* The measurements of a function on a kind of input.
+ */
+struct measure {
+	const char *func;
+	const char *kind;
+	unsigned inputs;
+	uint64_t bytes;
+	uint64_t ns;
+	double worst;
+	size_t worstlen;
+};
+
+static struct measure measures [64];
+static unsigned measurecnt;
+//
+static void measure (const char *func, const char *kind, size_t len, uint64_t ns) {
+	unsigned mi;
+	for (mi=0; mi<measurecnt; mi++) {
+		if ((strcmp (measures [mi].func, func) == 0) && (strcmp (measures [mi].kind, kind) == 0)) {
+			break;
+		}
+	}
+	if (mi == 64) {
+		return;
+	}
+	struct measure *msr = &measures [mi];
+	if (mi == measurecnt) {
+		measurecnt++;
+		msr->func = func;
+		msr->kind = kind;
+	}
+	if (len == 0) {
+		len = 1;
+	}
+	msr->inputs++;
+	msr->bytes += len;
+	msr->ns += ns;
+	if ((double) ns / len > msr->worst) {
+		msr->worst = (double) ns / len;
+		msr->worstlen = len;
+	}
+}
+
+
+int main (int argc, char **argv) {
+	unsigned repeats = 20;
+	char *corpusdir = NULL;
+	int opt;
+	while ((opt = getopt (argc, argv, "r:w:")) != -1) {
+		switch (opt) {
+		case 'r':
+			repeats = atoi (optarg);
+			break;
+		case 'w':
+			corpusdir = optarg;
+			break;
+		default:
+			fprintf (stderr, "Usage: %s [-r repeats] [-w corpusdir]\n", argv [0]);
+			exit (1);
+		}
+	}
+	if (repeats == 0) {
+		repeats = 1;
+	}
+	gen_lcs_real ();
+	gen_lcs_long ();
+	gen_lcs_bad ();
+	gen_dn_real ();
+	gen_dn_long ();
+	gen_dn_bad ();
+	gen_der_bad ();
+	if (corpusdir != NULL) {
+		write_corpus (corpusdir);
+		exit (0);
+	}
+	unsigned failed = 0;
+	unsigned i;
+	for (i=0; i<inputcnt; i++) {
+		struct input *in = &corpus [i];
+		// Parse the DER header
+		uint64_t t0 = now_ns ();
+		unsigned r;
+		char *str = NULL;
+		for (r=0; r<repeats; r++) {
+			free (str);
+			str = run_der (in->der, in->size);
+		}
+		measure ("parse_der", in->kind, in->size, (now_ns () - t0) / repeats);
+		if (str == NULL) {
+			if (in->expect != 0) {
+				fprintf (stderr, "Failed to parse DER of %s input %u\n", in->kind, i);
+				failed++;
+			}
+			continue;
+		}
+		size_t len = strlen (str);
+		// Check the grammar, after compiling its regex
+		bool ok = in->is_dn ? grammar_dn (str) : grammar_lcstate (str);
+		t0 = now_ns ();
+		for (r=0; r<repeats; r++) {
+			ok = in->is_dn ? grammar_dn (str) : grammar_lcstate (str);
+		}
+		measure (in->is_dn ? "grammar_dn" : "grammar_lcstate", in->kind, len, (now_ns () - t0) / repeats);
+		if ((in->expect >= 0) && (ok != (in->expect == 1))) {
+			fprintf (stderr, "Grammar %s %s input %u of %zu bytes\n",
+					ok ? "accepted" : "rejected", in->kind, i, len);
+			failed++;
+		}
+		// Move through the words, with find_type() and idlen()
+		if (!in->is_dn) {
+			t0 = now_ns ();
+			for (r=0; r<repeats; r++) {
+				run_words (str);
+			}
+			measure ("find_type", in->kind, len, (now_ns () - t0) / repeats);
+		}
+		free (str);
+	}
+	printf ("%-16s %-9s %7s %9s %9s %11s %s\n", "function", "input", "count", "bytes",
+			"ns/byte", "worst", "(at bytes)");
+	unsigned mi;
+	for (mi=0; mi<measurecnt; mi++) {
+		struct measure *msr = &measures [mi];
+		printf ("%-16s %-9s %7u %9lu %9.3f %11.3f (%zu)\n", msr->func, msr->kind,
+				msr->inputs, (unsigned long) msr->bytes,
+				(double) msr->ns / msr->bytes, msr->worst, msr->worstlen);
+	}
+	for (i=0; i<inputcnt; i++) {
+		free (corpus [i].der);
+	}
+	free (corpus);
+	exit ((failed == 0) ? 0 : 1);
+}
+
+
+#endif /* FUZZING */
@@ -0,0 +1,232 @@
+/* Benchmark the timer schedule of the service thread.
+ *
+ * One lcenv is populated with lcobjects that each hold one timer, with
+ * one of these distributions:
+ *
+ *  - uniform spreads the timers evenly over the firing window;
+ *  - cluster lets all timers expire in the same second;
+ *  - far puts nine in ten timers far into the future, beyond the hot
+ *    tier of the schedule, and spreads the rest over the firing window.
+ *
+ * The timers fire through plugin_lag, which measures the wake latency
+ * from the timestamp of each timer to its dispatch.  We report that
+ * with percentiles, along with the CPU time of the service thread per
+ * round of service_main(), during the window and while idle afterwards.
+ * Any scheduler behind service_update_timers() can be measured this way.
+ *
+ * Usage: bench_scheduler -p plugin_lag.so [-n objects] [-d distribution]
+ *                        [-l lead] [-w window] [-i idle] [-c batch]
+ *
+ * The lead is the time in seconds before the first timers are due, which
+ * should cover the time to load them.  Timers that are already due when
+ * loading finishes are counted as overdue; they still fire.
+ *
+ * Build without DEBUG for meaningful numbers.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "lifecycle.h"
+#include "test_util.h"
+#include <steamworks/pulleyback.h>
+
+
+typedef uint64_t plugin_lag_fired_t (void);
+typedef unsigned plugin_lag_percentile_t (double);
+
+
+/* Decide the timestamp for object i out of n, and whether it is due in
+ * the firing window starting at base.
+ */
+static time_t gen_time (char dist, uint64_t i, uint64_t n, time_t base, time_t window, bool *due) {
+	*due = true;
+	switch (dist) {
+	case 'c':
+		return base;
+	case 'f':
+		if (i % 10 != 0) {
+			*due = false;
+			return base + SCHED_HORIZON + (time_t) (i * (365 * 86400.0) / n);
+		}
+		/* fallthrough */
+	default:
+		return base + (time_t) (i * (double) window / n);
+	}
+}
+
+
+/* Sample the CPU time of the service thread and its number of rounds.
+ */
+static void sample (struct lcenv *lce, double *cpu, uint64_t *rounds) {
+	clockid_t cid;
+	struct timespec ts;
+	if ((pthread_getcpuclockid (lce->pth_service, &cid) != 0) ||
+			(clock_gettime (cid, &ts) != 0)) {
+		ts.tv_sec = ts.tv_nsec = 0;
+	}
+	*cpu = ts.tv_sec + ts.tv_nsec / 1e9;
+	pthread_mutex_lock (&lce->pth_rounds);
+	*rounds = lce->cnt_rounds;
+	pthread_mutex_unlock (&lce->pth_rounds);
+}
+
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s -p plugin_lag.so [-n objects] [-d uniform|cluster|far] [-l lead] [-w window] [-i idle] [-c batch]\n", prog);
+	exit (1);
+}
+
+
+int main (int argc, char **argv) {
+	uint64_t objects = 1000000;
+	uint64_t batch = 10000;
+	char dist = 'u';
+	time_t lead = 0;
+	time_t window = 10;
+	unsigned idle = 3;
+	char *plugin = NULL;
+	int opt;
+	while ((opt = getopt (argc, argv, "p:n:d:l:w:i:c:")) != -1) {
+		switch (opt) {
+		case 'p':
+			plugin = optarg;
+			break;
+		case 'n':
+			objects = strtoull (optarg, NULL, 10);
+			break;
+		case 'd':
+			dist = *optarg;
+			break;
+		case 'l':
+			lead = atol (optarg);
+			break;
+		case 'w':
+			window = atol (optarg);
+			break;
+		case 'i':
+			idle = atoi (optarg);
+			break;
+		case 'c':
+			batch = strtoull (optarg, NULL, 10);
+			break;
+		default:
+			usage (argv [0]);
+		}
+	}
+	if ((plugin == NULL) || (objects == 0) || (batch == 0) || (window <= 0) ||
+			(strchr ("ucf", dist) == NULL)) {
+		usage (argv [0]);
+	}
+	if (lead == 0) {
+		lead = 2 + objects / 100000;
+	}
+	//
+	// Open the backend with the plugin and find its results
+	//
+	char driver [1024];
+	snprintf (driver, sizeof (driver), "bench,plugin=%s", plugin);
+	char *drivers [] = { argv [0], driver, NULL };
+	struct lcenv *lce = pulleyback_open (2, drivers, 2);
+	if (lce == NULL) {
+		fprintf (stderr, "Failed to open Pulley Backend\n");
+		exit (1);
+	}
+	void *dlh = dlopen (plugin, RTLD_NOW | RTLD_NOLOAD);
+	plugin_lag_fired_t *fired;
+	plugin_lag_percentile_t *percentile;
+	*(void **) &fired      = (dlh == NULL) ? NULL : dlsym (dlh, "plugin_lag_fired");
+	*(void **) &percentile = (dlh == NULL) ? NULL : dlsym (dlh, "plugin_lag_percentile");
+	if ((fired == NULL) || (percentile == NULL)) {
+		fprintf (stderr, "Plugin %s does not measure lag\n", plugin);
+		exit (1);
+	}
+	//
+	// Load the timers in transactions
+	//
+	uint8_t der_dn [128];
+	uint8_t der_lcs [128];
+	uint8_t *fork [] = { der_dn, der_lcs };
+	char dn [100];
+	char lcs [100];
+	time_t base = time (NULL) + lead;
+	uint64_t due = 0;
+	double start = now_secs ();
+	uint64_t i;
+	for (i=0; i<objects; i++) {
+		bool isdue;
+		time_t tim = gen_time (dist, i, objects, base, window, &isdue);
+		due += isdue ? 1 : 0;
+		snprintf (dn,  sizeof (dn),  "cn=timer%lu,dc=example,dc=nep", (unsigned long) i);
+		snprintf (lcs, sizeof (lcs), "bench . fire@%lu", (unsigned long) tim);
+		der_string (der_dn,  dn );
+		der_string (der_lcs, lcs);
+		pulleyback_add (lce, fork);
+		if (((i + 1) % batch == 0) || (i + 1 == objects)) {
+			if (pulleyback_commit (lce) == 0) {
+				fprintf (stderr, "Commit failed after object %lu\n", (unsigned long) i);
+			}
+		}
+	}
+	double loaded = now_secs () - start;
+	time_t loadend = time (NULL);
+	uint64_t overdue = 0;
+	if (loadend > base) {
+		for (i=0; i<objects; i++) {
+			bool isdue;
+			if (gen_time (dist, i, objects, base, window, &isdue) < loadend) {
+				overdue++;
+			}
+		}
+	}
+	printf ("load: %lu objects in %.3f s, %lu due in %ld s window, %lu overdue\n",
+			(unsigned long) objects, loaded, (unsigned long) due,
+			(long) window, (unsigned long) overdue);
+	//
+	// Let the due timers fire, or give up well after the window
+	//
+	double cpu0, cpu1;
+	uint64_t rnd0, rnd1;
+	sample (lce, &cpu0, &rnd0);
+	time_t giveup = base + window + 5;
+	while ((fired () < due) && (time (NULL) < giveup)) {
+		usleep (10000);
+	}
+	sample (lce, &cpu1, &rnd1);
+	uint64_t done = fired ();
+	uint64_t rounds = (rnd1 > rnd0) ? (rnd1 - rnd0) : 1;
+	printf ("fire: %lu of %lu timers fired, %lu rounds, %.3f ms CPU per round, %.3f s CPU\n",
+			(unsigned long) done, (unsigned long) due,
+			(unsigned long) (rnd1 - rnd0), 1e3 * (cpu1 - cpu0) / rounds, cpu1 - cpu0);
+	printf ("fire: lag p50 %u ms, p90 %u ms, p99 %u ms, p99.9 %u ms, max %u ms\n",
+			percentile (50), percentile (90), percentile (99),
+			percentile (99.9), percentile (100));
+	struct lifecycle_histogram hst;
+	if (pulleyback_lifecycle_histogram (lce, LIFECYCLE_HIST_LAG, 0, &hst)) {
+		printf ("fire: backend lag p50 %.3f ms, p99 %.3f ms, max %.3f ms over %lu dispatches\n",
+				lifecycle_histogram_percentile (&hst, 50) / 1e6,
+				lifecycle_histogram_percentile (&hst, 99) / 1e6,
+				lifecycle_histogram_percentile (&hst, 100) / 1e6,
+				(unsigned long) hst.count);
+	}
+	//
+	// Measure the service thread while no timers are due
+	//
+	sample (lce, &cpu0, &rnd0);
+	sleep (idle);
+	sample (lce, &cpu1, &rnd1);
+	printf ("idle: %u s, %lu rounds, %.3f ms CPU\n",
+			idle, (unsigned long) (rnd1 - rnd0), 1e3 * (cpu1 - cpu0));
+	pulleyback_close (lce);
+	dlclose (dlh);
+	exit ((done == due) ? 0 : 1);
+}
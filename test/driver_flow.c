@@ -0,0 +1,791 @@
+/* Run driver processes, and check what becomes of the dispatches to them.
+ *
+ * The drivers are instances of driver_test, which logs every dispatch
+ * and answers it as told by the lifecycleState.
+ * The backend runs on a simulated clock, so the times at which lcstates
+ * fire again can be checked exactly.  Answers and driver processes are
+ * real though, so they are waited for, up to WAIT_SECS of real time.
+ *
+ * Usage: driver_flow driver_test scenario
+ *
+ * The scenarios are:
+ *  - affinity checks that the dispatches for a distinguishedName all go
+ *    to one worker of a pool, in the order in which they fire.
+ *  - verdicts checks that the answers "ok", "fail" and "retry-after=N"
+ *    set the time at which the lcstate fires again.
+ *  - restart checks that a killed worker is restarted, and is sent the
+ *    dispatch that it did not answer.
+ *  - frames checks that frames carry the distinguishedName, lifecycleState,
+ *    event and attempt, and that framed answers are applied.
+ *  - lease checks that a dispatch is not sent again when its lcobject
+ *    changes, until its lease expires.
+ *  - shm checks that records in the shared memory ring carry the
+ *    distinguishedName and lifecycleState, and that answers are applied.
+ *  - deferral checks that dispatches are deferred while a driver does not
+ *    read, that other lifecycles keep firing meanwhile, and that deferral
+ *    ends when the driver catches up.
+ *  - lazy checks that a lazy driver starts with its first dispatch, and
+ *    that an idle worker is retired and started again for new work.
+ *  - shared checks that two lcenvs share one driver process, also for
+ *    another lifecycle name, and that it keeps serving one after the
+ *    other closes.
+ *  - catchup checks that overdue lcstates fire oldest-first and at a
+ *    bounded rate after the wall clock jumps forward, until they are done.
+ *
+ * Every scenario logs to driver-<scenario>.log in the current directory.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lifecycle.h"
+#include "test_util.h"
+#include <steamworks/pulleyback.h>
+
+
+// A fixed start, so that every run sees the same times
+//
+#define SIM_START	1700000000
+
+// The real time to wait for drivers
+//
+#define WAIT_SECS	10
+
+
+static struct lifecycle_clock_sim sim;
+static char *driver;
+static char logpath [256];
+static int failed = 0;
+
+
+static void check (bool ok, char *fmt, ...) {
+	if (ok) {
+		return;
+	}
+	va_list args;
+	va_start (args, fmt);
+	fprintf (stderr, "FAIL: ");
+	vfprintf (stderr, fmt, args);
+	fprintf (stderr, "\n");
+	va_end (args);
+	failed++;
+}
+
+
+/* The wall clock time on the simulated clock of the lcenvs.
+ */
+static time_t clock_secs (void) {
+	return sim.clk.realtime_ns (&sim.clk) / 1000000000;
+}
+
+
+/* Advance the simulated clock, and let the lcenv fire what became due.
+ */
+static void pass (struct lcenv *lce, unsigned secs) {
+	lifecycle_clock_sim_advance (&sim, secs * (uint64_t) 1000000000);
+	pulleyback_lifecycle_sync (lce);
+}
+
+
+/* Open an lcenv with the given driver arguments.
+ */
+static struct lcenv *open_lcenv (int argc, char **args) {
+	char *argv [argc + 2];
+	argv [0] = "driver_flow";
+	memcpy (argv + 1, args, argc * sizeof (char *));
+	argv [argc + 1] = NULL;
+	lifecycle_clock_use (&sim.clk);
+	struct lcenv *lce = pulleyback_open (argc + 1, argv, 2);
+	lifecycle_clock_use (NULL);
+	if (lce == NULL) {
+		perror ("Failed to open Pulley Backend");
+		exit (1);
+	}
+	return lce;
+}
+
+
+/* Open an lcenv with driver_test for lifecycle x, with the given options
+ * for the lcdriver and for driver_test.
+ */
+static struct lcenv *open_driver (char *lcdopts, char *drvopts) {
+	char arg [1024];
+	snprintf (arg, sizeof (arg), "x%s=%s %s %s", lcdopts, driver, drvopts, logpath);
+	char *args [] = { arg };
+	return open_lcenv (1, args);
+}
+
+
+/* Add a fork in the current transaction, or add it in a transaction
+ * of its own.
+ */
+static void fork_add (struct lcenv *lce, char *dn, char *lcs) {
+	uint8_t der_dn [strlen (dn) + 4];
+	uint8_t der_lcs [strlen (lcs) + 4];
+	uint8_t *fork [] = { der_dn, der_lcs };
+	der_string (der_dn,  dn );
+	der_string (der_lcs, lcs);
+	if (pulleyback_add (lce, fork) == 0) {
+		fprintf (stderr, "Failed to add %s for %s\n", lcs, dn);
+		exit (1);
+	}
+}
+//
+static void fork_add_commit (struct lcenv *lce, char *dn, char *lcs) {
+	fork_add (lce, dn, lcs);
+	if (pulleyback_commit (lce) == 0) {
+		fprintf (stderr, "Failed to commit %s for %s\n", lcs, dn);
+		exit (1);
+	}
+}
+
+
+/* A line logged by driver_test.
+ */
+struct logline {
+	int pid;
+	unsigned event;
+	unsigned attempt;
+	char dn [128];
+	char lcs [128];
+};
+
+
+/* Read the lines logged so far into *lines, which must be freed.
+ * Return the number of lines.
+ */
+static unsigned log_read (struct logline **lines) {
+	*lines = NULL;
+	FILE *log = fopen (logpath, "r");
+	if (log == NULL) {
+		return 0;
+	}
+	unsigned count = 0;
+	unsigned alloc = 0;
+	struct logline line;
+	while (fscanf (log, "%d\t%u\t%u\t%127[^\t]\t%127[^\n]\n",
+			&line.pid, &line.event, &line.attempt, line.dn, line.lcs) == 5) {
+		if (count == alloc) {
+			alloc = (alloc == 0) ? 64 : 2 * alloc;
+			*lines = realloc (*lines, alloc * sizeof (struct logline));
+			if (*lines == NULL) {
+				perror ("Failed to read the log");
+				exit (1);
+			}
+		}
+		(*lines) [count++] = line;
+	}
+	fclose (log);
+	return count;
+}
+
+
+/* Count the lines logged for a distinguishedName, or for all of them
+ * when it is NULL, and return the last of them in *last, if it is not
+ * NULL.
+ */
+static unsigned log_count (char *dn, struct logline *last) {
+	struct logline *lines;
+	unsigned total = log_read (&lines);
+	unsigned count = 0;
+	unsigned i;
+	for (i=0; i<total; i++) {
+		if ((dn == NULL) || (strcmp (lines [i].dn, dn) == 0)) {
+			count++;
+			if (last != NULL) {
+				*last = lines [i];
+			}
+		}
+	}
+	free (lines);
+	return count;
+}
+
+
+/* Wait until the log holds at least the given number of lines for a
+ * distinguishedName, or for all when it is NULL, or until WAIT_SECS
+ * passed.  Return the number of
+ * lines.
+ */
+static unsigned log_wait (struct lcenv *lce, char *dn, unsigned lines, struct logline *last) {
+	double deadline = now_secs () + WAIT_SECS;
+	unsigned count;
+	while (pulleyback_lifecycle_sync (lce),
+			count = log_count (dn, last),
+			(count < lines) && (now_secs () < deadline)) {
+		usleep (10000);
+	}
+	return count;
+}
+
+
+/* Give the driver a moment to log what it was sent.  Return the number
+ * of lines for the distinguishedName, or for all when it is NULL, which
+ * is expected not to grow anymore.
+ */
+static unsigned log_settle (struct lcenv *lce, char *dn) {
+	pulleyback_lifecycle_sync (lce);
+	usleep (200000);
+	pulleyback_lifecycle_sync (lce);
+	return log_count (dn, NULL);
+}
+
+
+/* Return the time at which an lcstate fires next, or 0 when it is not
+ * found.  This looks into the lcenv while it is locked.
+ */
+static time_t peek_firetime (struct lcenv *lce, char *dn, char *lcs) {
+	time_t tim = 0;
+	pthread_mutex_lock (&lce->pth_envown);
+	struct lcobject *lco = lce->lco_first;
+	while ((lco != NULL) && (strcmp (lco->txt_dn, dn) != 0)) {
+		lco = lco->lco_next;
+	}
+	struct lcstate *lcs_found = (lco == NULL) ? NULL : lco->lcs_first;
+	while ((lcs_found != NULL) && (strcmp (lcs_found->txt_attr, lcs) != 0)) {
+		lcs_found = lcs_found->lcs_next;
+	}
+	if (lcs_found != NULL) {
+		tim = lcs_found->tim_next;
+	}
+	pthread_mutex_unlock (&lce->pth_envown);
+	return tim;
+}
+
+
+/* Wait until an lcstate that fired no earlier than since fires next after
+ * the expected number of seconds, or until WAIT_SECS passed.  It fired
+ * before now, which bounds the time at which it fires next.  Return
+ * whether the expected time was reached.
+ */
+static bool firetime_wait (struct lcenv *lce, char *dn, char *lcs, time_t since, time_t secs) {
+	double deadline = now_secs () + WAIT_SECS;
+	time_t tim;
+	while (tim = peek_firetime (lce, dn, lcs),
+			(tim < since + secs) || (tim > clock_secs () + secs)) {
+		if (now_secs () >= deadline) {
+			return false;
+		}
+		usleep (10000);
+	}
+	return true;
+}
+
+
+/* What the tests look at in the first lcdriver of an lcenv, and its
+ * first lcworker.
+ */
+struct driver_peek {
+	uint32_t restarts;
+	uint64_t deferred;
+	uint32_t congested;
+	pid_t    pid;
+	uint32_t flags;
+};
+
+
+/* Look into the first lcdriver of an lcenv while it is locked.
+ */
+static void peek_driver (struct lcenv *lce, struct driver_peek *dp) {
+	pthread_mutex_lock (&lce->pth_envown);
+	struct lcdriver *lcd = &lce->lcd_cmds [0];
+	dp->restarts  = lcd->cnt_restarts;
+	dp->deferred  = lcd->cnt_deferred;
+	dp->congested = lcd->cnt_congested;
+	dp->pid       = lcd->lcw_workers [0].cmdpid;
+	dp->flags     = lcd->lcw_workers [0].lcw_flags;
+	pthread_mutex_unlock (&lce->pth_envown);
+}
+
+
+/* Dispatches for one distinguishedName go to one worker of a pool, in the
+ * order in which they fire.  Every lcobject has a few lcstates that are
+ * due a second apart, and without answers they are retried later on.
+ * The lcobjects are spread over the workers.
+ */
+#define AFFINITY_DNS	12
+#define AFFINITY_SEQ	3
+static void scenario_affinity (void) {
+	struct lcenv *lce = open_driver (",workers:3", "");
+	char dn [AFFINITY_DNS] [100];
+	char lcs [AFFINITY_DNS] [AFFINITY_SEQ] [100];
+	time_t since = clock_secs ();
+	int i, j;
+	for (i=0; i<AFFINITY_DNS; i++) {
+		snprintf (dn [i], sizeof (dn [i]), "cn=affinity%d,dc=nep", i);
+		for (j=0; j<AFFINITY_SEQ; j++) {
+			snprintf (lcs [i] [j], sizeof (lcs [i] [j]), "x seq=%d . ev@%d", j, (int) since + j + 1);
+			fork_add (lce, dn [i], lcs [i] [j]);
+		}
+	}
+	if (pulleyback_commit (lce) == 0) {
+		fprintf (stderr, "Failed to commit the lcstates\n");
+		exit (1);
+	}
+	// Wait until the last lcstate of every lcobject was dispatched
+	struct logline *lines = NULL;
+	unsigned total = 0;
+	int seen = 0;
+	double deadline = now_secs () + WAIT_SECS;
+	while ((seen < AFFINITY_DNS) && (now_secs () < deadline)) {
+		pass (lce, 1);
+		usleep (100000);
+		free (lines);
+		total = log_read (&lines);
+		seen = 0;
+		for (i=0; i<AFFINITY_DNS; i++) {
+			unsigned k;
+			for (k=0; k<total; k++) {
+				if ((strcmp (lines [k].dn, dn [i]) == 0) &&
+						(strcmp (lines [k].lcs, lcs [i] [AFFINITY_SEQ - 1]) == 0)) {
+					seen++;
+					break;
+				}
+			}
+		}
+	}
+	check (seen == AFFINITY_DNS, "Only %d of %d lcobjects were dispatched completely", seen, AFFINITY_DNS);
+	// Check the process and order of the dispatches for every lcobject
+	int pids [AFFINITY_DNS];
+	int distinct = 0;
+	for (i=0; i<AFFINITY_DNS; i++) {
+		int pid = 0;
+		int first [AFFINITY_SEQ];
+		for (j=0; j<AFFINITY_SEQ; j++) {
+			first [j] = -1;
+		}
+		unsigned k;
+		for (k=0; k<total; k++) {
+			if (strcmp (lines [k].dn, dn [i]) != 0) {
+				continue;
+			}
+			if (pid == 0) {
+				pid = lines [k].pid;
+			}
+			check (lines [k].pid == pid, "Dispatches for %s went to processes %d and %d", dn [i], pid, lines [k].pid);
+			for (j=0; j<AFFINITY_SEQ; j++) {
+				if ((first [j] < 0) && (strcmp (lines [k].lcs, lcs [i] [j]) == 0)) {
+					first [j] = k;
+				}
+			}
+		}
+		for (j=1; j<AFFINITY_SEQ; j++) {
+			check (first [j - 1] < first [j], "Dispatches for %s arrived out of order", dn [i]);
+		}
+		for (j=0; (j<distinct) && (pids [j] != pid); j++) {
+			;
+		}
+		if (j == distinct) {
+			pids [distinct++] = pid;
+		}
+	}
+	check (distinct > 1, "All dispatches went to one process of the pool");
+	free (lines);
+	pulleyback_close (lce);
+}
+
+
+/* The answers of a driver set the time at which the lcstate fires again.
+ * An "ok" waits DRIVER_OKWAIT for LDAP, a "fail" takes the exponential
+ * fallback, which is 1 second at first, and "retry-after=N" waits N.
+ */
+static void scenario_verdicts (void) {
+	struct lcenv *lce = open_driver (",ack", "-a");
+	char *dn [3] = { "cn=ok,dc=nep", "cn=fail,dc=nep", "cn=retry,dc=nep" };
+	char *ans [3] = { "ok", "fail", "retry-after=3" };
+	time_t wait [3] = { DRIVER_OKWAIT, 1, 3 };
+	char lcs [3] [100];
+	time_t since = clock_secs ();
+	int i;
+	for (i=0; i<3; i++) {
+		snprintf (lcs [i], sizeof (lcs [i]), "x ans=%s . ev@%d", ans [i], (int) since);
+		fork_add_commit (lce, dn [i], lcs [i]);
+	}
+	for (i=0; i<3; i++) {
+		check (log_wait (lce, dn [i], 1, NULL) >= 1,
+				"Dispatch for %s did not arrive", dn [i]);
+		check (firetime_wait (lce, dn [i], lcs [i], since, wait [i]),
+				"Answer %s did not set the fire time %d seconds ahead", ans [i], (int) wait [i]);
+	}
+	// The retry fires again after 3 seconds, and not before
+	pass (lce, 1);
+	check (log_settle (lce, dn [2]) == 1, "Answer %s fired again before its time", ans [2]);
+	pass (lce, 2);
+	check (log_wait (lce, dn [2], 2, NULL) == 2, "Answer %s did not fire again in time", ans [2]);
+	// The ok is still waiting for LDAP
+	check (log_count (dn [0], NULL) == 1, "Answer %s fired again before LDAP could reply", ans [0]);
+	pulleyback_close (lce);
+}
+
+
+/* A worker that dies is restarted after a second on the lcenv clock, and
+ * is then sent the dispatches that it did not answer.
+ */
+static void scenario_restart (void) {
+	struct lcenv *lce = open_driver (",ack", "-a");
+	char *dn = "cn=restart,dc=nep";
+	char lcs [100];
+	snprintf (lcs, sizeof (lcs), "x ans=none . ev@%d", (int) clock_secs ());
+	fork_add_commit (lce, dn, lcs);
+	struct logline first;
+	if (log_wait (lce, dn, 1, &first) != 1) {
+		check (false, "Dispatch for %s did not arrive", dn);
+		pulleyback_close (lce);
+		return;
+	}
+	kill (first.pid, SIGKILL);
+	// Let time pass until the worker is restarted
+	struct driver_peek dp;
+	double deadline = now_secs () + WAIT_SECS;
+	while (peek_driver (lce, &dp),
+			(dp.restarts == 0) && (now_secs () < deadline)) {
+		pass (lce, 1);
+		usleep (10000);
+	}
+	check (dp.restarts == 1, "Worker was restarted %d times, not once", (int) dp.restarts);
+	struct logline again;
+	check (log_wait (lce, dn, 2, &again) == 2, "Dispatch for %s was not sent again", dn);
+	check (again.pid != first.pid, "Dispatch for %s was sent again to the killed worker", dn);
+	check (strcmp (again.lcs, lcs) == 0, "Dispatch for %s was sent again as %s", dn, again.lcs);
+	pulleyback_close (lce);
+}
+
+
+/* Frames arrive at the driver with the distinguishedName and lifecycleState
+ * as they were added, and the answers in frames are applied to them.  The
+ * word ans=... counts as the first event, so ev is the second.
+ */
+static void scenario_frames (void) {
+	struct lcenv *lce = open_driver (",ack,frames", "-a -f");
+	char *dn = "cn=frames,dc=nep";
+	char lcs [100];
+	time_t since = clock_secs ();
+	snprintf (lcs, sizeof (lcs), "x ans=retry-after=3 . ev@%d", (int) since);
+	fork_add_commit (lce, dn, lcs);
+	struct logline line;
+	check (log_wait (lce, dn, 1, &line) == 1, "Frame for %s did not arrive", dn);
+	check (strcmp (line.lcs, lcs) == 0, "Frame for %s arrived as %s", dn, line.lcs);
+	check (line.event == 1, "Frame for %s is for event %u, not 1", dn, line.event);
+	check (line.attempt == 1, "Frame for %s is attempt %u, not 1", dn, line.attempt);
+	check (firetime_wait (lce, dn, lcs, since, 3),
+			"Framed answer did not set the fire time 3 seconds ahead");
+	pulleyback_close (lce);
+}
+
+
+/* A dispatch to a driver without answers is leased, and is not sent again
+ * when a commit changes its lcobject after the exponential fallback has
+ * passed.  It is sent again when the lease expires.
+ */
+static void scenario_lease (void) {
+	struct lcenv *lce = open_driver (",lease:4", "");
+	char *dn = "cn=lease,dc=nep";
+	char lcs [100];
+	char later [100];
+	time_t since = clock_secs ();
+	snprintf (lcs,   sizeof (lcs),   "x . ev@%d",    (int) since);
+	snprintf (later, sizeof (later), "x . later@%d", (int) since + 1000);
+	fork_add_commit (lce, dn, lcs);
+	check (log_wait (lce, dn, 1, NULL) == 1, "Dispatch for %s did not arrive", dn);
+	pass (lce, 2);
+	fork_add_commit (lce, dn, later);
+	check (log_settle (lce, dn) == 1, "Dispatch for %s was sent again after a commit", dn);
+	pass (lce, 2);
+	check (log_wait (lce, dn, 2, NULL) == 2, "Dispatch for %s was not sent again after its lease", dn);
+	pulleyback_close (lce);
+}
+
+
+/* Records in the shared memory ring arrive at the driver with the
+ * distinguishedName and lifecycleState as they were added, and the answers
+ * to them are applied.
+ */
+static void scenario_shm (void) {
+	struct lcenv *lce = open_driver (",ack,shm", "-a -m");
+	char *dn [2] = { "cn=shm1,dc=nep", "cn=shm2,dc=nep" };
+	char *ans [2] = { "ok", "retry-after=3" };
+	time_t wait [2] = { DRIVER_OKWAIT, 3 };
+	char lcs [2] [100];
+	time_t since = clock_secs ();
+	int i;
+	for (i=0; i<2; i++) {
+		snprintf (lcs [i], sizeof (lcs [i]), "x ans=%s . ev@%d", ans [i], (int) since);
+		fork_add_commit (lce, dn [i], lcs [i]);
+	}
+	for (i=0; i<2; i++) {
+		struct logline line;
+		check (log_wait (lce, dn [i], 1, &line) == 1, "Record for %s did not arrive", dn [i]);
+		check (strcmp (line.lcs, lcs [i]) == 0, "Record for %s arrived as %s", dn [i], line.lcs);
+		check (line.event == 1, "Record for %s is for event %u, not 1", dn [i], line.event);
+		check (line.attempt == 1, "Record for %s is attempt %u, not 1", dn [i], line.attempt);
+		check (firetime_wait (lce, dn [i], lcs [i], since, wait [i]),
+				"Answer %s did not set the fire time %d seconds ahead", ans [i], (int) wait [i]);
+	}
+	pulleyback_close (lce);
+}
+
+
+/* A driver that stops reading makes its worker congested once the pipe
+ * is full and the queue reaches the high watermark.  Dispatches are
+ * deferred until the queue drains below the low watermark, while another
+ * lifecycle on the same lcenv keeps firing.  The dispatches are leased,
+ * so they are not sent again while the driver catches up.
+ */
+#define DEFERRAL_DNS	400
+static void scenario_deferral (void) {
+	char argx [1024];
+	char argy [1024];
+	snprintf (argx, sizeof (argx), "x,high:2000,low:500=%s -s %s", driver, logpath);
+	snprintf (argy, sizeof (argy), "y=%s %s", driver, logpath);
+	char *args [] = { argx, argy };
+	struct lcenv *lce = open_lcenv (2, args);
+	char dn [100];
+	char lcs [100];
+	time_t since = clock_secs ();
+	snprintf (lcs, sizeof (lcs), "x . ev@%d", (int) since);
+	// Stop the driver after its first dispatch
+	struct logline stall;
+	fork_add_commit (lce, "cn=stall,dc=nep", lcs);
+	if (log_wait (lce, "cn=stall,dc=nep", 1, &stall) != 1) {
+		check (false, "Dispatch for cn=stall,dc=nep did not arrive");
+		pulleyback_close (lce);
+		return;
+	}
+	kill (stall.pid, SIGSTOP);
+	int i;
+	for (i=0; i<DEFERRAL_DNS; i++) {
+		snprintf (dn, sizeof (dn), "cn=%d,ou=deferral,dc=nep", i);
+		fork_add (lce, dn, lcs);
+	}
+	if (pulleyback_commit (lce) == 0) {
+		fprintf (stderr, "Failed to commit the lcstates\n");
+		kill (stall.pid, SIGCONT);
+		exit (1);
+	}
+	struct driver_peek dp;
+	double deadline = now_secs () + WAIT_SECS;
+	while (peek_driver (lce, &dp),
+			((dp.deferred == 0) || (dp.congested == 0)) && (now_secs () < deadline)) {
+		pass (lce, 1);
+		usleep (10000);
+	}
+	check (dp.congested > 0, "Worker did not become congested");
+	check (dp.deferred > 0, "No dispatches were deferred");
+	// The other lifecycle is not held up
+	char lcsy [100];
+	snprintf (lcsy, sizeof (lcsy), "y . ev@%d", (int) clock_secs ());
+	fork_add_commit (lce, "cn=other,dc=nep", lcsy);
+	check (log_wait (lce, "cn=other,dc=nep", 1, NULL) >= 1, "Lifecycle y was held up by lifecycle x");
+	// Continue the driver, and wait until it got every dispatch
+	kill (stall.pid, SIGCONT);
+	struct logline *lines = NULL;
+	unsigned total, done = 0;
+	deadline = now_secs () + 6 * WAIT_SECS;
+	while ((done < DEFERRAL_DNS) && (now_secs () < deadline)) {
+		pass (lce, 1);
+		usleep (10000);
+		total = log_read (&lines);
+		done = 0;
+		unsigned k;
+		for (k=0; k<total; k++) {
+			if (strstr (lines [k].dn, ",ou=deferral,") != NULL) {
+				done++;
+			}
+		}
+		free (lines);
+	}
+	check (done == DEFERRAL_DNS, "Only %u of %d deferred dispatches arrived", done, DEFERRAL_DNS);
+	// Deferral has ended
+	peek_driver (lce, &dp);
+	uint64_t deferred = dp.deferred;
+	pass (lce, 2);
+	log_settle (lce, "cn=stall,dc=nep");
+	peek_driver (lce, &dp);
+	check (dp.deferred == deferred, "Dispatches were still deferred after the driver caught up");
+	check ((dp.flags & LCW_CONGESTED) == 0, "Worker is still congested after the driver caught up");
+	pulleyback_close (lce);
+}
+
+
+/* A lazy driver has no process until its first dispatch, which is held
+ * while it starts.  After idle_secs without work, the worker is retired,
+ * and it is started again for the next dispatch.
+ */
+static void scenario_lazy (void) {
+	struct lcenv *lce = open_driver (",ack,lazy,idle:2", "-a");
+	char *dn [2] = { "cn=lazy1,dc=nep", "cn=lazy2,dc=nep" };
+	char lcs [100];
+	struct driver_peek dp;
+	peek_driver (lce, &dp);
+	check (dp.pid <= 0, "Lazy driver started process %d before its first dispatch", (int) dp.pid);
+	snprintf (lcs, sizeof (lcs), "x . ev@%d", (int) clock_secs ());
+	fork_add_commit (lce, dn [0], lcs);
+	struct logline first;
+	if (log_wait (lce, dn [0], 1, &first) != 1) {
+		check (false, "Dispatch for %s did not arrive", dn [0]);
+		pulleyback_close (lce);
+		return;
+	}
+	// Let time pass until the worker is retired and reaped
+	double deadline = now_secs () + WAIT_SECS;
+	while (peek_driver (lce, &dp),
+			(dp.pid > 0) && (now_secs () < deadline)) {
+		pass (lce, 1);
+		usleep (10000);
+	}
+	check ((dp.flags & LCW_IDLE) != 0, "Worker was not retired");
+	check ((dp.pid <= 0) && (kill (first.pid, 0) == -1) && (errno == ESRCH),
+			"Retired process %d was not reaped", first.pid);
+	snprintf (lcs, sizeof (lcs), "x . ev@%d", (int) clock_secs ());
+	fork_add_commit (lce, dn [1], lcs);
+	struct logline again;
+	check (log_wait (lce, dn [1], 1, &again) == 1, "Dispatch for %s did not arrive after retirement", dn [1]);
+	check (again.pid != first.pid, "Dispatch after retirement went to the retired process %d", first.pid);
+	pulleyback_close (lce);
+}
+
+
+/* Two lcenvs with the shared option send to the same driver process, and
+ * the answers return to the lcenv that sent the dispatch.  They share it
+ * for other lifecycle names, and with the options in another order.
+ * After one of them closes, the other continues to use the driver.
+ */
+static void scenario_shared (void) {
+	struct lcenv *lce1 = open_driver (",shared,ack", "-a");
+	char arg [1024];
+	snprintf (arg, sizeof (arg), "y,ack,shared=%s -a %s", driver, logpath);
+	char *args [] = { arg };
+	struct lcenv *lce2 = open_lcenv (1, args);
+	char *dn [3] = { "cn=shared1,dc=nep", "cn=shared2,dc=nep", "cn=shared3,dc=nep" };
+	char lcs1 [100];
+	char lcs [100];
+	time_t since = clock_secs ();
+	snprintf (lcs1, sizeof (lcs1), "x . ev@%d", (int) since);
+	snprintf (lcs,  sizeof (lcs),  "y . ev@%d", (int) since);
+	fork_add_commit (lce1, dn [0], lcs1);
+	fork_add_commit (lce2, dn [1], lcs);
+	struct logline line1, line2, line3;
+	check (log_wait (lce1, dn [0], 1, &line1) == 1, "Dispatch for %s did not arrive", dn [0]);
+	check (log_wait (lce2, dn [1], 1, &line2) == 1, "Dispatch for %s did not arrive", dn [1]);
+	check (line1.pid == line2.pid, "Dispatches went to processes %d and %d", line1.pid, line2.pid);
+	check (firetime_wait (lce1, dn [0], lcs1, since, DRIVER_OKWAIT),
+			"Answer for %s was not applied", dn [0]);
+	check (firetime_wait (lce2, dn [1], lcs, since, DRIVER_OKWAIT),
+			"Answer for %s was not applied", dn [1]);
+	pulleyback_close (lce1);
+	fork_add_commit (lce2, dn [2], lcs);
+	check (log_wait (lce2, dn [2], 1, &line3) == 1, "Dispatch for %s did not arrive after a close", dn [2]);
+	check (line3.pid == line2.pid, "Dispatch after a close went to process %d, not %d", line3.pid, line2.pid);
+	check (firetime_wait (lce2, dn [2], lcs, since, DRIVER_OKWAIT),
+			"Answer for %s was not applied after a close", dn [2]);
+	pulleyback_close (lce2);
+}
+
+
+/* After a jump of the wall clock, overdue lcstates fire in catch-up mode.
+ * That is at most CATCHUP_BURST every CATCHUP_PAUSE, oldest-first, until
+ * the backlog has drained.  The lcstates are due in another order than
+ * they are added, and they are leased, so they do not fire again.
+ */
+#define CATCHUP_DNS	250
+static void scenario_catchup (void) {
+	struct lcenv *lce = open_driver ("", "");
+	time_t since = clock_secs ();
+	int i;
+	for (i=0; i<CATCHUP_DNS; i++) {
+		char dn [100];
+		char lcs [100];
+		snprintf (dn,  sizeof (dn),  "cn=catchup%d,dc=nep", i);
+		snprintf (lcs, sizeof (lcs), "x . ev@%d", (int) since + 60 + (i * 97) % CATCHUP_DNS);
+		fork_add (lce, dn, lcs);
+	}
+	if (pulleyback_commit (lce) == 0) {
+		fprintf (stderr, "Failed to commit the lcstates\n");
+		exit (1);
+	}
+	pass (lce, 1);
+	check (log_settle (lce, NULL) == 0, "Dispatches before the wall clock jumped");
+	lifecycle_clock_sim_jump (&sim, 3600 * (int64_t) 1000000000);
+	// Every round fires one burst, and nothing more until the pause passed
+	struct lifecycle_stats sts;
+	unsigned expect = 0;
+	while (expect < CATCHUP_DNS) {
+		if (expect == 0) {
+			pulleyback_lifecycle_sync (lce);
+		} else {
+			pass (lce, CATCHUP_PAUSE);
+		}
+		expect += (CATCHUP_DNS - expect < CATCHUP_BURST) ? (CATCHUP_DNS - expect) : CATCHUP_BURST;
+		unsigned count = log_wait (lce, NULL, expect, NULL);
+		check (count == expect, "Catch-up dispatched %u instead of %u", count, expect);
+		count = log_settle (lce, NULL);
+		check (count == expect, "Catch-up dispatched %u instead of %u before its pause", count, expect);
+		pulleyback_lifecycle_stats (lce, &sts);
+		check (sts.catching_up == (expect < CATCHUP_DNS), "Catch-up mode is %s after %u dispatches",
+				sts.catching_up ? "on" : "off", expect);
+		check (sts.late == CATCHUP_DNS - expect, "Catch-up has %lu late instead of %u",
+				(unsigned long) sts.late, CATCHUP_DNS - expect);
+		if (count != expect) {
+			break;
+		}
+	}
+	check (sts.catchups == 1, "Catch-up mode started %lu times", (unsigned long) sts.catchups);
+	// The dispatches came oldest-first
+	struct logline *lines;
+	unsigned total = log_read (&lines);
+	unsigned k;
+	for (k=1; k<total; k++) {
+		check (atoi (strstr (lines [k - 1].lcs, "ev@") + 3) < atoi (strstr (lines [k].lcs, "ev@") + 3),
+				"Catch-up dispatched %s before %s", lines [k - 1].lcs, lines [k].lcs);
+	}
+	free (lines);
+	pulleyback_close (lce);
+}
+
+
+int main (int argc, char **argv) {
+	if (argc != 3) {
+		fprintf (stderr, "Usage: %s driver_test scenario\n", argv [0]);
+		exit (1);
+	}
+	driver = argv [1];
+	snprintf (logpath, sizeof (logpath), "driver-%s.log", argv [2]);
+	unlink (logpath);
+	lifecycle_clock_sim_init (&sim, SIM_START);
+	if (strcmp (argv [2], "affinity") == 0) {
+		scenario_affinity ();
+	} else if (strcmp (argv [2], "verdicts") == 0) {
+		scenario_verdicts ();
+	} else if (strcmp (argv [2], "restart") == 0) {
+		scenario_restart ();
+	} else if (strcmp (argv [2], "frames") == 0) {
+		scenario_frames ();
+	} else if (strcmp (argv [2], "lease") == 0) {
+		scenario_lease ();
+	} else if (strcmp (argv [2], "shm") == 0) {
+		scenario_shm ();
+	} else if (strcmp (argv [2], "deferral") == 0) {
+		scenario_deferral ();
+	} else if (strcmp (argv [2], "lazy") == 0) {
+		scenario_lazy ();
+	} else if (strcmp (argv [2], "shared") == 0) {
+		scenario_shared ();
+	} else if (strcmp (argv [2], "catchup") == 0) {
+		scenario_catchup ();
+	} else {
+		fprintf (stderr, "Unknown scenario %s\n", argv [2]);
+		exit (1);
+	}
+	printf ("%s: %d failures\n", argv [2], failed);
+	exit ((failed == 0) ? 0 : 1);
+}
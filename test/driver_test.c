@@ -0,0 +1,263 @@
+/* A driver for tests, which logs what it is sent and may answer it.
+ *
+ * Every dispatch is appended to the log file as one line, with the
+ * process id of the driver, the event index and the attempt count if
+ * they were sent or else 0, the distinguishedName and the lifecycleState,
+ * separated by tabs.  The log is flushed after every line, so that a
+ * test can follow it while the driver runs.
+ *
+ * With -a the driver answers every dispatch, as drivers with the ack
+ * option must.  The answer is the value of a word "ans=..." in the
+ * lifecycleState, or "ok" without one.  The answer "none" is not sent,
+ * so the dispatch stays in flight.
+ *
+ * With -f the dispatches are read as frames, and answered with frames,
+ * as drivers with the frames option must.
+ *
+ * With -m the dispatches are taken from the shared memory ring on file
+ * descriptor 3 when the doorbell on 4 rings, as drivers with the shm
+ * option must.  The driver finishes when standard input closes.
+ *
+ * With -s the pipe on standard input is shrunk to a single page, so that
+ * backpressure builds up after a few dispatches when the driver is
+ * stopped.
+ *
+ * Usage: driver_test [-a] [-f] [-m] [-s] logfile
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lifecycle_driver.h"
+
+
+static FILE *logfile;
+static bool ack = false;
+static bool frames = false;
+static bool shm = false;
+
+
+/* Find the answer for a lifecycleState in its word "ans=...", or "ok".
+ */
+static void answer_for (char *lcs, char *ans, size_t anssz) {
+	char *word = strstr (lcs, " ans=");
+	if (word == NULL) {
+		snprintf (ans, anssz, "ok");
+		return;
+	}
+	word += 5;
+	snprintf (ans, anssz, "%.*s", (int) strcspn (word, " "), word);
+}
+
+
+/* Write all of a buffer to the connection, or exit.
+ */
+static void write_all (char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t done = write (1, buf, len);
+		if (done <= 0) {
+			exit (1);
+		}
+		buf += done;
+		len -= done;
+	}
+}
+
+
+/* Read all of a buffer from the connection.  Return false at the end.
+ */
+static bool read_all (int fd, void *buf, size_t len) {
+	while (len > 0) {
+		ssize_t done = read (fd, buf, len);
+		if (done <= 0) {
+			return false;
+		}
+		buf = (uint8_t *) buf + done;
+		len -= done;
+	}
+	return true;
+}
+
+
+/* Log a dispatch, and answer it when so desired.
+ */
+static void take (uint32_t id, uint16_t event, uint16_t attempt, char *dn, char *lcs) {
+	fprintf (logfile, "%d\t%u\t%u\t%s\t%s\n", (int) getpid (), event, attempt, dn, lcs);
+	fflush (logfile);
+	if (!ack) {
+		return;
+	}
+	char ans [64];
+	answer_for (lcs, ans, sizeof (ans));
+	if (strcmp (ans, "none") == 0) {
+		return;
+	}
+	if (frames) {
+		uint32_t hdr [2];
+		hdr [0] = htonl (4 + strlen (ans));
+		hdr [1] = htonl (id);
+		write_all ((char *) hdr, sizeof (hdr));
+		write_all (ans, strlen (ans));
+	} else {
+		strcat (ans, "\n");
+		write_all (ans, strlen (ans));
+	}
+}
+
+
+/* Read pairs of lines until the connection closes.
+ */
+static void run_lines (void) {
+	char *dn = NULL;
+	char *lcs = NULL;
+	size_t dnsz = 0;
+	size_t lcssz = 0;
+	ssize_t dnlen, lcslen;
+	while (((dnlen  = getline (&dn,  &dnsz,  stdin)) > 0) &&
+	       ((lcslen = getline (&lcs, &lcssz, stdin)) > 0)) {
+		dn  [dnlen  - 1] = '\0';
+		lcs [lcslen - 1] = '\0';
+		take (0, 0, 0, dn, lcs);
+	}
+	free (dn);
+	free (lcs);
+}
+
+
+/* Split a frame after its header into the distinguishedName and the
+ * lifecycleState, and take it.
+ */
+static void take_frame (struct lcframe *hdr, char *body) {
+	uint16_t dnlen  = ntohs (hdr->frm_dnlen );
+	uint16_t lcslen = ntohs (hdr->frm_lcslen);
+	char dn  [dnlen  + 1];
+	char lcs [lcslen + 1];
+	memcpy (dn,  body,         dnlen );
+	memcpy (lcs, body + dnlen, lcslen);
+	dn  [dnlen ] = '\0';
+	lcs [lcslen] = '\0';
+	take (ntohl (hdr->frm_id), ntohs (hdr->frm_event), ntohs (hdr->frm_attempt), dn, lcs);
+}
+
+
+/* Read frames until the connection closes.
+ */
+static void run_frames (void) {
+	struct lcframe hdr;
+	char body [2 * 65536];
+	while (read_all (0, &hdr, sizeof (hdr))) {
+		size_t bodylen = ntohl (hdr.frm_len) + sizeof (hdr.frm_len) - sizeof (hdr);
+		if ((bodylen > sizeof (body)) || !read_all (0, body, bodylen)) {
+			exit (1);
+		}
+		take_frame (&hdr, body);
+	}
+}
+
+
+/* Take the records from the shared memory ring whenever the doorbell
+ * rings, until standard input closes.
+ */
+static void run_shm (void) {
+	struct stat st;
+	if (fstat (3, &st) == -1) {
+		exit (1);
+	}
+	struct lcshm *ring = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, 3, 0);
+	if ((ring == MAP_FAILED) || (ring->shm_magic != LCSHM_MAGIC)) {
+		exit (1);
+	}
+	char *recs = (char *) (ring + 1);
+	uint64_t tail = ring->shm_tail;
+	struct pollfd pfd [2] = { { .fd = 0, .events = POLLIN }, { .fd = 4, .events = POLLIN } };
+	bool eof = false;
+	while (!eof) {
+		if (poll (pfd, 2, -1) == -1) {
+			continue;
+		}
+		if ((pfd [1].revents & POLLIN) != 0) {
+			eventfd_t rings;
+			eventfd_read (4, &rings);
+		}
+		if ((pfd [0].revents & (POLLIN | POLLHUP)) != 0) {
+			char buf [256];
+			eof = (read (0, buf, sizeof (buf)) <= 0);
+		}
+		uint64_t head = __atomic_load_n (&ring->shm_head, __ATOMIC_ACQUIRE);
+		while (tail != head) {
+			uint32_t ofs = tail % ring->shm_size;
+			struct lcframe *hdr = (struct lcframe *) (recs + ofs);
+			if (hdr->frm_len == 0) {
+				tail += ring->shm_size - ofs;
+				continue;
+			}
+			take_frame (hdr, (char *) (hdr + 1));
+			tail += LCSHM_RECSIZE (ntohl (hdr->frm_len));
+		}
+		__atomic_store_n (&ring->shm_tail, tail, __ATOMIC_RELEASE);
+	}
+	munmap (ring, st.st_size);
+}
+
+
+int main (int argc, char **argv) {
+	int opt;
+	bool shrink = false;
+	while ((opt = getopt (argc, argv, "afms")) != -1) {
+		switch (opt) {
+		case 'a':
+			ack = true;
+			break;
+		case 'f':
+			frames = true;
+			break;
+		case 'm':
+			shm = true;
+			break;
+		case 's':
+			shrink = true;
+			break;
+		default:
+			fprintf (stderr, "Usage: %s [-a] [-f] [-m] [-s] logfile\n", argv [0]);
+			exit (1);
+		}
+	}
+	if (optind + 1 != argc) {
+		fprintf (stderr, "Usage: %s [-a] [-f] [-m] [-s] logfile\n", argv [0]);
+		exit (1);
+	}
+	if (shrink && (fcntl (0, F_SETPIPE_SZ, getpagesize ()) == -1)) {
+		perror ("Failed to shrink the pipe");
+		exit (1);
+	}
+	logfile = fopen (argv [optind], "a");
+	if (logfile == NULL) {
+		perror (argv [optind]);
+		exit (1);
+	}
+	if (shm) {
+		run_shm ();
+	} else if (frames) {
+		run_frames ();
+	} else {
+		run_lines ();
+	}
+	fclose (logfile);
+	exit (0);
+}
@@ -16,6 +16,8 @@ void debug_lcstate (struct lcstate *lcs, char *what_to_do);
 struct lcobject *new_lcobject (char *dn, size_t dnlen);
 void debug_lcobject (struct lcobject *lco);
 
+bool advance_lcobject_events (struct lcobject *lco);
+
 
 
 static void debug (char *fmt, ...) {
@@ -45,5 +47,36 @@ int main (int argc, char **argv) {
 	debug ("Dumping the lifecycleObject with added lifecycleState");
 	debug_lcobject (lco);
 	//TODO// freeing
+	//
+	// An event "a?ev" waits for the past of lifecycle a to hold "ev"
+	debug ("Advancing over an event in the past of another lifecycle");
+	int failed = 0;
+	struct lcobject *lco2 = new_lcobject (s_dn, strlen (s_dn));
+	char *s_a = "a ev@1 . more@";
+	char *s_b = "b . a?ev fin@";
+	char *s_c = "c . a?more fin@";
+	struct lcstate *lcs_a = new_lcstate (lco2, s_a, strlen (s_a));
+	struct lcstate *lcs_b = new_lcstate (lco2, s_b, strlen (s_b));
+	struct lcstate *lcs_c = new_lcstate (lco2, s_c, strlen (s_c));
+	lco2->lcs_first = lco2->lcs_toadd;
+	lco2->lcs_toadd = NULL;
+	if (!advance_lcobject_events (lco2)) {
+		debug ("Nothing advanced, though a?ev is in the past of a");
+		failed++;
+	}
+	if ((lcs_b->typ_next != '@') || (strcmp (lcs_b->txt_attr + lcs_b->ofs_next, "fin@") != 0)) {
+		debug ("Lifecycle b did not advance to fin@");
+		failed++;
+	}
+	if ((lcs_c->typ_next != '?') || (strcmp (lcs_c->txt_attr + lcs_c->ofs_next, "a?more fin@") != 0)) {
+		debug ("Lifecycle c advanced, though a?more is in the future of a");
+		failed++;
+	}
+	if ((lcs_a->typ_next != '@') || advance_lcobject_events (lco2)) {
+		debug ("Advancing again changed something");
+		failed++;
+	}
+	debug_lcobject (lco2);
+	exit ((failed == 0) ? 0 : 1);
 }
 
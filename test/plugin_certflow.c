@@ -0,0 +1,95 @@
+/* plugin_certflow -- a plugin driver that queues firings for a test.
+ *
+ * Every firing is appended to a queue and accepted, so the lcstate will
+ * wait for LDAP to update it.  The queue is shared by all lifecycles
+ * that load this plugin, and it is taken from by bench_certflow, which
+ * finds plugin_certflow_take() with dlsym() and plays the part of the
+ * drivers and of LDAP.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "lifecycle_plugin.h"
+
+
+struct plugin_certflow {
+	struct plugin_certflow *next;
+	char *dn;
+	char *lcs;
+	unsigned event;
+};
+
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct plugin_certflow *queue_first = NULL;
+static struct plugin_certflow **queue_last = &queue_first;
+
+
+bool lifecycle_plugin_init (void **plugin, const char *lifecycle, const char *config) {
+	(void) lifecycle;
+	(void) config;
+	*plugin = NULL;
+	return true;
+}
+
+
+int lifecycle_plugin_fire (void *plugin, const char *dn, const char *lcs,
+				unsigned event, unsigned attempt) {
+	(void) plugin;
+	(void) attempt;
+	struct plugin_certflow *pcf = malloc (sizeof (struct plugin_certflow));
+	if (pcf == NULL) {
+		return LIFECYCLE_PLUGIN_FAIL;
+	}
+	pcf->next = NULL;
+	pcf->dn = strdup (dn);
+	pcf->lcs = strdup (lcs);
+	pcf->event = event;
+	if ((pcf->dn == NULL) || (pcf->lcs == NULL)) {
+		free (pcf->dn);
+		free (pcf->lcs);
+		free (pcf);
+		return LIFECYCLE_PLUGIN_FAIL;
+	}
+	pthread_mutex_lock (&queue_lock);
+	*queue_last = pcf;
+	queue_last = &pcf->next;
+	pthread_mutex_unlock (&queue_lock);
+	return LIFECYCLE_PLUGIN_OK;
+}
+
+
+void lifecycle_plugin_fini (void *plugin) {
+	(void) plugin;
+}
+
+
+/* Take the oldest firing from the queue, if any.  The distinguishedName
+ * and lifecycleState must be freed by the caller.
+ * Return whether a firing was taken.
+ */
+bool plugin_certflow_take (char **dn, char **lcs, unsigned *event) {
+	pthread_mutex_lock (&queue_lock);
+	struct plugin_certflow *pcf = queue_first;
+	if (pcf != NULL) {
+		queue_first = pcf->next;
+		if (queue_first == NULL) {
+			queue_last = &queue_first;
+		}
+	}
+	pthread_mutex_unlock (&queue_lock);
+	if (pcf == NULL) {
+		return false;
+	}
+	*dn = pcf->dn;
+	*lcs = pcf->lcs;
+	*event = pcf->event;
+	free (pcf);
+	return true;
+}
@@ -0,0 +1,95 @@
+/* plugin_lag -- a plugin driver that measures how late timers fire.
+ *
+ * Every firing compares the current time with the timestamp of the
+ * event that fired, and counts the lag in a histogram of milliseconds.
+ * Only the first attempt is counted; later attempts are retries.
+ *
+ * The results are read by bench_scheduler, which finds the functions
+ * plugin_lag_fired() and plugin_lag_percentile() with dlsym().
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "lifecycle_plugin.h"
+
+
+#define LAG_BUCKETS	65536
+
+
+static uint64_t lag_fired;
+static uint64_t lag_ms [LAG_BUCKETS];
+
+
+bool lifecycle_plugin_init (void **plugin, const char *lifecycle, const char *config) {
+	(void) lifecycle;
+	(void) config;
+	*plugin = NULL;
+	return true;
+}
+
+
+int lifecycle_plugin_fire (void *plugin, const char *dn, const char *lcs,
+				unsigned event, unsigned attempt) {
+	(void) plugin;
+	(void) dn;
+	(void) event;
+	if (attempt > 1) {
+		return LIFECYCLE_PLUGIN_OK;
+	}
+	struct timespec now;
+	clock_gettime (CLOCK_REALTIME, &now);
+	const char *stamp = strstr (lcs, " . ");
+	stamp = (stamp == NULL) ? NULL : strchr (stamp, '@');
+	int64_t lag = 0;
+	if (stamp != NULL) {
+		lag = ((int64_t) now.tv_sec - strtoll (stamp + 1, NULL, 10)) * 1000
+		    + now.tv_nsec / 1000000;
+	}
+	if (lag < 0) {
+		lag = 0;
+	} else if (lag >= LAG_BUCKETS) {
+		lag = LAG_BUCKETS - 1;
+	}
+	lag_ms [lag]++;
+	__atomic_store_n (&lag_fired, lag_fired + 1, __ATOMIC_RELEASE);
+	return LIFECYCLE_PLUGIN_OK;
+}
+
+
+void lifecycle_plugin_fini (void *plugin) {
+	(void) plugin;
+}
+
+
+/* Return the number of timers that fired for the first time.
+ */
+uint64_t plugin_lag_fired (void) {
+	return __atomic_load_n (&lag_fired, __ATOMIC_ACQUIRE);
+}
+
+
+/* Return the lag in milliseconds at a percentile of the first firings.
+ * This may be called when the timers have stopped firing.
+ */
+unsigned plugin_lag_percentile (double pct) {
+	uint64_t total = plugin_lag_fired ();
+	uint64_t want = (uint64_t) (pct * total / 100.0);
+	if ((want >= total) && (total > 0)) {
+		want = total - 1;
+	}
+	uint64_t seen = 0;
+	unsigned ms;
+	for (ms=0; ms<LAG_BUCKETS-1; ms++) {
+		seen += lag_ms [ms];
+		if (seen > want) {
+			break;
+		}
+	}
+	return ms;
+}
@@ -0,0 +1,52 @@
+/* plugin_null -- a plugin driver that logs and accepts every firing.
+ *
+ * The config text, if any, is a number of seconds after which to retry,
+ * instead of accepting the firing.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <syslog.h>
+
+#include "lifecycle_plugin.h"
+
+
+struct plugin_null {
+	const char *lifecycle;
+	int verdict;
+	unsigned long fired;
+};
+
+
+bool lifecycle_plugin_init (void **plugin, const char *lifecycle, const char *config) {
+	struct plugin_null *pn = calloc (1, sizeof (struct plugin_null));
+	if (pn == NULL) {
+		return false;
+	}
+	pn->lifecycle = lifecycle;
+	pn->verdict = (*config != '\0') ? atoi (config) : LIFECYCLE_PLUGIN_OK;
+	*plugin = pn;
+	printf ("Plugin initialised for lifecycle %s\n", lifecycle);
+	return true;
+}
+
+
+int lifecycle_plugin_fire (void *plugin, const char *dn, const char *lcs,
+				unsigned event, unsigned attempt) {
+	struct plugin_null *pn = plugin;
+	pn->fired++;
+	syslog (LOG_INFO, "Plugin for %s fired event %u attempt %u: %s for %s",
+			pn->lifecycle, event, attempt, lcs, dn);
+	return pn->verdict;
+}
+
+
+void lifecycle_plugin_fini (void *plugin) {
+	struct plugin_null *pn = plugin;
+	printf ("Plugin for lifecycle %s fired %lu times\n", pn->lifecycle, pn->fired);
+	free (pn);
+}
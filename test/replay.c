@@ -0,0 +1,222 @@
+/* Replay a trace of calls to the PulleyBack.
+ *
+ * A trace is recorded by setting the environment variable
+ * PULLEYBACK_LIFECYCLE_RECORD to a file name before the PulleyBack is
+ * opened, as described for struct lcrecord.  This program makes the same
+ * calls again, as fast as possible or at the original pace, and compares
+ * their results with the ones that were recorded.
+ *
+ * Usage: replay [-p] [-s standin] trace
+ *
+ * With -p the original pace is kept.  With -s the commands of all the
+ * drivers are replaced with the standin, such as "cat >/dev/null", so
+ * that a trace from production can be replayed without its drivers.
+ *
+ * The exit code is 0 when all results matched, and 1 otherwise.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lifecycle.h"
+#include <steamworks/pulleyback.h>
+
+
+size_t der_size (uint8_t *der);
+
+
+static const char *call_names [] = {
+	"?", "open", "close", "add", "del", "reset",
+	"prepare", "commit", "rollback", "collaborate"
+};
+
+
+static uint64_t now_ns (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * (uint64_t) 1000000000 + ts.tv_nsec;
+}
+
+
+/* Open the PulleyBack with the traced arguments, after replacing the
+ * driver commands with the standin, if one is given.
+ */
+static void *replay_open (char *data, uint32_t len, char *standin) {
+	uint32_t varc;
+	memcpy (&varc, data, sizeof (varc));
+	char *args = data + sizeof (varc);
+	char *end = data + len;
+	int argc = 0;
+	char *argv [256];
+	char *copies [256];
+	while ((args < end) && (argc < 256)) {
+		argv [argc] = args;
+		copies [argc] = NULL;
+		char *eq = strchr (args, '=');
+		if ((argc > 0) && (standin != NULL) && (eq != NULL)) {
+			size_t keep = eq + 1 - args;
+			copies [argc] = malloc (keep + strlen (standin) + 1);
+			if (copies [argc] == NULL) {
+				fprintf (stderr, "Out of memory\n");
+				exit (1);
+			}
+			memcpy (copies [argc], args, keep);
+			strcpy (copies [argc] + keep, standin);
+			argv [argc] = copies [argc];
+		}
+		args += strlen (args) + 1;
+		argc++;
+	}
+	void *pbh = pulleyback_open (argc, argv, varc);
+	while (argc-- > 0) {
+		free (copies [argc]);
+	}
+	return pbh;
+}
+
+
+int main (int argc, char **argv) {
+	bool paced = false;
+	char *standin = NULL;
+	int opt;
+	while ((opt = getopt (argc, argv, "ps:")) != -1) {
+		switch (opt) {
+		case 'p':
+			paced = true;
+			break;
+		case 's':
+			standin = optarg;
+			break;
+		default:
+			fprintf (stderr, "Usage: %s [-p] [-s standin] trace\n", argv [0]);
+			exit (1);
+		}
+	}
+	if (optind + 1 != argc) {
+		fprintf (stderr, "Usage: %s [-p] [-s standin] trace\n", argv [0]);
+		exit (1);
+	}
+	FILE *trace = fopen (argv [optind], "rb");
+	uint32_t head [2];
+	if ((trace == NULL) || (fread (head, sizeof (head), 1, trace) != 1) ||
+			(head [0] != LCREC_MAGIC) || (head [1] != LCREC_VERSION)) {
+		fprintf (stderr, "No trace in %s\n", argv [optind]);
+		exit (1);
+	}
+	static void *envs [UINT16_MAX + 1];
+	uint64_t calls [LCREC_COLLABORATE + 1];
+	memset (calls, 0, sizeof (calls));
+	uint64_t mismatches = 0;
+	size_t datamax = 0;
+	uint8_t *data = NULL;
+	uint64_t start = now_ns ();
+	struct lcrecord rec;
+	while (fread (&rec, sizeof (rec), 1, trace) == 1) {
+		if (rec.rec_len > datamax) {
+			datamax = rec.rec_len;
+			data = realloc (data, datamax);
+			if (data == NULL) {
+				fprintf (stderr, "Out of memory\n");
+				exit (1);
+			}
+		}
+		if ((rec.rec_len > 0) && (fread (data, rec.rec_len, 1, trace) != 1)) {
+			fprintf (stderr, "Trace ends halfway a record\n");
+			break;
+		}
+		if ((rec.rec_type < LCREC_OPEN) || (rec.rec_type > LCREC_COLLABORATE)) {
+			fprintf (stderr, "Unknown record type %d in trace\n", rec.rec_type);
+			exit (1);
+		}
+		if (paced) {
+			uint64_t now = now_ns () - start;
+			if (rec.rec_time > now) {
+				uint64_t delay = rec.rec_time - now;
+				struct timespec ts = { delay / 1000000000, delay % 1000000000 };
+				nanosleep (&ts, NULL);
+			}
+		}
+		void *pbh = envs [rec.rec_env];
+		if ((rec.rec_type != LCREC_OPEN) && (pbh == NULL)) {
+			fprintf (stderr, "Call %s on unknown handle %d\n", call_names [rec.rec_type], rec.rec_env);
+			mismatches++;
+			continue;
+		}
+		der_t fork [2];
+		uint16_t other;
+		int rv = 1;
+		switch (rec.rec_type) {
+		case LCREC_OPEN:
+			pbh = replay_open ((char *) data, rec.rec_len, standin);
+			rv = (pbh != NULL);
+			if (rec.rec_env != 0) {
+				envs [rec.rec_env] = pbh;
+			} else if (pbh != NULL) {
+				pulleyback_close (pbh);
+			}
+			break;
+		case LCREC_CLOSE:
+			pulleyback_close (pbh);
+			envs [rec.rec_env] = NULL;
+			break;
+		case LCREC_ADD:
+		case LCREC_DEL:
+			fork [0] = data;
+			fork [1] = data + der_size (data);
+			rv = (rec.rec_type == LCREC_ADD) ? pulleyback_add (pbh, fork) : pulleyback_del (pbh, fork);
+			break;
+		case LCREC_RESET:
+			rv = pulleyback_reset (pbh);
+			break;
+		case LCREC_PREPARE:
+			rv = pulleyback_prepare (pbh);
+			break;
+		case LCREC_COMMIT:
+			rv = pulleyback_commit (pbh);
+			break;
+		case LCREC_ROLLBACK:
+			pulleyback_rollback (pbh);
+			break;
+		case LCREC_COLLABORATE:
+			memcpy (&other, data, sizeof (other));
+			if (envs [other] == NULL) {
+				fprintf (stderr, "Collaboration with unknown handle %d\n", other);
+				mismatches++;
+				continue;
+			}
+			rv = pulleyback_collaborate (pbh, envs [other]);
+			break;
+		}
+		calls [rec.rec_type]++;
+		if (rv != rec.rec_result) {
+			fprintf (stderr, "Call %s on handle %d returned %d, recorded %d\n",
+					call_names [rec.rec_type], rec.rec_env, rv, rec.rec_result);
+			mismatches++;
+		}
+	}
+	double secs = (now_ns () - start) / 1e9;
+	uint64_t total = 0;
+	int type;
+	for (type=LCREC_OPEN; type<=LCREC_COLLABORATE; type++) {
+		if (calls [type] > 0) {
+			printf ("%s: %lu calls\n", call_names [type], (unsigned long) calls [type]);
+		}
+		total += calls [type];
+	}
+	printf ("replay: %lu calls in %.3f s, %.0f calls/s, %lu mismatches\n",
+			(unsigned long) total, secs, total / secs, (unsigned long) mismatches);
+	for (type=0; type<=UINT16_MAX; type++) {
+		if (envs [type] != NULL) {
+			pulleyback_close (envs [type]);
+		}
+	}
+	fclose (trace);
+	free (data);
+	exit ((mismatches == 0) ? 0 : 1);
+}
@@ -0,0 +1,203 @@
+/* Run the timer schedule on a simulated clock.
+ *
+ * One lcenv is populated with lcobjects that each hold one timer, spread
+ * over a number of simulated days.  The simulated clock then advances in
+ * steps, and after every step the service thread is synchronised with
+ * pulleyback_lifecycle_sync().  Exactly the timers that were due by then
+ * must have fired through plugin_lag, no more and no less, so every run
+ * fires the same timers in the same steps.  The forks that fired are then
+ * deleted, as LDAP would do when the lifecycle moves on, so they do not
+ * fire again.
+ *
+ * We report how many simulated days passed per second of real time, and
+ * the CPU time of the service thread per step.
+ *
+ * Usage: sim_clock -p plugin_lag.so [-n objects] [-d days] [-s step]
+ *
+ * The step is given in seconds of simulated time.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "lifecycle.h"
+#include "test_util.h"
+#include <steamworks/pulleyback.h>
+
+
+typedef uint64_t plugin_lag_fired_t (void);
+
+
+// A fixed start, so that every run sees the same times
+//
+#define SIM_START	1700000000
+
+
+/* Generate fork number i, with a timestamp scattered over the simulated
+ * days.  Return the timestamp.
+ */
+static time_t gen_fork (uint64_t i, uint64_t days, uint8_t *der_dn, uint8_t *der_lcs) {
+	char dn [100];
+	char lcs [100];
+	time_t tim = SIM_START + 1 + (time_t) ((i * 7919) % (days * 86400));
+	snprintf (dn,  sizeof (dn),  "cn=timer%lu,dc=example,dc=nep", (unsigned long) i);
+	snprintf (lcs, sizeof (lcs), "sim . fire@%lu", (unsigned long) tim);
+	der_string (der_dn,  dn );
+	der_string (der_lcs, lcs);
+	return tim;
+}
+
+
+static double service_cpu (struct lcenv *lce) {
+	clockid_t cid;
+	struct timespec ts;
+	if ((pthread_getcpuclockid (lce->pth_service, &cid) != 0) ||
+			(clock_gettime (cid, &ts) != 0)) {
+		return 0;
+	}
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void usage (char *prog) {
+	fprintf (stderr, "Usage: %s -p plugin_lag.so [-n objects] [-d days] [-s step]\n", prog);
+	exit (1);
+}
+
+
+int main (int argc, char **argv) {
+	uint64_t objects = 100000;
+	uint64_t days = 365;
+	uint64_t step = 3600;
+	char *plugin = NULL;
+	int opt;
+	while ((opt = getopt (argc, argv, "p:n:d:s:")) != -1) {
+		switch (opt) {
+		case 'p':
+			plugin = optarg;
+			break;
+		case 'n':
+			objects = strtoull (optarg, NULL, 10);
+			break;
+		case 'd':
+			days = strtoull (optarg, NULL, 10);
+			break;
+		case 's':
+			step = strtoull (optarg, NULL, 10);
+			break;
+		default:
+			usage (argv [0]);
+		}
+	}
+	if ((plugin == NULL) || (objects == 0) || (days == 0) || (step == 0)) {
+		usage (argv [0]);
+	}
+	//
+	// Open the backend on the simulated clock
+	//
+	struct lifecycle_clock_sim sim;
+	lifecycle_clock_sim_init (&sim, SIM_START);
+	lifecycle_clock_use (&sim.clk);
+	char driver [1024];
+	snprintf (driver, sizeof (driver), "sim,plugin=%s", plugin);
+	char *drivers [] = { argv [0], driver, NULL };
+	struct lcenv *lce = pulleyback_open (2, drivers, 2);
+	lifecycle_clock_use (NULL);
+	if (lce == NULL) {
+		fprintf (stderr, "Failed to open Pulley Backend\n");
+		exit (1);
+	}
+	void *dlh = dlopen (plugin, RTLD_NOW | RTLD_NOLOAD);
+	plugin_lag_fired_t *fired;
+	*(void **) &fired = (dlh == NULL) ? NULL : dlsym (dlh, "plugin_lag_fired");
+	if (fired == NULL) {
+		fprintf (stderr, "Plugin %s does not count firings\n", plugin);
+		exit (1);
+	}
+	//
+	// Load the timers, and sort them by the step in which they are due
+	//
+	uint64_t steps = (days * 86400 + step) / step;
+	uint64_t *due = calloc (steps + 2, sizeof (uint64_t));
+	uint64_t *order = calloc (objects, sizeof (uint64_t));
+	if ((due == NULL) || (order == NULL)) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	uint8_t der_dn [128];
+	uint8_t der_lcs [128];
+	uint8_t *fork [] = { der_dn, der_lcs };
+	uint64_t i;
+	for (i=0; i<objects; i++) {
+		time_t tim = gen_fork (i, days, der_dn, der_lcs);
+		due [(tim - SIM_START + step - 1) / step + 1]++;
+		pulleyback_add (lce, fork);
+		if (((i + 1) % 10000 == 0) || (i + 1 == objects)) {
+			if (pulleyback_commit (lce) == 0) {
+				fprintf (stderr, "Commit failed after object %lu\n", (unsigned long) i);
+			}
+		}
+	}
+	uint64_t s;
+	for (s=1; s<=steps+1; s++) {
+		due [s] += due [s-1];
+	}
+	for (i=0; i<objects; i++) {
+		time_t tim = gen_fork (i, days, der_dn, der_lcs);
+		order [due [(tim - SIM_START + step - 1) / step]++] = i;
+	}
+	//
+	// Step through the simulated days, checking what fired
+	//
+	double start = now_secs ();
+	double cpu = service_cpu (lce);
+	uint64_t expected = 0;
+	uint64_t mismatches = 0;
+	for (s=0; s<=steps; s++) {
+		if (s > 0) {
+			lifecycle_clock_sim_advance (&sim, step * (uint64_t) 1000000000);
+		}
+		if (!pulleyback_lifecycle_sync (lce)) {
+			perror ("Failed to sync");
+			exit (1);
+		}
+		// After sorting, due [s] is where the next step starts
+		uint64_t upto = due [s];
+		if (fired () != upto) {
+			if (mismatches++ < 10) {
+				fprintf (stderr, "After %lu s, %lu timers fired instead of %lu\n",
+						(unsigned long) (s * step),
+						(unsigned long) fired (), (unsigned long) upto);
+			}
+		}
+		// Delete what fired, as LDAP would
+		for (; expected < upto; expected++) {
+			gen_fork (order [expected], days, der_dn, der_lcs);
+			pulleyback_del (lce, fork);
+		}
+		if (pulleyback_commit (lce) == 0) {
+			fprintf (stderr, "Commit failed after step %lu\n", (unsigned long) s);
+		}
+	}
+	double secs = now_secs () - start;
+	cpu = service_cpu (lce) - cpu;
+	printf ("sim: %lu timers over %lu days in %lu steps, %lu fired, %lu mismatches\n",
+			(unsigned long) objects, (unsigned long) days, (unsigned long) (steps + 1),
+			(unsigned long) fired (), (unsigned long) mismatches);
+	printf ("sim: %.3f s real time, %.0f simulated days/s, %.3f ms CPU per step\n",
+			secs, days / secs, 1e3 * cpu / (steps + 1));
+	pulleyback_close (lce);
+	dlclose (dlh);
+	free (order);
+	free (due);
+	exit ((mismatches == 0) ? 0 : 1);
+}
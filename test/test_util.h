@@ -0,0 +1,49 @@
+/* Helpers shared by the test and benchmark programs.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+
+/* Encode a string as a DER OCTET STRING, as Pulley passes the values of
+ * its variables.  The length takes the short form below 128 bytes and
+ * the long form otherwise, so buf must hold strlen (str) + 4 bytes.
+ * Strings of 64 kB or more are not supported.
+ */
+static inline void der_string (uint8_t *buf, char *str) {
+	size_t len = strlen (str);
+	buf [0] = 0x04;
+	if (len < 128) {
+		buf [1] = len;
+		memcpy (buf + 2, str, len);
+	} else if (len < 256) {
+		buf [1] = 0x81;
+		buf [2] = len;
+		memcpy (buf + 3, str, len);
+	} else {
+		buf [1] = 0x82;
+		buf [2] = len >> 8;
+		buf [3] = len & 0xff;
+		memcpy (buf + 4, str, len);
+	}
+}
+
+
+/* Return the monotonic time in seconds, to measure real time spans.
+ */
+static inline double now_secs (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+#endif /* TEST_UTIL_H */